@@ -1,19 +1,27 @@
 #!/usr/bin/env python3
 
-import binascii
+import argparse
+import ctypes
 import os
-import subprocess
+import socket
+import struct
 import sys
-import time
-import json
 
 import numpy as np
 from PIL import Image
 
-# Adjust these paths to match where your maps are pinned.
-INPUT_MAP_PATH = "/sys/fs/bpf/mnist_input"
-OUTPUT_MAP_PATH = "/sys/fs/bpf/mnist_output"
-TRACE_PIPE = "/sys/kernel/debug/tracing/trace_pipe"
+# Must match kerinferencel.h and libkerinfer.h
+INPUT_SIZE = 784
+OUTPUT_SIZE = 10
+KERINFER_DEFAULT_PIN_DIR = "/sys/fs/bpf/kerinferencel"
+KERINFER_F_MMAP = 1 << 0
+KERINFER_F_RINGBUF = 1 << 1
+MNIST_UDP_DEFAULT_PORT = 7840
+# struct mnist_udp_request and struct mnist_udp_reply, in network byte order
+UDP_REQUEST_ID = struct.Struct("!I")
+UDP_REPLY = struct.Struct(f"!II{OUTPUT_SIZE}i")
+
+DEFAULT_TIMEOUT_MS = 1000
 
 
 def load_image(image_path):
@@ -25,115 +33,172 @@ def load_image(image_path):
     return flat
 
 
-def update_map(map_path, key, data_bytes):
-    # The key is a 4-byte little-endian value.
-    key_hex = key.to_bytes(4, byteorder="little").hex()
-    data_hex = binascii.hexlify(data_bytes).decode("ascii")
-    cmd = [
-        "bpftool",
-        "map",
-        "update",
-        "pinned",
-        map_path,
-        "key",
-        key_hex,
-        "value",
-        "data",
-        data_hex,
-    ]
-    subprocess.run(cmd, check=True)
-    print(f"Updated {map_path} at key {key}")
-
-
-def lookup_map(map_path, key):
-    """Lookup a BPF map entry using bpftool in JSON mode."""
-    key_hex = key.to_bytes(4, byteorder="little").hex()
-    cmd = [
-        "bpftool",
-        "-j",
-        "map",
-        "lookup",
-        "pinned",
-        map_path,
-        "key",
-        key_hex,
+def load_library(path=None):
+    """Load libkerinfer.so, by default from next to this script."""
+    if path is None:
+        here = os.path.dirname(os.path.abspath(__file__))
+        path = os.path.join(here, "libkerinfer.so")
+    lib = ctypes.CDLL(path, use_errno=True)
+
+    lib.kerinfer_open_pinned.argtypes = [ctypes.c_char_p, ctypes.c_uint]
+    lib.kerinfer_open_pinned.restype = ctypes.c_void_p
+    lib.kerinfer_close.argtypes = [ctypes.c_void_p]
+    lib.kerinfer_close.restype = None
+    lib.kerinfer_nr_slots.argtypes = [ctypes.c_void_p]
+    lib.kerinfer_nr_slots.restype = ctypes.c_uint
+    lib.kerinfer_infer_batch.argtypes = [
+        ctypes.c_void_p,
+        ctypes.POINTER(ctypes.c_uint8),
+        ctypes.c_uint,
+        ctypes.POINTER(ctypes.c_int32),
+        ctypes.c_int,
     ]
-    result = subprocess.run(cmd, stdout=subprocess.PIPE, check=True)
-    return result.stdout
-
-
-def trigger_inference():
-    # Trigger the BPF program by executing a syscall.
-    # Since the eBPF program is attached to a tracepoint,
-    # any syscall (like getpid) will trigger it.
-    os.getpid()
-
-
-def parse_output(data):
-    """Decode JSON output from bpftool into an array of int32 values."""
-    obj = json.loads(data.decode("utf-8"))
-    if isinstance(obj, list):
-        if not obj:
-            raise ValueError("No data returned from bpftool")
-        obj = obj[0]
-    if "value" not in obj:
-        raise ValueError("Unexpected bpftool output")
-    value_bytes = bytes(obj["value"])
-    if len(value_bytes) < 40:
-        raise ValueError("Unexpected output map size")
-    arr = np.frombuffer(value_bytes, dtype=np.int32)
-    return arr
-
-
-def check_kernel_trace(timeout=1.0):
-    """
-    Read the kernel trace pipe for a short time and check for our marker.
-    Returns True if the marker "BPF_INFER:" is seen.
-    """
-    marker = b"BPF_INFER:"
-    found = False
-    try:
-        with open(TRACE_PIPE, "rb") as f:
-            start = time.time()
-            while time.time() - start < timeout:
-                # Non-blocking read of a line; if no data, sleep briefly.
-                line = f.readline()
-                if marker in line:
-                    print("Kernel trace marker detected:", line.decode().strip())
-                    found = True
+    lib.kerinfer_infer_batch.restype = ctypes.c_int
+    return lib
+
+
+class KerInfer:
+    """Client for the maps pinned by the loader, backed by libkerinfer."""
+
+    def __init__(
+        self,
+        pin_dir=KERINFER_DEFAULT_PIN_DIR,
+        mmap=False,
+        ringbuf=False,
+        lib=None,
+    ):
+        self.lib = lib or load_library()
+        flags = (KERINFER_F_MMAP if mmap else 0) | (
+            KERINFER_F_RINGBUF if ringbuf else 0
+        )
+        self.handle = self.lib.kerinfer_open_pinned(pin_dir.encode(), flags)
+        if not self.handle:
+            err = ctypes.get_errno()
+            raise OSError(
+                err, f"Failed to open maps pinned in {pin_dir}: {os.strerror(err)}"
+            )
+
+    def close(self):
+        if self.handle:
+            self.lib.kerinfer_close(self.handle)
+            self.handle = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    @property
+    def nr_slots(self):
+        return self.lib.kerinfer_nr_slots(self.handle)
+
+    def infer(self, images, timeout_ms=DEFAULT_TIMEOUT_MS):
+        """Run a (N, 784) uint8 array of images, returning (N, 10) int32 logits."""
+        images = np.ascontiguousarray(images, dtype=np.uint8)
+        images = images.reshape(-1, INPUT_SIZE)
+        logits = np.zeros((len(images), OUTPUT_SIZE), dtype=np.int32)
+        err = self.lib.kerinfer_infer_batch(
+            self.handle,
+            images.ctypes.data_as(ctypes.POINTER(ctypes.c_uint8)),
+            len(images),
+            logits.ctypes.data_as(ctypes.POINTER(ctypes.c_int32)),
+            timeout_ms,
+        )
+        if err:
+            raise OSError(-err, f"Inference failed: {os.strerror(-err)}")
+        return logits
+
+
+def infer_udp(host, port, images, timeout_ms=DEFAULT_TIMEOUT_MS):
+    """Classify images through bpf_mnist_infer_xdp, one datagram each."""
+    logits = np.zeros((len(images), OUTPUT_SIZE), dtype=np.int32)
+    with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as sock:
+        sock.settimeout(timeout_ms / 1000)
+        sock.connect((host, port))
+        for i, image in enumerate(images):
+            sock.send(UDP_REQUEST_ID.pack(i + 1) + image.tobytes())
+            while True:
+                reply = sock.recv(UDP_REPLY.size)
+                if len(reply) != UDP_REPLY.size:
+                    continue
+                seq, _, *values = UDP_REPLY.unpack(reply)
+                # Drop late replies to requests that already timed out
+                if seq == i + 1:
                     break
-    except Exception as e:
-        print("Failed to read trace_pipe:", e)
-    return found
-
+            logits[i] = values
+    return logits
+
+
+def parse_udp_address(value):
+    host, _, port = value.rpartition(":")
+    if not host:
+        return value, MNIST_UDP_DEFAULT_PORT
+    return host, int(port)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Classify images with the in-kernel MNIST model"
+    )
+    parser.add_argument("images", nargs="+", help="image files to classify")
+    parser.add_argument(
+        "--pin-dir",
+        default=KERINFER_DEFAULT_PIN_DIR,
+        help="directory holding the pinned maps (default %(default)s)",
+    )
+    parser.add_argument(
+        "--mmap", action="store_true", help="access the slot maps through mmap()"
+    )
+    parser.add_argument(
+        "--ringbuf",
+        action="store_true",
+        help="wait on the results ring buffer instead of polling slot states "
+        "(one client at a time)",
+    )
+    parser.add_argument(
+        "--timeout-ms",
+        type=int,
+        default=DEFAULT_TIMEOUT_MS,
+        help="per-request timeout (default %(default)s)",
+    )
+    parser.add_argument(
+        "--udp",
+        metavar="HOST[:PORT]",
+        type=parse_udp_address,
+        help="send the images as UDP requests to a loader running with --xdp "
+        f"(default port {MNIST_UDP_DEFAULT_PORT}) instead of using the maps",
+    )
+    args = parser.parse_args()
+
+    images = []
+    for path in args.images:
+        flat = load_image(path)
+        if flat.size != INPUT_SIZE:
+            print(f"Error: {path} did not yield {INPUT_SIZE} pixels")
+            sys.exit(1)
+        images.append(flat)
 
-def main(image_path):
-    flat = load_image(image_path)
-    if flat.size != 784:
-        print("Error: Image did not yield 784 pixels")
+    try:
+        if args.udp:
+            logits = infer_udp(*args.udp, images, args.timeout_ms)
+        else:
+            with KerInfer(
+                args.pin_dir, mmap=args.mmap, ringbuf=args.ringbuf
+            ) as ki:
+                logits = ki.infer(np.stack(images), args.timeout_ms)
+    except socket.timeout:
+        print("Error: timed out waiting for a UDP reply")
+        sys.exit(1)
+    except OSError as e:
+        print(f"Error: {e.strerror}")
         sys.exit(1)
 
-    update_map(INPUT_MAP_PATH, 0, flat.tobytes())
-    trigger_inference()
-    if check_kernel_trace(timeout=1.0):
-        print("Verification: BPF program executed in kernel space.")
-    else:
-        print(
-            "Warning: No kernel trace marker detected. Verify that tracing is enabled and accessible."
-        )
-
-    # Allow the BPF program to run
-    time.sleep(0.1)
-    out_data = lookup_map(OUTPUT_MAP_PATH, 0)
-    output = parse_output(out_data)
-    print("MNIST Output (raw int32 values):", output)
-
-    predicted_digit = int(np.argmax(output))
-    print("Predicted digit:", predicted_digit)
+    print("Verification: BPF program served the request(s) in kernel space.")
+    for path, output in zip(args.images, logits):
+        print(f"{path}: MNIST Output (raw int32 values): {output}")
+        print(f"{path}: Predicted digit: {int(np.argmax(output))}")
 
 
 if __name__ == "__main__":
-    if len(sys.argv) != 2:
-        print("Usage: {} <image_file>".format(sys.argv[0]))
-        sys.exit(1)
-    main(sys.argv[1])
+    main()
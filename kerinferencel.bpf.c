@@ -2,30 +2,76 @@
 //
 // mnist_inference_8bit_small.bpf.c
 // Minimal eBPF program for quantized MNIST inference with LeakyReLU.
-// Single hidden layer of 32 units, parameters stored as int8 (weights) and
-// int32 (biases).
+// Single hidden layer of HIDDEN_SIZE units (32 by default), parameters
+// stored as int8 (weights; int4 in the hidden layer with make
+// WEIGHTS=int4) and int32 (biases). Every layer's sums are requantized to
+// uint8 activations (see struct mnist_layer_requant).
 
 #include "vmlinux.h"
 #include <bpf/bpf_core_read.h>
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_tracing.h>
 #include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <bpf/bpf_endian.h>
 
-// Model dimensions
-#define INPUT_SIZE 784
-#define HIDDEN_SIZE 32
-#define OUTPUT_SIZE 10
+#include "kerinferencel.h"
 
 // Maximum verifier complexity - helps with large BPF programs
 #define MAX_LAYERS 2
 
-// Structs to hold entire arrays as single map values
-struct input_val {
-  __u8 input[INPUT_SIZE];
-};
+// Hidden units computed per bpf_loop iteration by the single-image paths.
+// Verification cost scales with the chunk rather than with HIDDEN_SIZE. With
+// the blocked layout a chunk is one weight block, so it reads contiguously.
+#if MNIST_HIDDEN_LAYOUT == MNIST_LAYOUT_BLOCKED
+#define MNIST_HIDDEN_CHUNK MNIST_WEIGHT_BLOCK
+#elif !defined(MNIST_HIDDEN_CHUNK)
+#define MNIST_HIDDEN_CHUNK 8
+#endif
+
+#if HIDDEN_SIZE % MNIST_HIDDEN_CHUNK
+#error "HIDDEN_SIZE must be a multiple of MNIST_HIDDEN_CHUNK"
+#endif
+
+#define MNIST_NR_HIDDEN_CHUNKS (HIDDEN_SIZE / MNIST_HIDDEN_CHUNK)
 
+// Build with -DMNIST_DEBUG (make DEBUG=1) to log every inference to
+// trace_pipe. Off by default: the trace buffer lock serializes all CPUs.
+#ifdef MNIST_DEBUG
+#define mnist_debug(fmt, ...) bpf_printk(fmt, ##__VA_ARGS__)
+#else
+#define mnist_debug(fmt, ...)                                                  \
+  do {                                                                         \
+  } while (0)
+#endif
+
+// Build with -DMNIST_PROFILE (make PROFILE=1) to also time the two layers
+// of the two-layer programs into MNIST_STAT_LAYER{0,1}_NS. Off by default,
+// since every bpf_ktime_get_ns() call adds to the cost being measured.
+#ifdef MNIST_PROFILE
+#define mnist_profile_start() bpf_ktime_get_ns()
+#define mnist_profile_end(stat, start)                                         \
+  stat_add(stat, bpf_ktime_get_ns() - (start))
+#else
+#define mnist_profile_start() 0
+#define mnist_profile_end(stat, start)                                         \
+  do {                                                                         \
+    (void)(start);                                                             \
+  } while (0)
+#endif
+
+// Structs to hold entire arrays as single map values. input_val and
+// output_val are shared with user space and live in kerinferencel.h.
 struct hidden_weights_val {
+#if MNIST_HIDDEN_WEIGHT_BITS == 4
+  __s8 weights[INPUT_SIZE * HIDDEN_SIZE / 2]; // two int4 weights per byte
+  __u8 shift[HIDDEN_SIZE];
+#else
   __s8 weights[INPUT_SIZE * HIDDEN_SIZE];
+#endif
 };
 
 struct hidden_bias_val {
@@ -40,38 +86,51 @@ struct output_bias_val {
   int bias[OUTPUT_SIZE];
 };
 
-struct output_val {
-  int output[OUTPUT_SIZE];
+struct hidden_requant_val {
+  struct mnist_layer_requant layer;
+  struct mnist_requant unit[HIDDEN_SIZE];
+};
+
+struct output_requant_val {
+  struct mnist_layer_requant layer;
+  struct mnist_requant unit[OUTPUT_SIZE];
 };
 
-// 1) Input: 784 bytes (uint8) stored as single value
+// 1) Input: one 784-byte (uint8) image per request slot. Like the other
+// slot arrays and mnist_control it is BPF_F_MMAPABLE, so clients can write
+// requests with plain stores instead of map update syscalls.
 struct {
   __uint(type, BPF_MAP_TYPE_ARRAY);
-  __uint(max_entries, 1);
+  __uint(map_flags, BPF_F_MMAPABLE);
+  __uint(max_entries, MNIST_DEFAULT_SLOTS);
   __type(key, __u32);
   __type(value, struct input_val);
 } mnist_input SEC(".maps");
 
-// 2) Hidden layer weights: 784*32 int8 values
+// 2) Hidden layer weights: 784*HIDDEN_SIZE int8 values (packed int4 and
+// per-unit shifts with make WEIGHTS=int4), mmap-able so a model can be
+// rewritten in place. Like every parameter map it has one entry per weight
+// set, selected by mnist_control[MNIST_CTL_WEIGHT_SET].
 struct {
   __uint(type, BPF_MAP_TYPE_ARRAY);
-  __uint(max_entries, 1);
+  __uint(map_flags, BPF_F_MMAPABLE);
+  __uint(max_entries, MNIST_NR_WEIGHT_SETS);
   __type(key, __u32);
   __type(value, struct hidden_weights_val);
 } hidden_weights SEC(".maps");
 
-// 3) Hidden layer bias: 32 int32 values
+// 3) Hidden layer bias: HIDDEN_SIZE int32 values
 struct {
   __uint(type, BPF_MAP_TYPE_ARRAY);
-  __uint(max_entries, 1);
+  __uint(max_entries, MNIST_NR_WEIGHT_SETS);
   __type(key, __u32);
   __type(value, struct hidden_bias_val);
 } hidden_bias SEC(".maps");
 
-// 4) Output layer weights: 32*10 int8 values
+// 4) Output layer weights: HIDDEN_SIZE*10 int8 values
 struct {
   __uint(type, BPF_MAP_TYPE_ARRAY);
-  __uint(max_entries, 1);
+  __uint(max_entries, MNIST_NR_WEIGHT_SETS);
   __type(key, __u32);
   __type(value, struct output_weights_val);
 } output_weights SEC(".maps");
@@ -79,89 +138,1621 @@ struct {
 // 5) Output layer bias: 10 int32 values
 struct {
   __uint(type, BPF_MAP_TYPE_ARRAY);
-  __uint(max_entries, 1);
+  __uint(max_entries, MNIST_NR_WEIGHT_SETS);
   __type(key, __u32);
   __type(value, struct output_bias_val);
 } output_bias SEC(".maps");
 
-// 6) Output array: 10 int32 values
+// 6) Output array: 10 int32 values per request slot. The loader can switch
+// it to BPF_MAP_TYPE_PERCPU_ARRAY (--percpu), which cannot be mmap()ed;
+// lookups here are unchanged.
 struct {
   __uint(type, BPF_MAP_TYPE_ARRAY);
-  __uint(max_entries, 1);
+  __uint(map_flags, BPF_F_MMAPABLE);
+  __uint(max_entries, MNIST_DEFAULT_SLOTS);
   __type(key, __u32);
   __type(value, struct output_val);
 } mnist_output SEC(".maps");
 
-// Leaky ReLU activation function
-static __always_inline int leaky_relu_int32(int x) {
-  if (x >= 0) {
-    return x;
-  } else {
-    unsigned int abs_x = (unsigned int)(-x);
-    return -(abs_x / 100U);
+// Per-slot state word (MNIST_SLOT_*). Kept out of input_val so that a
+// client's map update of the image can never be observed half-written by a
+// program that sees the slot as pending.
+struct {
+  __uint(type, BPF_MAP_TYPE_ARRAY);
+  __uint(map_flags, BPF_F_MMAPABLE);
+  __uint(max_entries, MNIST_DEFAULT_SLOTS);
+  __type(key, __u32);
+  __type(value, __u32);
+} mnist_slot_state SEC(".maps");
+
+// Indices of unused slots. Popping from a queue map is atomic, which is how
+// concurrent clients claim a slot without any other coordination.
+struct {
+  __uint(type, BPF_MAP_TYPE_QUEUE);
+  __uint(max_entries, MNIST_DEFAULT_SLOTS);
+  __type(value, __u32);
+} mnist_free_slots SEC(".maps");
+
+// Request gating words, indexed by enum mnist_ctl
+struct {
+  __uint(type, BPF_MAP_TYPE_ARRAY);
+  __uint(map_flags, BPF_F_MMAPABLE);
+  __uint(max_entries, MNIST_NR_CTL);
+  __type(key, __u32);
+  __type(value, __u32);
+} mnist_control SEC(".maps");
+
+// Per-CPU event counters, indexed by enum mnist_stat
+struct {
+  __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+  __uint(max_entries, MNIST_NR_STATS);
+  __type(key, __u32);
+  __type(value, __u64);
+} mnist_stats SEC(".maps");
+
+// Completion records (struct mnist_result) for served request slots
+struct {
+  __uint(type, BPF_MAP_TYPE_RINGBUF);
+  __uint(max_entries, MNIST_RESULTS_RINGBUF_SIZE);
+} mnist_results SEC(".maps");
+
+// 7) Per-CPU scratch for the batched on-demand program. The context buffer
+// can only be accessed at fixed offsets, so the images are staged in map
+// memory, along with the hidden activations and logits of the whole batch.
+struct scratch_val {
+  __u8 input[MNIST_BATCH_SIZE][INPUT_SIZE];
+  __u8 hidden[MNIST_BATCH_SIZE][HIDDEN_SIZE];
+  int output[MNIST_BATCH_SIZE][OUTPUT_SIZE];
+};
+
+struct {
+  __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+  __uint(max_entries, 1);
+  __type(key, __u32);
+  __type(value, struct scratch_val);
+} mnist_scratch SEC(".maps");
+
+// 8) Per-CPU staging copy of the pixel list for the sparse program
+struct sparse_scratch_val {
+  struct mnist_pixel pixels[MNIST_MAX_NNZ];
+};
+
+struct {
+  __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+  __uint(max_entries, 1);
+  __type(key, __u32);
+  __type(value, struct sparse_scratch_val);
+} mnist_sparse_scratch SEC(".maps");
+
+// 9) Per-CPU uint8 hidden activations of the single-image programs, filled
+// one chunk at a time by bpf_loop callbacks and read by the output layer.
+// The XDP program runs in softirq context, where it may interrupt a
+// syscall-side program halfway through an image, so it has an entry of its
+// own.
+#define MNIST_ACT_TASK 0
+#define MNIST_ACT_XDP 1
+
+struct activation_val {
+  __u8 hidden[HIDDEN_SIZE];
+};
+
+struct {
+  __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+  __uint(max_entries, 2);
+  __type(key, __u32);
+  __type(value, struct activation_val);
+} mnist_activations SEC(".maps");
+
+// 10) Descriptor and packed parameters of the generic network run by
+// bpf_mnist_infer_net (see struct mnist_model_desc)
+struct {
+  __uint(type, BPF_MAP_TYPE_ARRAY);
+  __uint(max_entries, MNIST_NR_WEIGHT_SETS);
+  __type(key, __u32);
+  __type(value, struct mnist_model_desc);
+} mnist_model SEC(".maps");
+
+struct {
+  __uint(type, BPF_MAP_TYPE_ARRAY);
+  __uint(max_entries, MNIST_NR_WEIGHT_SETS);
+  __type(key, __u32);
+  __type(value, struct mnist_net_weights);
+} mnist_net_weights SEC(".maps");
+
+// 11) Per-CPU activations of the generic network, double-buffered: layer l
+// reads act[l % 2] and writes act[(l + 1) % 2]
+struct net_scratch_val {
+  __u8 act[2][MNIST_NET_MAX_DIM];
+};
+
+struct {
+  __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+  __uint(max_entries, 1);
+  __type(key, __u32);
+  __type(value, struct net_scratch_val);
+} mnist_net_scratch SEC(".maps");
+
+// 12) Logits of recently served images, keyed by mnist_input_hash() of the
+// pixels (see MNIST_DEFAULT_CACHE_ENTRIES). Only used by bpf_mnist_infer,
+// while mnist_control[MNIST_CTL_CACHE] is set.
+struct mnist_cache_val {
+  __u32 generation; // mnist_control[MNIST_CTL_WEIGHT_SET] of the logits
+  __s32 logits[OUTPUT_SIZE];
+};
+
+struct {
+  __uint(type, BPF_MAP_TYPE_LRU_HASH);
+  __uint(max_entries, MNIST_DEFAULT_CACHE_ENTRIES);
+  __type(key, __u64);
+  __type(value, struct mnist_cache_val);
+} mnist_cache SEC(".maps");
+
+// 13) Per-CPU copy of the pixels of the UDP request being served by the
+// XDP program
+struct xdp_scratch_val {
+  __u8 input[INPUT_SIZE];
+};
+
+struct {
+  __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+  __uint(max_entries, 1);
+  __type(key, __u32);
+  __type(value, struct xdp_scratch_val);
+} mnist_xdp_scratch SEC(".maps");
+
+// 14) Requantization of the hidden layer sums to its LeakyReLU activations
+struct {
+  __uint(type, BPF_MAP_TYPE_ARRAY);
+  __uint(max_entries, MNIST_NR_WEIGHT_SETS);
+  __type(key, __u32);
+  __type(value, struct hidden_requant_val);
+} hidden_requant SEC(".maps");
+
+// 15) Requantization of the output layer sums to the uint8 logits
+struct {
+  __uint(type, BPF_MAP_TYPE_ARRAY);
+  __uint(max_entries, MNIST_NR_WEIGHT_SETS);
+  __type(key, __u32);
+  __type(value, struct output_requant_val);
+} output_requant SEC(".maps");
+
+#ifdef MNIST_ARENA
+// Pointers into the arena, user-space addresses that clang converts with
+// addr_space_cast before every access
+#define __arena __attribute__((address_space(1)))
+
+// 16) The arena of bpf_mnist_infer_arena (struct mnist_arena), mapped at the
+// same address in user space
+struct {
+  __uint(type, BPF_MAP_TYPE_ARENA);
+  __uint(map_flags, BPF_F_MMAPABLE);
+  __uint(max_entries, MNIST_ARENA_PAGES);
+  __ulong(map_extra, MNIST_ARENA_ADDR);
+} mnist_arena SEC(".maps");
+#endif
+
+#ifdef MNIST_PRUNED_BLOCKS
+// 17) Kept blocks of the pruned hidden weights (MNIST_TENSOR_HIDDEN_BLOCKS):
+// MNIST_PRUNED_BLOCKS pixel blocks per hidden unit and their weights
+struct hidden_blocks_val {
+  __u8 block[HIDDEN_SIZE][MNIST_PRUNED_BLOCKS];
+  __s8 weights[HIDDEN_SIZE][MNIST_PRUNED_BLOCKS][MNIST_PRUNE_BLOCK];
+};
+
+struct {
+  __uint(type, BPF_MAP_TYPE_ARRAY);
+  __uint(max_entries, MNIST_NR_WEIGHT_SETS);
+  __type(key, __u32);
+  __type(value, struct hidden_blocks_val);
+} hidden_blocks SEC(".maps");
+#endif
+
+// Per-CPU owner word of the task-context scratch: 7), 8), the MNIST_ACT_TASK
+// entry of 9), 11) and the arena's activation rows. Syscall programs only
+// have migration disabled, so a task preempting one halfway through a batch
+// may run a program on the same CPU itself, and so may the sys_enter
+// tracepoint firing in that task. It finds the word taken and backs off with
+// MNIST_RUN_EBUSY (the tracepoint program leaves its request pending for a
+// later syscall) instead of overwriting the scratch of the preempted run.
+// The XDP program has scratch of its own and does not take it.
+struct {
+  __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+  __uint(max_entries, 1);
+  __type(key, __u32);
+  __type(value, __u32);
+} mnist_busy SEC(".maps");
+
+// Per-CPU count of runs reading each weight set. The loader sums the counts
+// of the set it switched away from and only lets anyone rewrite it once they
+// reach zero.
+struct {
+  __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+  __uint(max_entries, MNIST_NR_WEIGHT_SETS);
+  __type(key, __u32);
+  __type(value, __u64);
+} mnist_set_readers SEC(".maps");
+
+static __always_inline int clamp_u8(__s64 x) {
+  return x < 0 ? 0 : x > 255 ? 255 : (int)x;
+}
+
+// Requantize the sum of one output unit to its uint8 activation, as
+// described at struct mnist_layer_requant. The loader checks the shifts;
+// masking them only keeps those of a corrupt map below 64.
+static __always_inline int requantize(int sum,
+                                      const struct mnist_layer_requant *layer,
+                                      const struct mnist_requant *unit,
+                                      int leaky) {
+  struct mnist_requant rq = {unit->multiplier, unit->shift & 63};
+
+  if (!leaky)
+    return clamp_u8(layer->zero_point + MNIST_REQUANT(sum, rq));
+
+  int d = clamp_u8(layer->linear_zero_point + MNIST_REQUANT(sum, rq)) -
+          layer->linear_zero_point;
+  const struct mnist_requant *act = d >= 0 ? &layer->pos : &layer->neg;
+
+  rq.multiplier = act->multiplier;
+  rq.shift = act->shift & 63;
+  return clamp_u8(layer->zero_point + MNIST_REQUANT(d, rq));
+}
+
+static __always_inline void stat_add(__u32 idx, __u64 val) {
+  __u64 *cnt = bpf_map_lookup_elem(&mnist_stats, &idx);
+  if (cnt)
+    *cnt += val;
+}
+
+static __always_inline __u32 *control_word(__u32 key) {
+  return bpf_map_lookup_elem(&mnist_control, &key);
+}
+
+// Model generation (the WEIGHT_SET counter) for one request or batch
+static __always_inline __u32 model_generation(void) {
+  __u32 *gen = control_word(MNIST_CTL_WEIGHT_SET);
+
+  return gen ? *(volatile __u32 *)gen : 0;
+}
+
+// Model generation for one request or batch, whose weight set
+// (generation % MNIST_NR_WEIGHT_SETS) is counted in mnist_set_readers until
+// model_put(). Read once, so that every layer sees the same model even if
+// user space switches sets meanwhile. A run registering just as the loader
+// switches away from its set, after the loader summed the counts, sees the
+// new generation on the re-read and moves on to the new set.
+static __always_inline __u32 model_get(void) {
+  __u32 gen = model_generation();
+
+  for (int tries = 1;; tries++) {
+    __u32 set = gen % MNIST_NR_WEIGHT_SETS;
+    __u64 *readers = bpf_map_lookup_elem(&mnist_set_readers, &set);
+    if (!readers)
+      return gen;
+
+    __sync_fetch_and_add(readers, 1);
+    __u32 now = model_generation();
+    // Past a few switches in a row, keep the set we hold
+    if (now == gen || tries == 4)
+      return gen;
+    __sync_fetch_and_add(readers, -1);
+    gen = now;
+  }
+}
+
+static __always_inline void model_put(__u32 gen) {
+  __u32 set = gen % MNIST_NR_WEIGHT_SETS;
+  __u64 *readers = bpf_map_lookup_elem(&mnist_set_readers, &set);
+
+  if (readers)
+    __sync_fetch_and_add(readers, -1);
+}
+
+// Hidden weight idx (in MNIST_HIDDEN_W_INDEX order), and the uint8
+// activation of hidden unit j from its weighted sum of the pixels. INT4
+// builds unpack the weight from its nibble and shift the sum by the unit's
+// shift before the bias is added; the weights of a row share both the
+// nibble order and the shift, so the sum can be accumulated unshifted.
+#if MNIST_HIDDEN_WEIGHT_BITS == 4
+static __always_inline int hidden_weight(const struct hidden_weights_val *w,
+                                         __u32 idx) {
+  int byte = w->weights[idx / 2];
+
+  // Move the low nibble to the top of the byte, then sign-extend either one
+  return idx & 1 ? byte >> 4 : (__s8)(byte << 4) >> 4;
+}
+
+static __always_inline int
+hidden_unit(const struct hidden_weights_val *w,
+            const struct hidden_bias_val *b,
+            const struct hidden_requant_val *rq, __u32 j, int sum) {
+  return requantize(b->bias[j] + (int)((__u32)sum << (w->shift[j] & 7)),
+                    &rq->layer, &rq->unit[j], 1);
+}
+#else
+static __always_inline int hidden_weight(const struct hidden_weights_val *w,
+                                         __u32 idx) {
+  return w->weights[idx];
+}
+
+static __always_inline int
+hidden_unit(const struct hidden_weights_val *w,
+            const struct hidden_bias_val *b,
+            const struct hidden_requant_val *rq, __u32 j, int sum) {
+  return requantize(b->bias[j] + sum, &rq->layer, &rq->unit[j], 1);
+}
+#endif
+
+// Layer 1 for one image: uint8 logits from the hidden activations. The
+// output weights are small enough to stay cached, so this is shared by
+// every path.
+static __always_inline void
+output_layer(const __u8 *hidden, int *out_ptr,
+             const struct output_weights_val *outW_val,
+             const struct output_bias_val *outB_val,
+             const struct output_requant_val *outR_val) {
+#pragma unroll
+  for (int o = 0; o < OUTPUT_SIZE; o++) {
+    int sum_o = outB_val->bias[o];
+
+#pragma unroll 16
+    for (int j = 0; j < HIDDEN_SIZE; j++) {
+      int weight = outW_val->weights[o * HIDDEN_SIZE + j]; // int8
+      sum_o += (weight * hidden[j]);
+    }
+    out_ptr[o] = requantize(sum_o, &outR_val->layer, &outR_val->unit[o], 0);
+  }
+}
+
+struct forward_ctx {
+  const __u8 *in_ptr;
+  __u32 set; // weight set
+  __u32 act; // mnist_activations entry (MNIST_ACT_*)
+  int err;
+};
+
+// bpf_loop callback computing hidden units c * MNIST_HIDDEN_CHUNK onwards
+// for one image into mnist_activations. The image is walked once per chunk;
+// the verifier only has to check one chunk, whatever HIDDEN_SIZE is.
+static long forward_hidden_chunk(__u32 c, struct forward_ctx *fctx) {
+  __u32 set = fctx->set;
+  __u32 act_key = fctx->act;
+  const __u8 *in_ptr = fctx->in_ptr;
+
+  struct hidden_weights_val *hidW_val =
+      bpf_map_lookup_elem(&hidden_weights, &set);
+  struct hidden_bias_val *hidB_val = bpf_map_lookup_elem(&hidden_bias, &set);
+  struct hidden_requant_val *hidR_val =
+      bpf_map_lookup_elem(&hidden_requant, &set);
+  struct activation_val *act =
+      bpf_map_lookup_elem(&mnist_activations, &act_key);
+
+  if (!hidW_val || !hidB_val || !hidR_val || !act) {
+    fctx->err = 1;
+    return 1;
+  }
+  if (c >= MNIST_NR_HIDDEN_CHUNKS)
+    return 1;
+
+  int sums[MNIST_HIDDEN_CHUNK] = {};
+
+#pragma unroll 2
+  for (int i = 0; i < INPUT_SIZE; i++) {
+    int input_val = in_ptr[i]; // uint8, treat as int
+
+#pragma unroll
+    for (int k = 0; k < MNIST_HIDDEN_CHUNK; k++) {
+      int j = c * MNIST_HIDDEN_CHUNK + k;
+      int weight = hidden_weight(hidW_val, MNIST_HIDDEN_W_INDEX(j, i));
+      sums[k] += (weight * input_val);
+    }
+  }
+
+#pragma unroll
+  for (int k = 0; k < MNIST_HIDDEN_CHUNK; k++) {
+    int j = c * MNIST_HIDDEN_CHUNK + k;
+    act->hidden[j] = hidden_unit(hidW_val, hidB_val, hidR_val, j, sums[k]);
+  }
+  return 0;
+}
+
+// Runs the two-layer network over in_ptr with weight set set and writes the
+// logits to out_ptr, using activation buffer act_key (MNIST_ACT_*). Returns
+// -1 if any of the parameter maps could not be looked up.
+static __always_inline int mnist_forward(const __u8 *in_ptr, int *out_ptr,
+                                         __u32 set, __u32 act_key) {
+  struct output_weights_val *outW_val =
+      bpf_map_lookup_elem(&output_weights, &set);
+  struct output_bias_val *outB_val = bpf_map_lookup_elem(&output_bias, &set);
+  struct output_requant_val *outR_val =
+      bpf_map_lookup_elem(&output_requant, &set);
+  struct activation_val *act =
+      bpf_map_lookup_elem(&mnist_activations, &act_key);
+
+  if (!outW_val || !outB_val || !outR_val || !act)
+    return -1;
+
+  for (int layer = 0; layer < MAX_LAYERS; layer++) {
+    __u64 start_ns = mnist_profile_start();
+
+    if (layer == 0) {
+      struct forward_ctx fctx = {
+          .in_ptr = in_ptr, .set = set, .act = act_key};
+
+      bpf_loop(MNIST_NR_HIDDEN_CHUNKS, forward_hidden_chunk, &fctx, 0);
+      if (fctx.err)
+        return -1;
+      mnist_profile_end(MNIST_STAT_LAYER0_NS, start_ns);
+    } else if (layer == 1) {
+      output_layer(act->hidden, out_ptr, outW_val, outB_val, outR_val);
+      mnist_profile_end(MNIST_STAT_LAYER1_NS, start_ns);
+    }
+  }
+
+  return 0;
+}
+
+#define FNV64_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV64_PRIME 0x100000001b3ULL
+
+// FNV-1a over the 32-bit words of the image (input follows the 4-byte seq,
+// so the words are aligned): a quarter of the multiplies of the bytewise
+// hash. A collision serves another image's logits; at 64 bits that is
+// accepted, as for any hash-keyed cache.
+static __always_inline __u64 mnist_input_hash(const struct input_val *in_val) {
+  const __u32 *words = (const __u32 *)in_val->input;
+  __u64 hash = FNV64_OFFSET_BASIS;
+
+#pragma unroll 4
+  for (int i = 0; i < INPUT_SIZE / 4; i++)
+    hash = (hash ^ words[i]) * FNV64_PRIME;
+  return hash;
+}
+
+// Copies cached logits for hash into out_ptr if they were computed by model
+// generation gen. Returns 1 on a hit.
+static __always_inline int cache_lookup(__u64 hash, __u32 gen, int *out_ptr) {
+  struct mnist_cache_val *val = bpf_map_lookup_elem(&mnist_cache, &hash);
+
+  if (!val || val->generation != gen)
+    return 0;
+#pragma unroll
+  for (int o = 0; o < OUTPUT_SIZE; o++)
+    out_ptr[o] = val->logits[o];
+  return 1;
+}
+
+static __always_inline void cache_store(__u64 hash, __u32 gen,
+                                        const int *out_ptr) {
+  struct mnist_cache_val val = {.generation = gen};
+
+#pragma unroll
+  for (int o = 0; o < OUTPUT_SIZE; o++)
+    val.logits[o] = out_ptr[o];
+  bpf_map_update_elem(&mnist_cache, &hash, &val, BPF_ANY);
+}
+
+static __always_inline __u32 logits_argmax(const int *logits) {
+  __u32 argmax = 0;
+  int max_val = logits[0];
+
+#pragma unroll
+  for (int o = 1; o < OUTPUT_SIZE; o++) {
+    if (logits[o] > max_val) {
+      max_val = logits[o];
+      argmax = o;
+    }
+  }
+  return argmax;
+}
+
+// Reserves and fills the completion record for a served slot. The caller
+// submits it only after marking the slot done, so a consumer never sees a
+// record for a slot it cannot release yet. Returns NULL if the ring is full;
+// the result is then still available in mnist_output.
+static __always_inline struct mnist_result *
+prepare_result(__u32 slot, const struct output_val *out_val) {
+  struct mnist_result *res =
+      bpf_ringbuf_reserve(&mnist_results, sizeof(*res), 0);
+  if (!res)
+    return NULL;
+
+  res->seq = out_val->seq;
+  res->slot = slot;
+#pragma unroll
+  for (int o = 0; o < OUTPUT_SIZE; o++)
+    res->logits[o] = out_val->output[o];
+  res->argmax = logits_argmax(out_val->output);
+  res->reserved = 0;
+  res->ktime_ns = bpf_ktime_get_ns();
+  return res;
+}
+
+// Claims the first pending slot, moving it to BUSY. Returns the slot index,
+// or -1 if no slot is waiting. The scan stops at the first index past the
+// loader-configured map size.
+static __always_inline int claim_pending_slot(void) {
+  for (__u32 slot = 0; slot < MNIST_MAX_SLOTS; slot++) {
+    __u32 *state = bpf_map_lookup_elem(&mnist_slot_state, &slot);
+    if (!state)
+      break;
+    if (*state == MNIST_SLOT_PENDING &&
+        __sync_val_compare_and_swap(state, MNIST_SLOT_PENDING,
+                                    MNIST_SLOT_BUSY) == MNIST_SLOT_PENDING)
+      return slot;
+  }
+  return -1;
+}
+
+// Take the CPU's scratch (see mnist_busy) for the rest of the run. Returns
+// the word to hand back to scratch_put(), or NULL, counted in
+// MNIST_STAT_BUSY, while a preempted run still holds it.
+static __always_inline __u32 *scratch_get(void) {
+  __u32 zero = 0;
+  __u32 *busy = bpf_map_lookup_elem(&mnist_busy, &zero);
+
+  if (!busy || __sync_val_compare_and_swap(busy, 0, 1) != 0) {
+    stat_add(MNIST_STAT_BUSY, 1);
+    return NULL;
   }
+  return busy;
+}
+
+static __always_inline void scratch_put(__u32 *busy) {
+  // Every scratch access must come before the release
+  asm volatile("" ::: "memory");
+  *(volatile __u32 *)busy = 0;
 }
 
+// Serve one pending request slot for bpf_mnist_infer (or slot 0 when forced)
+// under the CPU's scratch guard
+static __always_inline void serve_request(int forced, __u32 gen,
+                                          __u32 *served, __u32 *cache,
+                                          __u32 model_gen) {
+  int claimed = 0;
+
+  if (!forced) {
+    claimed = claim_pending_slot();
+    if (claimed < 0) {
+      *served = gen;
+      stat_add(MNIST_STAT_SKIPPED, 1);
+      return;
+    }
+  }
+
+  __u32 slot = claimed;
+  __u32 *state = bpf_map_lookup_elem(&mnist_slot_state, &slot);
+  struct input_val *in_val = bpf_map_lookup_elem(&mnist_input, &slot);
+  struct output_val *out_val = bpf_map_lookup_elem(&mnist_output, &slot);
+
+  if (!state) {
+    stat_add(MNIST_STAT_ERRORS, 1);
+    return;
+  }
+
+  __u64 start_ns = bpf_ktime_get_ns();
+  // Forced runs measure the network, so they always compute
+  int cached = !forced && *(volatile __u32 *)cache;
+  __u64 hash = 0;
+  int hit = 0;
+
+  if (in_val && out_val && cached) {
+    hash = mnist_input_hash(in_val);
+    hit = cache_lookup(hash, model_gen, out_val->output);
+    stat_add(hit ? MNIST_STAT_CACHE_HITS : MNIST_STAT_CACHE_MISSES, 1);
+  }
+  if (!in_val || !out_val ||
+      (!hit && mnist_forward(in_val->input, out_val->output,
+                             model_gen % MNIST_NR_WEIGHT_SETS,
+                             MNIST_ACT_TASK) < 0)) {
+    if (!forced)
+      __sync_lock_test_and_set(state, MNIST_SLOT_ERROR);
+    stat_add(MNIST_STAT_ERRORS, 1);
+    return;
+  }
+  if (cached && !hit)
+    cache_store(hash, model_gen, out_val->output);
+  stat_add(MNIST_STAT_INFER_NS, bpf_ktime_get_ns() - start_ns);
+  stat_add(MNIST_STAT_IMAGES, 1);
+
+  // A forced run leaves the state of slot 0 and the ring buffer alone
+  if (forced)
+    return;
+
+  // Publish: the logits and seq must be visible before the state flips
+  out_val->seq = in_val->seq;
+  struct mnist_result *res = prepare_result(slot, out_val);
+  __sync_lock_test_and_set(state, MNIST_SLOT_DONE);
+  if (res)
+    bpf_ringbuf_submit(res, 0);
+
+  mnist_debug("BPF_INFER: inference executed (slot %u)\n", slot);
+}
+
+// Tracepoint variant: runs on every syscall, serving one pending request
+// slot by reading its image from mnist_input and publishing the logits to
+// mnist_output. Syscalls from other processes than the configured target,
+// and syscalls arriving while no new request has been submitted, return
+// after a couple of loads. With the cache enabled, an image seen before under
+// the same model is served from mnist_cache without running the network.
 SEC("tracepoint/raw_syscalls/sys_enter")
 int bpf_mnist_infer(struct trace_event_raw_sys_enter *ctx) {
+  __u32 *generation = control_word(MNIST_CTL_GENERATION);
+  __u32 *served = control_word(MNIST_CTL_SERVED);
+  __u32 *target_tgid = control_word(MNIST_CTL_TARGET_TGID);
+  __u32 *force = control_word(MNIST_CTL_FORCE_COMPUTE);
+  __u32 *cache = control_word(MNIST_CTL_CACHE);
+
+  stat_add(MNIST_STAT_INVOCATIONS, 1);
+  if (!generation || !served || !target_tgid || !force || !cache) {
+    stat_add(MNIST_STAT_ERRORS, 1);
+    return 0;
+  }
+
+  if (*target_tgid && (bpf_get_current_pid_tgid() >> 32) != *target_tgid) {
+    stat_add(MNIST_STAT_SKIPPED, 1);
+    return 0;
+  }
+
+  int forced = *(volatile __u32 *)force;
+  // Snapshot the generation before scanning: a slot that becomes pending
+  // after the snapshot is always followed by a new generation
+  __u32 gen = *(volatile __u32 *)generation;
+
+  if (!forced && gen == *served) {
+    stat_add(MNIST_STAT_SKIPPED, 1);
+    return 0;
+  }
+
+  // A busy CPU leaves served behind, so a later syscall serves the slot
+  __u32 *busy = scratch_get();
+  if (!busy)
+    return 0;
+
+  // The cache entry's tag and the weights used come from the same read
+  __u32 model_gen = model_get();
+  serve_request(forced, gen, served, cache, model_gen);
+  model_put(model_gen);
+  scratch_put(busy);
+  return 0;
+}
+
+// Fragment bits of iphdr.frag_off, from the kernel-internal net/ip.h
+#ifndef IP_MF
+#define IP_MF 0x2000
+#define IP_OFFSET 0x1fff
+#endif
+
+#define MNIST_UDP_PAYLOAD_OFF                                                  \
+  (sizeof(struct ethhdr) + sizeof(struct iphdr) + sizeof(struct udphdr))
+
+// RFC 1624 incremental update of an Internet checksum for one 16-bit field
+static __always_inline __u16 csum_replace16(__u16 check, __u16 old,
+                                            __u16 new) {
+  __u32 sum = (__u16)~check + (__u16)~old + new;
+
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  return ~sum;
+}
+
+// Turn the request packet around into a reply carrying the logits: swap
+// the addresses and ports, cut the payload down to a struct mnist_udp_reply
+// and fix up the lengths and the IP checksum. Returns XDP_TX, or XDP_DROP
+// if the packet could not be resized.
+static __always_inline int xdp_reply(struct xdp_md *ctx, __u32 id,
+                                     const int *logits) {
+  void *data = (void *)(long)ctx->data;
+  void *data_end = (void *)(long)ctx->data_end;
+  int new_len = MNIST_UDP_PAYLOAD_OFF + sizeof(struct mnist_udp_reply);
+
+  if (bpf_xdp_adjust_tail(ctx, new_len - (int)(data_end - data)))
+    return XDP_DROP;
+
+  // Resizing invalidates every packet pointer
+  data = (void *)(long)ctx->data;
+  data_end = (void *)(long)ctx->data_end;
+  struct ethhdr *eth = data;
+  struct iphdr *ip = (void *)(eth + 1);
+  struct udphdr *udp = (void *)(ip + 1);
+  struct mnist_udp_reply *reply = (void *)(udp + 1);
+  if ((void *)(reply + 1) > data_end)
+    return XDP_DROP;
+
+  __u8 mac[ETH_ALEN];
+  __builtin_memcpy(mac, eth->h_source, ETH_ALEN);
+  __builtin_memcpy(eth->h_source, eth->h_dest, ETH_ALEN);
+  __builtin_memcpy(eth->h_dest, mac, ETH_ALEN);
+
+  // Swapping the addresses leaves the checksum as it is; the length does not
+  __be32 addr = ip->saddr;
+  ip->saddr = ip->daddr;
+  ip->daddr = addr;
+  __be16 old_len = ip->tot_len;
+  ip->tot_len = bpf_htons(sizeof(*ip) + sizeof(*udp) + sizeof(*reply));
+  ip->check = csum_replace16(ip->check, old_len, ip->tot_len);
+
+  __be16 port = udp->source;
+  udp->source = udp->dest;
+  udp->dest = port;
+  udp->len = bpf_htons(sizeof(*udp) + sizeof(*reply));
+  udp->check = 0;
+
+  reply->id = id;
+  reply->argmax = bpf_htonl(logits_argmax(logits));
+#pragma unroll
+  for (int o = 0; o < OUTPUT_SIZE; o++)
+    reply->logits[o] = bpf_htonl(logits[o]);
+  return XDP_TX;
+}
+
+// XDP variant: classifies images arriving as UDP requests (struct
+// mnist_udp_request) and answers them from the driver, without a copy to
+// user space or a context switch. Everything not addressed to the
+// configured port goes up the stack untouched. Only requests count as
+// invocations.
+SEC("xdp")
+int bpf_mnist_infer_xdp(struct xdp_md *ctx) {
+  void *data = (void *)(long)ctx->data;
+  void *data_end = (void *)(long)ctx->data_end;
+  struct ethhdr *eth = data;
+  struct iphdr *ip = (void *)(eth + 1);
+  struct udphdr *udp = (void *)(ip + 1);
+  struct mnist_udp_request *req = (void *)(udp + 1);
+  __u32 *port = control_word(MNIST_CTL_UDP_PORT);
+  __u32 zero = 0;
+
+  if ((void *)(req + 1) > data_end || !port || !*port)
+    return XDP_PASS;
+  if (eth->h_proto != bpf_htons(ETH_P_IP) || ip->ihl != 5 ||
+      ip->protocol != IPPROTO_UDP ||
+      (ip->frag_off & bpf_htons(IP_MF | IP_OFFSET)) ||
+      udp->dest != bpf_htons(*port))
+    return XDP_PASS;
+
+  stat_add(MNIST_STAT_INVOCATIONS, 1);
+
+  struct xdp_scratch_val *scratch =
+      bpf_map_lookup_elem(&mnist_xdp_scratch, &zero);
+  int logits[OUTPUT_SIZE];
+  __u32 id = req->id;
+
+  // The network reads its input through bpf_loop callbacks, which cannot
+  // take packet pointers, so stage the pixels in map memory first
+  if (!scratch ||
+      bpf_xdp_load_bytes(ctx,
+                         MNIST_UDP_PAYLOAD_OFF +
+                             __builtin_offsetof(struct mnist_udp_request,
+                                                pixels),
+                         scratch->input, INPUT_SIZE)) {
+    stat_add(MNIST_STAT_ERRORS, 1);
+    return XDP_DROP;
+  }
+
+  __u64 start_ns = bpf_ktime_get_ns();
+  __u32 model_gen = model_get();
+  int err = mnist_forward(scratch->input, logits,
+                          model_gen % MNIST_NR_WEIGHT_SETS, MNIST_ACT_XDP);
+  model_put(model_gen);
+  if (err < 0) {
+    stat_add(MNIST_STAT_ERRORS, 1);
+    return XDP_DROP;
+  }
+  stat_add(MNIST_STAT_INFER_NS, bpf_ktime_get_ns() - start_ns);
+  stat_add(MNIST_STAT_IMAGES, 1);
+
+  int action = xdp_reply(ctx, id, logits);
+  if (action != XDP_TX)
+    stat_add(MNIST_STAT_ERRORS, 1);
+  mnist_debug("BPF_INFER: UDP request %u served\n", bpf_ntohl(id));
+  return action;
+}
+
+struct batch_ctx {
+  __u32 count;
+  __u32 set; // weight set
+  int err;
+};
+
+#if MNIST_HIDDEN_LAYOUT == MNIST_LAYOUT_ROW_MAJOR
+// bpf_loop callback computing hidden unit j for every image in the batch.
+// Each weight row is walked once and applied to all images while it is hot
+// in cache, instead of once per image.
+static long batch_hidden_unit(__u32 j, struct batch_ctx *bctx) {
+  __u32 zero = 0;
+  __u32 set = bctx->set;
+  __u32 count = bctx->count;
+
+  struct hidden_weights_val *hidW_val =
+      bpf_map_lookup_elem(&hidden_weights, &set);
+  struct hidden_bias_val *hidB_val = bpf_map_lookup_elem(&hidden_bias, &set);
+  struct hidden_requant_val *hidR_val =
+      bpf_map_lookup_elem(&hidden_requant, &set);
+  struct scratch_val *scratch = bpf_map_lookup_elem(&mnist_scratch, &zero);
+
+  if (!hidW_val || !hidB_val || !hidR_val || !scratch) {
+    bctx->err = 1;
+    return 1;
+  }
+  if (j >= HIDDEN_SIZE || count > MNIST_BATCH_SIZE)
+    return 1;
+
+  __u32 row = j * INPUT_SIZE;
+  int sums[MNIST_BATCH_SIZE] = {};
+
+  for (int i = 0; i < INPUT_SIZE; i++) {
+    int weight = hidden_weight(hidW_val, row + i); // sign-extended
+
+#pragma unroll
+    for (int b = 0; b < MNIST_BATCH_SIZE; b++) {
+      if (b >= count)
+        break;
+      sums[b] += weight * scratch->input[b][i];
+    }
+  }
+
+#pragma unroll
+  for (int b = 0; b < MNIST_BATCH_SIZE; b++) {
+    if (b >= count)
+      break;
+    scratch->hidden[b][j] =
+        hidden_unit(hidW_val, hidB_val, hidR_val, j, sums[b]);
+  }
+  return 0;
+}
+#endif
+
+#if MNIST_HIDDEN_LAYOUT == MNIST_LAYOUT_BLOCKED
+// bpf_loop callback for the blocked layout, computing one block of hidden
+// units for one image. Iterations are ordered block-major, so a block's
+// interleaved weights stay hot in cache while the whole batch uses them,
+// and each image is read once per block rather than once per hidden unit.
+static long batch_hidden_block(__u32 idx, struct batch_ctx *bctx) {
+  __u32 zero = 0;
+  __u32 set = bctx->set;
+  __u32 count = bctx->count;
+
+  struct hidden_weights_val *hidW_val =
+      bpf_map_lookup_elem(&hidden_weights, &set);
+  struct hidden_bias_val *hidB_val = bpf_map_lookup_elem(&hidden_bias, &set);
+  struct hidden_requant_val *hidR_val =
+      bpf_map_lookup_elem(&hidden_requant, &set);
+  struct scratch_val *scratch = bpf_map_lookup_elem(&mnist_scratch, &zero);
+
+  if (!hidW_val || !hidB_val || !hidR_val || !scratch) {
+    bctx->err = 1;
+    return 1;
+  }
+  if (count == 0 || count > MNIST_BATCH_SIZE)
+    return 1;
+
+  __u32 jb = idx / count;
+  __u32 b = idx % count;
+  if (jb >= MNIST_NR_WEIGHT_BLOCKS || b >= MNIST_BATCH_SIZE)
+    return 1;
+
+  __u32 blk = jb * INPUT_SIZE * MNIST_WEIGHT_BLOCK;
+  const __u8 *image = scratch->input[b];
+  int sums[MNIST_WEIGHT_BLOCK] = {};
+
+  for (int i = 0; i < INPUT_SIZE; i++) {
+    int input_val = image[i];
+
+#pragma unroll
+    for (int k = 0; k < MNIST_WEIGHT_BLOCK; k++)
+      sums[k] += hidden_weight(hidW_val, blk + i * MNIST_WEIGHT_BLOCK + k) *
+                 input_val;
+  }
+
+#pragma unroll
+  for (int k = 0; k < MNIST_WEIGHT_BLOCK; k++) {
+    int j = jb * MNIST_WEIGHT_BLOCK + k;
+    scratch->hidden[b][j] =
+        hidden_unit(hidW_val, hidB_val, hidR_val, j, sums[k]);
+  }
+  return 0;
+}
+#endif
+
+#ifdef MNIST_PRUNED_BLOCKS
+// bpf_loop callback for the pruned kernel, computing hidden unit j for every
+// image in the batch from the unit's kept blocks only: MNIST_PRUNED_BLOCKS
+// times MNIST_PRUNE_BLOCK MACs per image instead of INPUT_SIZE. The pruned
+// weights are zero, so the sums equal those of the dense kernels.
+static long batch_hidden_unit_pruned(__u32 j, struct batch_ctx *bctx) {
+  __u32 zero = 0;
+  __u32 set = bctx->set;
+  __u32 count = bctx->count;
+
+  struct hidden_blocks_val *blk_val =
+      bpf_map_lookup_elem(&hidden_blocks, &set);
+  struct hidden_bias_val *hidB_val = bpf_map_lookup_elem(&hidden_bias, &set);
+  struct hidden_requant_val *hidR_val =
+      bpf_map_lookup_elem(&hidden_requant, &set);
+  struct scratch_val *scratch = bpf_map_lookup_elem(&mnist_scratch, &zero);
+
+  if (!blk_val || !hidB_val || !hidR_val || !scratch) {
+    bctx->err = 1;
+    return 1;
+  }
+  if (j >= HIDDEN_SIZE || count > MNIST_BATCH_SIZE)
+    return 1;
+
+  int sums[MNIST_BATCH_SIZE] = {};
+
+  for (int k = 0; k < MNIST_PRUNED_BLOCKS; k++) {
+    __u32 col = blk_val->block[j][k];
+    const __s8 *w = blk_val->weights[j][k];
+
+    // The loader checks the indices; this bounds the pixel reads
+    if (col >= MNIST_NR_PIXEL_BLOCKS) {
+      bctx->err = 1;
+      return 1;
+    }
+    col *= MNIST_PRUNE_BLOCK;
+
+#pragma unroll
+    for (int b = 0; b < MNIST_BATCH_SIZE; b++) {
+      if (b >= count)
+        break;
+      const __u8 *x = &scratch->input[b][col];
+
+#pragma unroll
+      for (int t = 0; t < MNIST_PRUNE_BLOCK; t++)
+        sums[b] += w[t] * x[t];
+    }
+  }
+
+#pragma unroll
+  for (int b = 0; b < MNIST_BATCH_SIZE; b++) {
+    if (b >= count)
+      break;
+    scratch->hidden[b][j] =
+        requantize(hidB_val->bias[j] + sums[b], &hidR_val->layer,
+                   &hidR_val->unit[j], 1);
+  }
+  return 0;
+}
+#endif
+
+#if MNIST_HAVE_SWAR
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "the SWAR kernel assumes little-endian weight words"
+#endif
+
+#define SWAR_BIAS 0x8080808080808080ULL
+#define SWAR_LANES 0x000000FF000000FFULL
+
+// SWAR variant of batch_hidden_block. Each 64-bit load fetches 8 weights
+// of the block; XOR with 0x80 per byte turns the int8 weights into
+// unsigned w + 128, and four shift/mask steps spread them into pairs of
+// 32-bit lanes, so one 64-bit multiply by the pixel performs two MACs. A
+// lane never exceeds 784 * 255 * 255 < 2^32, so no carry crosses lanes.
+// The bias is removed at the end by subtracting 128 * sum(pixels), which
+// makes the result bit-identical to the scalar kernel.
+static long batch_hidden_block_swar(__u32 idx, struct batch_ctx *bctx) {
   __u32 zero = 0;
+  __u32 set = bctx->set;
+  __u32 count = bctx->count;
 
-  // Lookup map pointers to the value structs
-  struct input_val *in_val = bpf_map_lookup_elem(&mnist_input, &zero);
   struct hidden_weights_val *hidW_val =
-      bpf_map_lookup_elem(&hidden_weights, &zero);
-  struct hidden_bias_val *hidB_val = bpf_map_lookup_elem(&hidden_bias, &zero);
+      bpf_map_lookup_elem(&hidden_weights, &set);
+  struct hidden_bias_val *hidB_val = bpf_map_lookup_elem(&hidden_bias, &set);
+  struct hidden_requant_val *hidR_val =
+      bpf_map_lookup_elem(&hidden_requant, &set);
+  struct scratch_val *scratch = bpf_map_lookup_elem(&mnist_scratch, &zero);
+
+  if (!hidW_val || !hidB_val || !hidR_val || !scratch) {
+    bctx->err = 1;
+    return 1;
+  }
+  if (count == 0 || count > MNIST_BATCH_SIZE)
+    return 1;
+
+  __u32 jb = idx / count;
+  __u32 b = idx % count;
+  if (jb >= MNIST_NR_WEIGHT_BLOCKS || b >= MNIST_BATCH_SIZE)
+    return 1;
+
+  const __s8 *blk = &hidW_val->weights[jb * INPUT_SIZE * MNIST_WEIGHT_BLOCK];
+  const __u8 *image = scratch->input[b];
+  // acc[g][r] holds units g*8 + r (low lane) and g*8 + r + 4 (high lane)
+  __u64 acc[MNIST_WEIGHT_BLOCK / 8][4] = {};
+  __u32 sum_x = 0;
+
+  for (int i = 0; i < INPUT_SIZE; i++) {
+    __u64 x = image[i];
+    sum_x += x;
+
+#pragma unroll
+    for (int g = 0; g < MNIST_WEIGHT_BLOCK / 8; g++) {
+      __u64 w = *(const __u64 *)&blk[i * MNIST_WEIGHT_BLOCK + g * 8];
+      w ^= SWAR_BIAS;
+      acc[g][0] += (w & SWAR_LANES) * x;
+      acc[g][1] += ((w >> 8) & SWAR_LANES) * x;
+      acc[g][2] += ((w >> 16) & SWAR_LANES) * x;
+      acc[g][3] += ((w >> 24) & SWAR_LANES) * x;
+    }
+  }
+
+  int correction = (int)(sum_x * 128);
+
+#pragma unroll
+  for (int g = 0; g < MNIST_WEIGHT_BLOCK / 8; g++) {
+#pragma unroll
+    for (int r = 0; r < 4; r++) {
+      int j = jb * MNIST_WEIGHT_BLOCK + g * 8 + r;
+      int lo = (int)(__u32)acc[g][r] - correction;
+      int hi = (int)(__u32)(acc[g][r] >> 32) - correction;
+
+      scratch->hidden[b][j] = hidden_unit(hidW_val, hidB_val, hidR_val, j, lo);
+      scratch->hidden[b][j + 4] =
+          hidden_unit(hidW_val, hidB_val, hidR_val, j + 4, hi);
+    }
+  }
+  return 0;
+}
+#endif
+
+// First-layer kernels selectable for the batched on-demand programs
+#define KERNEL_SCALAR 0
+#define KERNEL_SWAR 1
+#define KERNEL_PRUNED 2
+
+// Body shared by the batched on-demand programs; kernel is a compile-time
+// constant picking the first-layer implementation.
+static __always_inline int infer_batch(struct mnist_run_ctx *ctx, int kernel,
+                                       __u32 set) {
+  __u32 zero = 0;
+  __u32 count = ctx->count;
+
+  if (count == 0 || count > MNIST_BATCH_SIZE) {
+    stat_add(MNIST_STAT_ERRORS, 1);
+    return MNIST_RUN_EINVAL;
+  }
+
+  struct scratch_val *scratch = bpf_map_lookup_elem(&mnist_scratch, &zero);
   struct output_weights_val *outW_val =
-      bpf_map_lookup_elem(&output_weights, &zero);
-  struct output_bias_val *outB_val = bpf_map_lookup_elem(&output_bias, &zero);
-  struct output_val *out_val = bpf_map_lookup_elem(&mnist_output, &zero);
+      bpf_map_lookup_elem(&output_weights, &set);
+  struct output_bias_val *outB_val = bpf_map_lookup_elem(&output_bias, &set);
+  struct output_requant_val *outR_val =
+      bpf_map_lookup_elem(&output_requant, &set);
+  if (!scratch || !outW_val || !outB_val || !outR_val) {
+    stat_add(MNIST_STAT_ERRORS, 1);
+    return MNIST_RUN_ENOMAP;
+  }
 
-  if (!in_val || !hidW_val || !hidB_val || !outW_val || !outB_val || !out_val)
-    return 0;
+  bpf_probe_read_kernel(scratch->input, count * INPUT_SIZE, ctx->input);
 
-  __u8 *in_ptr = in_val->input;
-  __s8 *hidW_ptr = hidW_val->weights;
-  int *hidB_ptr = hidB_val->bias;
-  __s8 *outW_ptr = outW_val->weights;
-  int *outB_ptr = outB_val->bias;
-  int *out_ptr = out_val->output;
+  __u64 start_ns = bpf_ktime_get_ns();
 
-  // Temporary stack array for hidden activations (int32)
-  int hidden_layer[HIDDEN_SIZE];
+  // Layer 0: hidden units outermost, so each weight row serves the batch
+  struct batch_ctx bctx = {.count = count, .set = set};
+#ifdef MNIST_PRUNED_BLOCKS
+  if (kernel == KERNEL_PRUNED)
+    bpf_loop(HIDDEN_SIZE, batch_hidden_unit_pruned, &bctx, 0);
+  else
+#endif
+#if MNIST_HAVE_SWAR
+  if (kernel == KERNEL_SWAR)
+    bpf_loop(MNIST_NR_WEIGHT_BLOCKS * count, batch_hidden_block_swar, &bctx,
+             0);
+  else
+#endif
+#if MNIST_HIDDEN_LAYOUT == MNIST_LAYOUT_BLOCKED
+    bpf_loop(MNIST_NR_WEIGHT_BLOCKS * count, batch_hidden_block, &bctx, 0);
+#else
+    bpf_loop(HIDDEN_SIZE, batch_hidden_unit, &bctx, 0);
+#endif
+  if (bctx.err) {
+    stat_add(MNIST_STAT_ERRORS, 1);
+    return MNIST_RUN_ENOMAP;
+  }
+  mnist_profile_end(MNIST_STAT_LAYER0_NS, start_ns);
+
+  // Layer 1
+  __u64 layer1_ns = mnist_profile_start();
+  for (__u32 b = 0; b < MNIST_BATCH_SIZE; b++) {
+    if (b >= count)
+      break;
+    output_layer(scratch->hidden[b], scratch->output[b], outW_val, outB_val,
+                 outR_val);
+  }
+  mnist_profile_end(MNIST_STAT_LAYER1_NS, layer1_ns);
+
+  stat_add(MNIST_STAT_INFER_NS, bpf_ktime_get_ns() - start_ns);
+  stat_add(MNIST_STAT_IMAGES, count);
+
+  bpf_probe_read_kernel(ctx->output, count * sizeof(ctx->output[0]),
+                        scratch->output);
+  mnist_debug("BPF_INFER: batch of %u executed\n", count);
+  return MNIST_RUN_OK;
+}
+
+static __always_inline int run_batch(struct mnist_run_ctx *ctx, int kernel) {
+  stat_add(MNIST_STAT_INVOCATIONS, 1);
+
+  __u32 *busy = scratch_get();
+  if (!busy)
+    return MNIST_RUN_EBUSY;
+
+  __u32 gen = model_get();
+  int ret = infer_batch(ctx, kernel, gen % MNIST_NR_WEIGHT_SETS);
+  model_put(gen);
+  scratch_put(busy);
+  return ret;
+}
+
+// On-demand variant: executed synchronously by user space through
+// BPF_PROG_RUN, with up to MNIST_BATCH_SIZE images and their logits carried
+// in the context buffer. This is the reference path.
+SEC("syscall")
+int bpf_mnist_infer_run(struct mnist_run_ctx *ctx) {
+  return run_batch(ctx, KERNEL_SCALAR);
+}
+
+#if MNIST_HAVE_SWAR
+// Same as bpf_mnist_infer_run, with the SWAR first-layer kernel
+SEC("syscall")
+int bpf_mnist_infer_swar(struct mnist_run_ctx *ctx) {
+  return run_batch(ctx, KERNEL_SWAR);
+}
+#endif
+
+#ifdef MNIST_PRUNED_BLOCKS
+// Same as bpf_mnist_infer_run, with the first layer computed from the kept
+// blocks of a pruned model (hidden_blocks)
+SEC("syscall")
+int bpf_mnist_infer_pruned(struct mnist_run_ctx *ctx) {
+  return run_batch(ctx, KERNEL_PRUNED);
+}
+#endif
+
+struct sparse_loop_ctx {
+  __u32 nnz;
+  __u32 set; // weight set
+  int err;
+};
+
+// bpf_loop callback accumulating hidden units c * MNIST_HIDDEN_CHUNK onwards
+// over the staged pixel list into mnist_activations
+static long sparse_hidden_chunk(__u32 c, struct sparse_loop_ctx *sctx) {
+  __u32 zero = 0;
+  __u32 set = sctx->set;
+  __u32 nnz = sctx->nnz;
+
+  struct sparse_scratch_val *scratch =
+      bpf_map_lookup_elem(&mnist_sparse_scratch, &zero);
+  struct hidden_weights_val *hidW_val =
+      bpf_map_lookup_elem(&hidden_weights, &set);
+  struct hidden_bias_val *hidB_val = bpf_map_lookup_elem(&hidden_bias, &set);
+  struct hidden_requant_val *hidR_val =
+      bpf_map_lookup_elem(&hidden_requant, &set);
+  struct activation_val *act = bpf_map_lookup_elem(&mnist_activations, &zero);
+
+  if (!scratch || !hidW_val || !hidB_val || !hidR_val || !act) {
+    sctx->err = 1;
+    return 1;
+  }
+  if (c >= MNIST_NR_HIDDEN_CHUNKS)
+    return 1;
+
+  int sums[MNIST_HIDDEN_CHUNK] = {};
+
+  for (__u32 n = 0; n < MNIST_MAX_NNZ; n++) {
+    if (n >= nnz)
+      break;
+    __u32 i = scratch->pixels[n].index;
+    int input_val = scratch->pixels[n].value;
+    if (i >= INPUT_SIZE)
+      continue;
 
-  for (int layer = 0; layer < MAX_LAYERS; layer++) {
-    if (layer == 0) {
 #pragma unroll
-      for (int j = 0; j < HIDDEN_SIZE; j++) {
-        int sum_j = hidB_ptr[j]; // bias is int32
+    for (int k = 0; k < MNIST_HIDDEN_CHUNK; k++) {
+      int j = c * MNIST_HIDDEN_CHUNK + k;
+      int weight = hidden_weight(hidW_val, MNIST_HIDDEN_W_INDEX(j, i));
+      sums[k] += weight * input_val;
+    }
+  }
 
-#pragma unroll 16
-        for (int i = 0; i < INPUT_SIZE; i++) {
-          int weight = hidW_ptr[j * INPUT_SIZE + i]; // int8, sign-extended
-          int input_val = in_ptr[i];                 // uint8, treat as int
-          sum_j += (weight * input_val);
-        }
-        hidden_layer[j] = leaky_relu_int32(sum_j);
-      }
-    } else if (layer == 1) {
 #pragma unroll
-      for (int o = 0; o < OUTPUT_SIZE; o++) {
-        int sum_o = outB_ptr[o];
+  for (int k = 0; k < MNIST_HIDDEN_CHUNK; k++) {
+    int j = c * MNIST_HIDDEN_CHUNK + k;
+    act->hidden[j] = hidden_unit(hidW_val, hidB_val, hidR_val, j, sums[k]);
+  }
+  return 0;
+}
+
+static __always_inline int infer_sparse(struct mnist_sparse_ctx *ctx,
+                                        __u32 set) {
+  __u32 zero = 0;
+  __u32 nnz = ctx->nnz;
+
+  if (nnz > MNIST_MAX_NNZ) {
+    stat_add(MNIST_STAT_ERRORS, 1);
+    return MNIST_RUN_EINVAL;
+  }
+
+  struct sparse_scratch_val *scratch =
+      bpf_map_lookup_elem(&mnist_sparse_scratch, &zero);
+  struct activation_val *act = bpf_map_lookup_elem(&mnist_activations, &zero);
+  struct output_weights_val *outW_val =
+      bpf_map_lookup_elem(&output_weights, &set);
+  struct output_bias_val *outB_val = bpf_map_lookup_elem(&output_bias, &set);
+  struct output_requant_val *outR_val =
+      bpf_map_lookup_elem(&output_requant, &set);
+  if (!scratch || !act || !outW_val || !outB_val || !outR_val) {
+    stat_add(MNIST_STAT_ERRORS, 1);
+    return MNIST_RUN_ENOMAP;
+  }
+
+  if (nnz)
+    bpf_probe_read_kernel(scratch->pixels, nnz * sizeof(struct mnist_pixel),
+                          ctx->pixels);
+
+  __u64 start_ns = bpf_ktime_get_ns();
+  struct sparse_loop_ctx sctx = {.nnz = nnz, .set = set};
+  int logits[OUTPUT_SIZE];
+
+  bpf_loop(MNIST_NR_HIDDEN_CHUNKS, sparse_hidden_chunk, &sctx, 0);
+  if (sctx.err) {
+    stat_add(MNIST_STAT_ERRORS, 1);
+    return MNIST_RUN_ENOMAP;
+  }
+  mnist_profile_end(MNIST_STAT_LAYER0_NS, start_ns);
+
+  __u64 layer1_ns = mnist_profile_start();
+  output_layer(act->hidden, logits, outW_val, outB_val, outR_val);
+  mnist_profile_end(MNIST_STAT_LAYER1_NS, layer1_ns);
+
+  stat_add(MNIST_STAT_INFER_NS, bpf_ktime_get_ns() - start_ns);
+  stat_add(MNIST_STAT_IMAGES, 1);
+
+  bpf_probe_read_kernel(ctx->output, sizeof(ctx->output), logits);
+  mnist_debug("BPF_INFER: sparse image with %u pixels executed\n", nnz);
+  return MNIST_RUN_OK;
+}
+
+// Sparse variant: like bpf_mnist_infer_run for a single image, but the
+// context lists only its non-zero pixels, and the first layer accumulates
+// just those columns of hidden_weights. With LAYOUT=blocked every pixel
+// touches contiguous runs of MNIST_WEIGHT_BLOCK weights.
+SEC("syscall")
+int bpf_mnist_infer_sparse(struct mnist_sparse_ctx *ctx) {
+  stat_add(MNIST_STAT_INVOCATIONS, 1);
+
+  __u32 *busy = scratch_get();
+  if (!busy)
+    return MNIST_RUN_EBUSY;
+
+  __u32 gen = model_get();
+  int ret = infer_sparse(ctx, gen % MNIST_NR_WEIGHT_SETS);
+  model_put(gen);
+  scratch_put(busy);
+  return ret;
+}
+
+struct net_loop_ctx {
+  __u32 layer; // index into mnist_model.layers
+  __u32 src;   // activation buffer holding the layer's inputs
+  __u32 set;   // weight set
+  int err;     // MNIST_RUN_* code of the first failure
+};
+
+// bpf_loop callback computing output unit j of one layer of the generic
+// network. The bounds checks double as the verifier's proof that every
+// weight and activation access stays inside its map value.
+static long net_unit(__u32 j, struct net_loop_ctx *nctx) {
+  __u32 zero = 0;
+  __u32 set = nctx->set;
+
+  struct mnist_model_desc *model = bpf_map_lookup_elem(&mnist_model, &set);
+  struct mnist_net_weights *w = bpf_map_lookup_elem(&mnist_net_weights, &set);
+  struct net_scratch_val *net = bpf_map_lookup_elem(&mnist_net_scratch, &zero);
+
+  if (!model || !w || !net) {
+    nctx->err = MNIST_RUN_ENOMAP;
+    return 1;
+  }
+
+  __u32 l = nctx->layer;
+  __u32 src = nctx->src & 1;
+  if (l >= MNIST_NET_MAX_LAYERS)
+    goto invalid;
+
+  const struct mnist_layer_desc *ld = &model->layers[l];
+  __u32 in_dim = ld->in_dim;
+  __u64 row = ld->weight_off + (__u64)j * in_dim;
+  __u64 bias = ld->bias_off + (__u64)j * sizeof(int);
+  __u64 layer_rq = ld->requant_off;
+  __u64 unit_rq = layer_rq + MNIST_LAYER_REQUANT_SIZE(j);
+
+  if (j >= MNIST_NET_MAX_DIM || in_dim > MNIST_NET_MAX_DIM ||
+      row > MNIST_NET_BLOB_SIZE || bias > MNIST_NET_BLOB_SIZE - sizeof(int) ||
+      layer_rq > MNIST_NET_BLOB_SIZE - sizeof(struct mnist_layer_requant) ||
+      unit_rq > MNIST_NET_BLOB_SIZE - sizeof(struct mnist_requant))
+    goto invalid;
+
+  const __u8 *in = net->act[src];
+  int sum = *(const int *)&w->data[bias];
+
+#pragma unroll 4
+  for (__u32 i = 0; i < MNIST_NET_MAX_DIM; i++) {
+    if (i >= in_dim)
+      break;
+    sum += (__s8)w->data[row + i] * in[i];
+  }
+
+  net->act[src ^ 1][j] =
+      requantize(sum, (const struct mnist_layer_requant *)&w->data[layer_rq],
+                 (const struct mnist_requant *)&w->data[unit_rq],
+                 ld->activation == MNIST_ACT_LEAKY_RELU);
+  return 0;
+
+invalid:
+  nctx->err = MNIST_RUN_EINVAL;
+  return 1;
+}
+
+// bpf_loop callback running the whole generic network over staged image b
+static long net_image(__u32 b, struct net_loop_ctx *bctx) {
+  __u32 zero = 0;
+  __u32 set = bctx->set;
+
+  struct mnist_model_desc *model = bpf_map_lookup_elem(&mnist_model, &set);
+  struct scratch_val *scratch = bpf_map_lookup_elem(&mnist_scratch, &zero);
+  struct net_scratch_val *net = bpf_map_lookup_elem(&mnist_net_scratch, &zero);
+
+  if (!model || !scratch || !net) {
+    bctx->err = MNIST_RUN_ENOMAP;
+    return 1;
+  }
+  if (b >= MNIST_BATCH_SIZE)
+    return 1;
+
+#pragma unroll 8
+  for (int i = 0; i < INPUT_SIZE; i++)
+    net->act[0][i] = scratch->input[b][i];
+
+  struct net_loop_ctx nctx = {.src = 0, .set = set};
+  __u32 nr_layers = model->nr_layers;
 
+  for (__u32 l = 0; l < MNIST_NET_MAX_LAYERS; l++) {
+    if (l >= nr_layers)
+      break;
+    nctx.layer = l;
+    bpf_loop(model->layers[l].out_dim, net_unit, &nctx, 0);
+    if (nctx.err) {
+      bctx->err = nctx.err;
+      return 1;
+    }
+    nctx.src ^= 1;
+  }
+
+  const __u8 *logits = net->act[nctx.src & 1];
 #pragma unroll
-        for (int j = 0; j < HIDDEN_SIZE; j++) {
-          int weight = outW_ptr[o * HIDDEN_SIZE + j]; // int8
-          int hidden_val = hidden_layer[j];
-          sum_o += (weight * hidden_val);
-        }
-        out_ptr[o] = leaky_relu_int32(sum_o);
-      }
+  for (int o = 0; o < OUTPUT_SIZE; o++)
+    scratch->output[b][o] = logits[o];
+  return 0;
+}
+
+static __always_inline int infer_net(struct mnist_run_ctx *ctx, __u32 set) {
+  __u32 zero = 0;
+  __u32 count = ctx->count;
+
+  if (count == 0 || count > MNIST_BATCH_SIZE) {
+    stat_add(MNIST_STAT_ERRORS, 1);
+    return MNIST_RUN_EINVAL;
+  }
+
+  struct scratch_val *scratch = bpf_map_lookup_elem(&mnist_scratch, &zero);
+  struct mnist_model_desc *model = bpf_map_lookup_elem(&mnist_model, &set);
+  if (!scratch || !model) {
+    stat_add(MNIST_STAT_ERRORS, 1);
+    return MNIST_RUN_ENOMAP;
+  }
+
+  __u32 nr_layers = model->nr_layers;
+  if (nr_layers == 0 || nr_layers > MNIST_NET_MAX_LAYERS ||
+      model->layers[0].in_dim != INPUT_SIZE ||
+      model->layers[nr_layers - 1].out_dim != OUTPUT_SIZE) {
+    stat_add(MNIST_STAT_ERRORS, 1);
+    return MNIST_RUN_EINVAL;
+  }
+
+  bpf_probe_read_kernel(scratch->input, count * INPUT_SIZE, ctx->input);
+
+  __u64 start_ns = bpf_ktime_get_ns();
+  struct net_loop_ctx bctx = {.set = set};
+
+  bpf_loop(count, net_image, &bctx, 0);
+  if (bctx.err) {
+    stat_add(MNIST_STAT_ERRORS, 1);
+    return bctx.err;
+  }
+
+  stat_add(MNIST_STAT_INFER_NS, bpf_ktime_get_ns() - start_ns);
+  stat_add(MNIST_STAT_IMAGES, count);
+
+  bpf_probe_read_kernel(ctx->output, count * sizeof(ctx->output[0]),
+                        scratch->output);
+  mnist_debug("BPF_INFER: %u-layer net ran on %u images\n", nr_layers, count);
+  return MNIST_RUN_OK;
+}
+
+// Generic variant: same context as bpf_mnist_infer_run, but the network is
+// whatever mnist_model describes, so deeper or narrower models need no
+// rebuild of this object
+SEC("syscall")
+int bpf_mnist_infer_net(struct mnist_run_ctx *ctx) {
+  stat_add(MNIST_STAT_INVOCATIONS, 1);
+
+  __u32 *busy = scratch_get();
+  if (!busy)
+    return MNIST_RUN_EBUSY;
+
+  __u32 gen = model_get();
+  int ret = infer_net(ctx, gen % MNIST_NR_WEIGHT_SETS);
+  model_put(gen);
+  scratch_put(busy);
+  return ret;
+}
+
+#ifdef MNIST_ARENA
+// The arena, at its fixed user-space address. The verifier only lets a
+// program use arena pointers if the program references the arena map, so
+// the map's address is taken here too.
+static __always_inline struct mnist_arena __arena *arena_base(void) {
+  asm volatile("" ::"r"(&mnist_arena));
+  return (struct mnist_arena __arena *)MNIST_ARENA_ADDR;
+}
+
+struct arena_loop_ctx {
+  __u32 set;   // weight set
+  __u32 cpu;   // row of mnist_arena.act
+  __u32 slot;  // slot whose image is being run
+  __u32 layer; // index into the descriptor's layers
+  int err;     // MNIST_RUN_* code of the first failure
+};
+
+// bpf_loop callback computing output unit j of one layer, like net_unit but
+// reading and writing the arena. Layer 0 reads the slot's pixels directly;
+// layer l writes act[l & 1]. The arena needs no bounds checks for the
+// verifier's sake, so the checks below only reject a bad descriptor.
+static long arena_unit(__u32 j, struct arena_loop_ctx *actx) {
+  struct mnist_arena __arena *arena = arena_base();
+  struct mnist_arena_model __arena *model = &arena->models[actx->set];
+  __u32 l = actx->layer;
+
+  if (l >= MNIST_NET_MAX_LAYERS || actx->cpu >= MNIST_ARENA_MAX_CPUS)
+    goto invalid;
+
+  struct mnist_layer_desc ld = model->desc.layers[l];
+  __u64 row = ld.weight_off + (__u64)j * ld.in_dim;
+  __u64 bias = ld.bias_off + (__u64)j * sizeof(int);
+  __u64 layer_rq = ld.requant_off;
+  __u64 unit_rq = layer_rq + MNIST_LAYER_REQUANT_SIZE(j);
+
+  if (j >= MNIST_NET_MAX_DIM || ld.in_dim > MNIST_NET_MAX_DIM ||
+      row > MNIST_ARENA_BLOB_SIZE - ld.in_dim ||
+      bias > MNIST_ARENA_BLOB_SIZE - sizeof(int) ||
+      layer_rq > MNIST_ARENA_BLOB_SIZE - sizeof(struct mnist_layer_requant) ||
+      unit_rq > MNIST_ARENA_BLOB_SIZE - sizeof(struct mnist_requant))
+    goto invalid;
+
+  const __u8 __arena *in = l ? arena->act[actx->cpu][(l - 1) & 1]
+                             : arena->slots[actx->slot].input;
+  const __s8 __arena *w = (const __s8 __arena *)&model->blob[row];
+  int sum = *(const int __arena *)&model->blob[bias];
+
+#pragma unroll 4
+  for (__u32 i = 0; i < MNIST_NET_MAX_DIM; i++) {
+    if (i >= ld.in_dim)
+      break;
+    sum += w[i] * in[i];
+  }
+
+  // requantize() takes kernel pointers, so copy the records out
+  struct mnist_layer_requant lrq =
+      *(const struct mnist_layer_requant __arena *)&model->blob[layer_rq];
+  struct mnist_requant urq =
+      *(const struct mnist_requant __arena *)&model->blob[unit_rq];
+
+  arena->act[actx->cpu][l & 1][j] =
+      requantize(sum, &lrq, &urq, ld.activation == MNIST_ACT_LEAKY_RELU);
+  return 0;
+
+invalid:
+  actx->err = MNIST_RUN_EINVAL;
+  return 1;
+}
+
+// bpf_loop callback running the whole network over slot first + b
+static long arena_image(__u32 b, struct arena_loop_ctx *bctx) {
+  struct mnist_arena __arena *arena = arena_base();
+  struct mnist_model_desc __arena *desc = &arena->models[bctx->set].desc;
+  struct arena_loop_ctx actx = *bctx;
+  __u32 nr_layers = desc->nr_layers;
+
+  actx.slot += b;
+  if (actx.slot >= MNIST_ARENA_SLOTS || actx.cpu >= MNIST_ARENA_MAX_CPUS)
+    return 1;
+
+  for (__u32 l = 0; l < MNIST_NET_MAX_LAYERS; l++) {
+    if (l >= nr_layers)
+      break;
+    actx.layer = l;
+    bpf_loop(desc->layers[l].out_dim, arena_unit, &actx, 0);
+    if (actx.err) {
+      bctx->err = actx.err;
+      return 1;
     }
   }
 
-  bpf_trace_printk("BPF_INFER: inference executed\n",
-                   sizeof("BPF_INFER: inference executed\n") - 1);
+  const __u8 __arena *logits = arena->act[actx.cpu][(nr_layers - 1) & 1];
+  __s32 __arena *out = arena->slots[actx.slot].output;
+#pragma unroll
+  for (int o = 0; o < OUTPUT_SIZE; o++)
+    out[o] = logits[o];
   return 0;
 }
 
+static __always_inline int infer_arena(struct mnist_arena_ctx *ctx,
+                                       __u32 set) {
+  struct mnist_arena __arena *arena = arena_base();
+  __u32 first = ctx->first;
+  __u32 count = ctx->count;
+  __u32 cpu = bpf_get_smp_processor_id();
+
+  if (count == 0 || first >= MNIST_ARENA_SLOTS ||
+      count > MNIST_ARENA_SLOTS - first || cpu >= MNIST_ARENA_MAX_CPUS) {
+    stat_add(MNIST_STAT_ERRORS, 1);
+    return MNIST_RUN_EINVAL;
+  }
+
+  struct mnist_model_desc __arena *desc = &arena->models[set].desc;
+  __u32 nr_layers = desc->nr_layers;
+  if (nr_layers == 0 || nr_layers > MNIST_NET_MAX_LAYERS ||
+      desc->layers[0].in_dim != INPUT_SIZE ||
+      desc->layers[nr_layers - 1].out_dim != OUTPUT_SIZE) {
+    stat_add(MNIST_STAT_ERRORS, 1);
+    return MNIST_RUN_EINVAL;
+  }
+
+  __u64 start_ns = bpf_ktime_get_ns();
+  struct arena_loop_ctx bctx = {.set = set, .cpu = cpu, .slot = first};
+
+  bpf_loop(count, arena_image, &bctx, 0);
+  if (bctx.err) {
+    stat_add(MNIST_STAT_ERRORS, 1);
+    return bctx.err;
+  }
+
+  stat_add(MNIST_STAT_INFER_NS, bpf_ktime_get_ns() - start_ns);
+  stat_add(MNIST_STAT_IMAGES, count);
+  mnist_debug("BPF_INFER: %u-layer arena net ran on %u slots\n", nr_layers,
+              count);
+  return MNIST_RUN_OK;
+}
+
+// Arena variant of bpf_mnist_infer_net: the images, the network and the
+// logits all live in the arena, which user space reads and writes directly.
+// The context only names the slots to run. The loader populates every arena
+// page before the first run. Syscall programs are preemptible, so the CPU's
+// activation rows are only ours while we hold its mnist_busy word.
+SEC("syscall")
+int bpf_mnist_infer_arena(struct mnist_arena_ctx *ctx) {
+  stat_add(MNIST_STAT_INVOCATIONS, 1);
+
+  __u32 *busy = scratch_get();
+  if (!busy)
+    return MNIST_RUN_EBUSY;
+
+  __u32 gen = model_get();
+  int ret = infer_arena(ctx, gen % MNIST_NR_WEIGHT_SETS);
+  model_put(gen);
+  scratch_put(busy);
+  return ret;
+}
+#endif
+
 char _license[] SEC("license") = "GPL";
@@ -0,0 +1,470 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// kerinferencel.h
+// Definitions shared between the eBPF program and the user-space loader.
+// Everything in here is ABI: the BPF side and user space must agree on it.
+
+#ifndef __KERINFERENCEL_H
+#define __KERINFERENCEL_H
+
+#include <linux/types.h>
+
+// Model dimensions. The hidden layer width is baked into each BPF object
+// (make HIDDEN_SHAPES="N ...", each up to MNIST_MAX_HIDDEN); the loader
+// embeds one object per width and runs the one matching the model file.
+// Outside the BPF objects HIDDEN_SIZE is only the loader's default width.
+#define INPUT_SIZE 784
+#ifndef HIDDEN_SIZE
+#define HIDDEN_SIZE 32
+#endif
+#define OUTPUT_SIZE 10
+
+#define MNIST_MAX_HIDDEN 256
+
+#if HIDDEN_SIZE < 1 || HIDDEN_SIZE > MNIST_MAX_HIDDEN
+#error "HIDDEN_SIZE must be between 1 and MNIST_MAX_HIDDEN"
+#endif
+
+// Memory layout of the hidden_weights map, fixed at build time
+// (make LAYOUT=blocked BLOCK=N). Row-major is what train.py exports:
+// one 784-byte row per hidden unit. The blocked layout interleaves
+// MNIST_WEIGHT_BLOCK hidden units per input pixel, so a single pass over the
+// image updates a whole block of accumulators.
+#define MNIST_LAYOUT_ROW_MAJOR 0
+#define MNIST_LAYOUT_BLOCKED 1
+
+#ifndef MNIST_HIDDEN_LAYOUT
+#define MNIST_HIDDEN_LAYOUT MNIST_LAYOUT_ROW_MAJOR
+#endif
+
+#ifndef MNIST_WEIGHT_BLOCK
+#define MNIST_WEIGHT_BLOCK 8
+#endif
+
+#if HIDDEN_SIZE % MNIST_WEIGHT_BLOCK
+#error "HIDDEN_SIZE must be a multiple of MNIST_WEIGHT_BLOCK"
+#endif
+
+#define MNIST_NR_WEIGHT_BLOCKS (HIDDEN_SIZE / MNIST_WEIGHT_BLOCK)
+
+// Index of the weight for hidden unit j and input pixel i
+#if MNIST_HIDDEN_LAYOUT == MNIST_LAYOUT_BLOCKED
+#define MNIST_HIDDEN_W_INDEX(j, i)                                             \
+  ((((j) / MNIST_WEIGHT_BLOCK) * INPUT_SIZE + (i)) * MNIST_WEIGHT_BLOCK +      \
+   (j) % MNIST_WEIGHT_BLOCK)
+#else
+#define MNIST_HIDDEN_W_INDEX(j, i) ((j) * INPUT_SIZE + (i))
+#endif
+
+// Precision of the hidden_weights map, fixed at build time (make
+// WEIGHTS=int4). INT4 packs two weights per byte: weight k, in
+// MNIST_HIDDEN_W_INDEX order, is the low nibble of byte k / 2 if k is even
+// and the high nibble if it is odd, as two's complement in [-8, 7]. The
+// nibbles are followed by one shift per hidden unit, at most
+// MNIST_MAX_HIDDEN_SHIFT, so rows quantized with different scales still
+// share one: unit j computes bias[j] + (sum_i w[j][i] * x[i] << shift[j]).
+// A weight shifted left by its row's shift always fits in an int8, which is
+// how user space expands INT4 weights for the generic network and the
+// reference engine, bit for bit.
+#ifndef MNIST_HIDDEN_WEIGHT_BITS
+#define MNIST_HIDDEN_WEIGHT_BITS 8
+#endif
+
+#if MNIST_HIDDEN_WEIGHT_BITS != 8 && MNIST_HIDDEN_WEIGHT_BITS != 4
+#error "MNIST_HIDDEN_WEIGHT_BITS must be 8 or 4"
+#endif
+
+#define MNIST_MAX_HIDDEN_SHIFT 4
+
+// Size of a hidden_weights map value, and of a model file's
+// MNIST_TENSOR_HIDDEN_WEIGHTS section, for hidden units of bits-bit weights
+#define MNIST_HIDDEN_WEIGHTS_SIZE(bits, hidden)                                \
+  ((bits) == 4 ? INPUT_SIZE * (hidden) / 2 + (hidden) : INPUT_SIZE * (hidden))
+
+// The SWAR first-layer kernel (bpf_mnist_infer_swar) multiplies one pixel
+// against 8 interleaved int8 weights at a time, so it needs the blocked
+// layout with a block size that is a multiple of 8
+#define MNIST_HAVE_SWAR                                                        \
+  (MNIST_HIDDEN_LAYOUT == MNIST_LAYOUT_BLOCKED &&                              \
+   MNIST_WEIGHT_BLOCK % 8 == 0 && MNIST_HIDDEN_WEIGHT_BITS == 8)
+
+// Block-sparse hidden weights. train.py --prune-blocks K keeps, for every
+// hidden unit, the K runs of MNIST_PRUNE_BLOCK consecutive pixels with the
+// largest weights and prunes the rest to zero. A model file's
+// MNIST_TENSOR_HIDDEN_BLOCKS section then lists the kept blocks of each
+// unit: __u8 block[hidden][K], pixel block indices (pixel / MNIST_PRUNE_BLOCK)
+// in ascending order, followed by __s8 weights[hidden][K][MNIST_PRUNE_BLOCK].
+// The dense hidden weights hold the same values, zeros included. A build
+// with make PRUNED=K (MNIST_PRUNED_BLOCKS) adds bpf_mnist_infer_pruned,
+// whose first layer only reads those K blocks per unit.
+#define MNIST_PRUNE_BLOCK 8
+#define MNIST_NR_PIXEL_BLOCKS (INPUT_SIZE / MNIST_PRUNE_BLOCK)
+
+#define MNIST_HIDDEN_BLOCKS_SIZE(hidden, k)                                    \
+  ((hidden) * (k) * (1 + MNIST_PRUNE_BLOCK))
+
+#ifdef MNIST_PRUNED_BLOCKS
+#if MNIST_PRUNED_BLOCKS < 1 || MNIST_PRUNED_BLOCKS > MNIST_NR_PIXEL_BLOCKS
+#error "MNIST_PRUNED_BLOCKS must be between 1 and MNIST_NR_PIXEL_BLOCKS"
+#endif
+#if MNIST_HIDDEN_WEIGHT_BITS != 8
+#error "MNIST_PRUNED_BLOCKS needs 8-bit hidden weights"
+#endif
+#endif
+
+// Request slots for the map-based (tracepoint) interface. mnist_input,
+// mnist_output and mnist_slot_state all have one entry per slot; the loader
+// sizes them at load time (at most MNIST_MAX_SLOTS) and seeds the
+// mnist_free_slots queue with every slot index.
+#define MNIST_MAX_SLOTS 64
+#define MNIST_DEFAULT_SLOTS 1
+
+// Slot life cycle, stored in mnist_slot_state[slot]:
+//   client pops a free slot index from mnist_free_slots
+//   client writes mnist_input[slot], then sets FREE -> PENDING
+//   program claims it with PENDING -> BUSY, runs, then sets BUSY -> DONE
+//   client reads mnist_output[slot], sets DONE -> FREE, pushes the index back
+// mnist_input, mnist_output, mnist_slot_state and mnist_control are
+// BPF_F_MMAPABLE, so all but the queue operations can be plain loads and
+// stores on an mmap() of the map; the state and control words must then be
+// accessed atomically. Element i of a mapped array starts at
+// i * MNIST_MMAP_STRIDE(value size).
+#define MNIST_MMAP_STRIDE(size) (((size) + 7) & ~(__u64)7)
+
+#define MNIST_SLOT_FREE 0
+#define MNIST_SLOT_PENDING 1
+#define MNIST_SLOT_BUSY 2
+#define MNIST_SLOT_DONE 3
+#define MNIST_SLOT_ERROR 4
+
+// Keys of the mnist_control array (one __u32 each, so every writer updates
+// only its own word). A client stores its request seq in GENERATION after
+// marking its slot pending; the tracepoint program records the generation
+// it last found nothing to do for in SERVED, and returns right away while
+// the two match. A non-zero TARGET_TGID, set by the loader, restricts the
+// tracepoint program to syscalls made by that process. WEIGHT_SET counts
+// model activations; WEIGHT_SET % MNIST_NR_WEIGHT_SETS is the parameter set
+// in use. A non-zero FORCE_COMPUTE, for overhead benchmarks only, makes
+// every syscall run the network over slot 0, bypassing the gate and the slot
+// protocol. A non-zero CACHE lets the tracepoint program serve repeated
+// images from mnist_cache. UDP_PORT is the port the XDP program serves
+// requests on, in host byte order (0: pass every packet up the stack).
+enum mnist_ctl {
+  MNIST_CTL_GENERATION,
+  MNIST_CTL_SERVED,
+  MNIST_CTL_TARGET_TGID,
+  MNIST_CTL_WEIGHT_SET,
+  MNIST_CTL_FORCE_COMPUTE,
+  MNIST_CTL_CACHE,
+  MNIST_CTL_UDP_PORT,
+  MNIST_NR_CTL,
+};
+
+// Every parameter map (weights, biases and the generic network) holds this
+// many generations of the model, one per key. Programs read WEIGHT_SET once
+// per request or batch and use that entry for all layers, so a new model is
+// written into the inactive set and activated with one 4-byte store of the
+// incremented counter; no
+// request ever sees a half-written model. The writer must not rewrite the
+// previously active set until invocations that started before the switch
+// have finished.
+#define MNIST_NR_WEIGHT_SETS 2
+
+// Map value of mnist_input. seq is chosen by the client, must be non-zero
+// and should be unique (it doubles as the gating generation), and is echoed
+// into the matching mnist_output entry so a reader can tell its result apart
+// from a stale one.
+struct input_val {
+  __u32 seq;
+  __u8 input[INPUT_SIZE];
+};
+
+// Map value of mnist_output
+struct output_val {
+  __u32 seq;
+  __s32 output[OUTPUT_SIZE];
+};
+
+// Record published to the mnist_results ring buffer for every request slot
+// the program serves, so clients can wait on the ring buffer instead of
+// polling mnist_output.
+struct mnist_result {
+  __u32 seq;     // request sequence number from input_val
+  __u32 slot;    // slot the request was served from
+  __s32 logits[OUTPUT_SIZE];
+  __u32 argmax;  // predicted digit
+  __u32 reserved;
+  __u64 ktime_ns; // bpf_ktime_get_ns() at completion
+};
+
+#define MNIST_RESULTS_RINGBUF_SIZE (256 * 1024)
+
+// Result cache of the tracepoint program: an LRU hash from a 64-bit hash of
+// the pixels to the logits and the WEIGHT_SET value they were computed with,
+// so entries from an earlier model never match. Sized by the loader.
+#define MNIST_DEFAULT_CACHE_ENTRIES 4096
+#define MNIST_MAX_CACHE_ENTRIES (1 << 20)
+
+// UDP protocol of bpf_mnist_infer_xdp. A request is one datagram to the
+// configured port, over IPv4 without options, carrying an id chosen by the
+// client and one image. The program turns the packet around in place into a
+// reply to the sender: the id echoed unchanged, then the predicted digit and
+// the logits in network byte order. UDP checksums of replies are zero.
+#define MNIST_UDP_DEFAULT_PORT 7840
+
+struct mnist_udp_request {
+  __u32 id;
+  __u8 pixels[INPUT_SIZE];
+};
+
+struct mnist_udp_reply {
+  __u32 id;
+  __u32 argmax;
+  __s32 logits[OUTPUT_SIZE];
+};
+
+// Counters kept in the per-CPU mnist_stats array map, one key each. User
+// space sums the per-CPU values.
+enum mnist_stat {
+  MNIST_STAT_INVOCATIONS,  // program runs
+  MNIST_STAT_SKIPPED,      // runs that found no work (gated or no pending slot)
+  MNIST_STAT_IMAGES,       // images classified
+  MNIST_STAT_INFER_NS,     // total time spent in the network, in ns
+  MNIST_STAT_ERRORS,       // failed runs (map lookups, bad requests)
+  MNIST_STAT_BUSY,         // runs turned away by a preempted run (mnist_busy)
+  MNIST_STAT_LAYER0_NS,    // time in the hidden layer (make PROFILE=1 only)
+  MNIST_STAT_LAYER1_NS,    // time in the output layer (make PROFILE=1 only)
+  MNIST_STAT_CACHE_HITS,   // requests served from mnist_cache
+  MNIST_STAT_CACHE_MISSES, // requests computed and added to mnist_cache
+  MNIST_NR_STATS,
+};
+
+// Maximum number of images per on-demand run. Baked into the BPF object and
+// the loader alike (make BATCH=N); the per-CPU scratch value, which holds
+// the images, hidden activations and logits of a whole batch, has to stay
+// under the 32 KiB per-CPU allocation limit. That caps it at 32 with the
+// default hidden layer, and at 30 with 256 hidden units.
+#ifndef MNIST_BATCH_SIZE
+#define MNIST_BATCH_SIZE 8
+#endif
+
+#if MNIST_BATCH_SIZE < 1 || MNIST_BATCH_SIZE > 32
+#error "MNIST_BATCH_SIZE must be between 1 and 32"
+#endif
+
+#if MNIST_BATCH_SIZE * (INPUT_SIZE + HIDDEN_SIZE + 4 * OUTPUT_SIZE) > 32768
+#error "MNIST_BATCH_SIZE too large for HIDDEN_SIZE (per-CPU scratch > 32 KiB)"
+#endif
+
+// Context passed to the on-demand program through BPF_PROG_RUN. The caller
+// fills in count images; the program writes count rows of logits back into
+// the same buffer, which the kernel copies back to ctx_in on return.
+struct mnist_run_ctx {
+  __u32 count;
+  __u32 reserved;
+  __u8 input[MNIST_BATCH_SIZE][INPUT_SIZE];
+  __s32 output[MNIST_BATCH_SIZE][OUTPUT_SIZE];
+};
+
+// Sparse input for bpf_mnist_infer_sparse: only the non-zero pixels of one
+// image, as (index, value) pairs. Typical digits have about 150 of them;
+// images with more than MNIST_MAX_NNZ must go through the dense program.
+#define MNIST_MAX_NNZ 384
+
+struct mnist_pixel {
+  __u16 index; // 0..INPUT_SIZE-1
+  __u8 value;
+  __u8 reserved;
+};
+
+struct mnist_sparse_ctx {
+  __u32 nnz;
+  __u32 reserved;
+  struct mnist_pixel pixels[MNIST_MAX_NNZ];
+  __s32 output[OUTPUT_SIZE];
+};
+
+// Requantization of a layer's int32 sums back to uint8 activations, so that
+// every layer, the last one included, computes uint8 x int8 products like
+// PyTorch's quantized Linear. A real multiplier m is stored in fixed point as
+// multiplier * 2^-shift, and MNIST_REQUANT(x, rq) is x * m rounded half up,
+// in 64-bit arithmetic. Output unit j of a layer without activation is
+//   q = clamp(zero_point + MNIST_REQUANT(sum_j, unit[j]), 0, 255)
+// A MNIST_ACT_LEAKY_RELU layer first requantizes around linear_zero_point,
+// then applies PyTorch's quantized LeakyReLU to d = q - linear_zero_point:
+//   q' = clamp(zero_point + MNIST_REQUANT(d, d >= 0 ? pos : neg), 0, 255)
+// The biases are in units of the sums (input scale times weight scale),
+// with the input zero point already folded in.
+#define MNIST_MAX_REQUANT_SHIFT 62
+
+#define MNIST_REQUANT(x, rq)                                                   \
+  (((__s64)(x) * (rq).multiplier + ((__s64)1 << ((rq).shift - 1))) >>          \
+   (rq).shift)
+
+struct mnist_requant {
+  __s32 multiplier; // non-negative
+  __u32 shift;      // 1..MNIST_MAX_REQUANT_SHIFT
+};
+
+// Followed by one struct mnist_requant per output unit
+struct mnist_layer_requant {
+  __s32 linear_zero_point; // of the linear outputs, for MNIST_ACT_LEAKY_RELU
+  __s32 zero_point;        // of the layer's activations
+  // LeakyReLU multipliers for d >= 0 and d < 0
+  struct mnist_requant pos;
+  struct mnist_requant neg;
+};
+
+#define MNIST_LAYER_REQUANT_SIZE(units)                                        \
+  (sizeof(struct mnist_layer_requant) + (units) * sizeof(struct mnist_requant))
+
+// Generic N-layer network run by bpf_mnist_infer_net. The mnist_model map
+// holds a descriptor of up to MNIST_NET_MAX_LAYERS fully connected layers,
+// each with int8 weights ([out_dim][in_dim], row-major), int32 biases and
+// its requantization at byte offsets into one packed blob, the single value
+// of mnist_net_weights. The first layer must take INPUT_SIZE inputs and the
+// last must produce OUTPUT_SIZE logits; no layer may be wider than
+// MNIST_NET_MAX_DIM.
+#define MNIST_NET_MAX_LAYERS 4
+#define MNIST_NET_MAX_DIM INPUT_SIZE
+#define MNIST_NET_BLOB_SIZE (1 << 20)
+
+// Activation applied to a layer's outputs
+#define MNIST_ACT_NONE 0
+#define MNIST_ACT_LEAKY_RELU 1
+#define MNIST_NR_ACT 2
+
+struct mnist_layer_desc {
+  __u32 in_dim;
+  __u32 out_dim;
+  __u32 activation;  // MNIST_ACT_*
+  __u32 weight_off;  // byte offset of the weights in the blob
+  __u32 bias_off;    // byte offset of the biases, 4-byte aligned
+  __u32 requant_off; // byte offset of the requantization, 4-byte aligned
+};
+
+// Value of mnist_model. In a model file's MNIST_TENSOR_NET section it is
+// followed by blob_size bytes of blob.
+struct mnist_model_desc {
+  __u32 nr_layers;
+  __u32 blob_size;
+  struct mnist_layer_desc layers[MNIST_NET_MAX_LAYERS];
+};
+
+// Value of mnist_net_weights. The slack past the blob lets the program bound
+// a weight row with a single check on its start offset.
+struct mnist_net_weights {
+  __u8 data[MNIST_NET_BLOB_SIZE + MNIST_NET_MAX_DIM];
+};
+
+// Arena mode (make ARENA=1; needs BPF_MAP_TYPE_ARENA, Linux 6.9+, and
+// clang 18+). A single arena, mapped at MNIST_ARENA_ADDR both in the
+// programs and in user space, holds everything bpf_mnist_infer_arena
+// touches: request slots that user space fills and reads with plain stores
+// and loads, the generic network of each weight set, and per-CPU
+// activations. Its hot path does no map lookups, and its blob fits
+// MNIST_NET_MAX_LAYERS layers of MNIST_NET_MAX_DIM units, which
+// mnist_net_weights does not.
+#define MNIST_ARENA_ADDR (1ULL << 44)
+#define MNIST_ARENA_SLOTS 256
+#define MNIST_ARENA_MAX_CPUS 256
+#define MNIST_ARENA_BLOB_SIZE (4 << 20)
+#define MNIST_ARENA_PAGE_SIZE 4096
+
+struct mnist_arena_slot {
+  __u8 input[INPUT_SIZE];
+  __s32 output[OUTPUT_SIZE];
+};
+
+// A weight set: the same descriptor and blob as mnist_model and
+// mnist_net_weights
+struct mnist_arena_model {
+  struct mnist_model_desc desc;
+  __u8 blob[MNIST_ARENA_BLOB_SIZE];
+};
+
+struct mnist_arena {
+  struct mnist_arena_slot slots[MNIST_ARENA_SLOTS];
+  __u8 act[MNIST_ARENA_MAX_CPUS][2][MNIST_NET_MAX_DIM];
+  struct mnist_arena_model models[MNIST_NR_WEIGHT_SETS];
+};
+
+#define MNIST_ARENA_PAGES                                                      \
+  ((sizeof(struct mnist_arena) + MNIST_ARENA_PAGE_SIZE - 1) /                  \
+   MNIST_ARENA_PAGE_SIZE)
+
+// Largest blob a generic network program of this build accepts
+#ifdef MNIST_ARENA
+#define MNIST_NET_MAX_BLOB_SIZE MNIST_ARENA_BLOB_SIZE
+#else
+#define MNIST_NET_MAX_BLOB_SIZE MNIST_NET_BLOB_SIZE
+#endif
+
+// BPF_PROG_RUN context of bpf_mnist_infer_arena, which runs the active
+// weight set's network over the count slots starting at first
+struct mnist_arena_ctx {
+  __u32 first;
+  __u32 count;
+};
+
+// Model file (mnist_model.bin), written by train.py and mmap()ed by the
+// loader: a struct mnist_model_header followed by tensor sections, each
+// starting on a MNIST_MODEL_ALIGN boundary. All fields are little-endian.
+#define MNIST_MODEL_MAGIC 0x4c4e494b // "KINL"
+#define MNIST_MODEL_VERSION 3
+#define MNIST_MODEL_ALIGN 64
+
+enum mnist_tensor {
+  MNIST_TENSOR_HIDDEN_WEIGHTS, // __s8 [hidden][input], in header.layout
+                               // (INT4: nibbles, then __u8 shift[hidden])
+  MNIST_TENSOR_HIDDEN_BIAS,    // __s32 [hidden]
+  MNIST_TENSOR_OUTPUT_WEIGHTS, // __s8 [output][hidden]
+  MNIST_TENSOR_OUTPUT_BIAS,    // __s32 [output]
+  MNIST_TENSOR_HIDDEN_SCALES,  // float [hidden], per-unit weight scales
+  MNIST_TENSOR_OUTPUT_SCALES,  // float [output], per-unit weight scales
+  MNIST_TENSOR_NET,            // struct mnist_model_desc + blob, for --net
+  MNIST_TENSOR_HIDDEN_REQUANT, // mnist_layer_requant + [hidden], LeakyReLU
+  MNIST_TENSOR_OUTPUT_REQUANT, // mnist_layer_requant + [output]
+  MNIST_TENSOR_HIDDEN_BLOCKS,  // kept blocks of a pruned model, see
+                               // MNIST_PRUNE_BLOCK
+  MNIST_NR_TENSORS,
+};
+
+// A missing tensor has offset and size 0
+struct mnist_tensor_desc {
+  __u64 offset; // from the start of the file
+  __u64 size;   // in bytes
+};
+
+struct mnist_model_header {
+  __u32 magic;        // MNIST_MODEL_MAGIC
+  __u32 version;      // MNIST_MODEL_VERSION
+  __u32 header_size;  // sizeof(struct mnist_model_header)
+  __u32 checksum;     // CRC-32 of the whole file, with this field zeroed
+  __u32 input_size;
+  __u32 hidden_size;  // 0 if the file only carries MNIST_TENSOR_NET
+  __u32 output_size;
+  __u32 layout;       // MNIST_LAYOUT_* of MNIST_TENSOR_HIDDEN_WEIGHTS
+  __u32 weight_block; // hidden units per block, for MNIST_LAYOUT_BLOCKED
+  __u32 hidden_bits;  // bits per hidden weight, 4 or 8 (0 means 8)
+  // Activation quantization parameters (real = scale * (q - zero_point)) of
+  // the pixels, hidden activations and logits, for user-space tooling; the
+  // programs only use the requantization tensors. 0 scales mean unknown.
+  float input_scale;
+  float hidden_scale;
+  float output_scale;
+  __s32 input_zero_point;
+  __s32 hidden_zero_point;
+  __s32 output_zero_point;
+  struct mnist_tensor_desc tensors[MNIST_NR_TENSORS];
+};
+
+// Return values of the on-demand program (visible as test_run retval)
+#define MNIST_RUN_OK 0
+#define MNIST_RUN_ENOMAP 1  // a parameter map lookup failed
+#define MNIST_RUN_EINVAL 2  // count/nnz out of range for the context
+// Another run on this CPU was preempted while holding its scratch; nothing
+// was computed and the caller should retry
+#define MNIST_RUN_EBUSY 3
+
+#endif /* __KERINFERENCEL_H */
@@ -0,0 +1,880 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// libkerinfer.c
+// Client side of the request slot protocol described in kerinferencel.h, and
+// the BPF_PROG_RUN dispatcher
+
+// CPU affinity and pthread_attr_setaffinity_np()
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "libkerinfer.h"
+
+#define SLOT_POLL_INTERVAL_US 1000
+#define RESULT_POLL_INTERVAL_MS 10
+// MNIST_RUN_EBUSY retries of kerinfer_run_program(), each after a yield
+#define BUSY_RETRIES 1000
+
+// Per-CPU map values are copied out as one 8-byte aligned entry per CPU
+#define PERCPU_VALUE_SIZE(type) ((sizeof(type) + 7) & ~(size_t)7)
+
+// Address of element idx of an mmap()ed array map
+#define MMAP_VALUE(mem, type, idx)                                             \
+  ((type *)((mem) + (size_t)(idx) * MNIST_MMAP_STRIDE(sizeof(type))))
+
+// Completion record received for a slot from mnist_results
+struct result_wait {
+  __u32 seq;
+  int done;
+  struct mnist_result result;
+};
+
+// Maps making up the request slot protocol
+enum slot_map {
+  SLOT_MAP_INPUT,
+  SLOT_MAP_OUTPUT,
+  SLOT_MAP_STATE,
+  SLOT_MAP_FREE,
+  SLOT_MAP_RESULTS, // mnist_results ring buffer
+  SLOT_MAP_CONTROL, // mnist_control gating words
+  NR_SLOT_MAPS,
+};
+
+static const char *const slot_map_names[NR_SLOT_MAPS] = {
+    [SLOT_MAP_INPUT] = "mnist_input",
+    [SLOT_MAP_OUTPUT] = "mnist_output",
+    [SLOT_MAP_STATE] = "mnist_slot_state",
+    [SLOT_MAP_FREE] = "mnist_free_slots",
+    [SLOT_MAP_RESULTS] = "mnist_results",
+    [SLOT_MAP_CONTROL] = "mnist_control",
+};
+
+struct kerinfer {
+  int fd[NR_SLOT_MAPS];
+  int owns_fds;
+  unsigned int flags;
+  __u32 nr_slots;
+  int nr_cpus; // > 0 when mnist_output is a per-CPU array
+  __u32 next_seq;
+  // mmap()ed slot arrays (KERINFER_F_MMAP), NULL while requests go through
+  // map syscalls. output_mem stays NULL for a per-CPU mnist_output.
+  uint8_t *input_mem;
+  uint8_t *output_mem;
+  uint8_t *state_mem;
+  uint8_t *control_mem;
+  struct ring_buffer *rb;
+  struct result_wait waits[MNIST_MAX_SLOTS];
+};
+
+static size_t mmap_length(size_t value_size, __u32 nr_entries) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t len = nr_entries * MNIST_MMAP_STRIDE(value_size);
+
+  return (len + page - 1) / page * page;
+}
+
+static uint8_t *mmap_array(int map_fd, size_t value_size, __u32 nr_entries,
+                           const char *map_name) {
+  void *mem = mmap(NULL, mmap_length(value_size, nr_entries),
+                   PROT_READ | PROT_WRITE, MAP_SHARED, map_fd, 0);
+  if (mem == MAP_FAILED) {
+    fprintf(stderr, "Failed to mmap %s: %s\n", map_name, strerror(errno));
+    return NULL;
+  }
+  return mem;
+}
+
+// Map the slot arrays and mnist_control into memory, so requests are
+// submitted and collected without map syscalls
+static int mmap_slot_maps(struct kerinfer *ki) {
+  ki->input_mem = mmap_array(ki->fd[SLOT_MAP_INPUT], sizeof(struct input_val),
+                             ki->nr_slots, "mnist_input");
+  ki->state_mem = mmap_array(ki->fd[SLOT_MAP_STATE], sizeof(__u32),
+                             ki->nr_slots, "mnist_slot_state");
+  ki->control_mem = mmap_array(ki->fd[SLOT_MAP_CONTROL], sizeof(__u32),
+                               MNIST_NR_CTL, "mnist_control");
+  if (ki->nr_cpus <= 0)
+    ki->output_mem =
+        mmap_array(ki->fd[SLOT_MAP_OUTPUT], sizeof(struct output_val),
+                   ki->nr_slots, "mnist_output");
+
+  if (!ki->input_mem || !ki->state_mem || !ki->control_mem ||
+      (ki->nr_cpus <= 0 && !ki->output_mem))
+    return -1;
+  return 0;
+}
+
+static void munmap_slot_maps(struct kerinfer *ki) {
+  if (ki->input_mem)
+    munmap(ki->input_mem, mmap_length(sizeof(struct input_val), ki->nr_slots));
+  if (ki->output_mem)
+    munmap(ki->output_mem,
+           mmap_length(sizeof(struct output_val), ki->nr_slots));
+  if (ki->state_mem)
+    munmap(ki->state_mem, mmap_length(sizeof(__u32), ki->nr_slots));
+  if (ki->control_mem)
+    munmap(ki->control_mem, mmap_length(sizeof(__u32), MNIST_NR_CTL));
+  ki->input_mem = ki->output_mem = NULL;
+  ki->state_mem = ki->control_mem = NULL;
+}
+
+static int handle_result(void *ctx, void *data, size_t size) {
+  struct kerinfer *ki = ctx;
+  const struct mnist_result *res = data;
+
+  // Records for other clients' requests are simply skipped
+  if (size < sizeof(*res) || res->slot >= ki->nr_slots ||
+      res->seq != ki->waits[res->slot].seq)
+    return 0;
+  ki->waits[res->slot].result = *res;
+  ki->waits[res->slot].done = 1;
+  return 0;
+}
+
+static int map_info(int fd, const char *map_name, struct bpf_map_info *info) {
+  __u32 len = sizeof(*info);
+
+  memset(info, 0, sizeof(*info));
+  if (bpf_obj_get_info_by_fd(fd, info, &len)) {
+    fprintf(stderr, "Failed to query %s: %s\n", map_name, strerror(errno));
+    return -errno;
+  }
+  return 0;
+}
+
+// Check that the maps speak the slot ABI of this build, then size the
+// client after them
+static int probe_slot_maps(struct kerinfer *ki) {
+  static const __u32 value_sizes[NR_SLOT_MAPS] = {
+      [SLOT_MAP_INPUT] = sizeof(struct input_val),
+      [SLOT_MAP_OUTPUT] = sizeof(struct output_val),
+      [SLOT_MAP_STATE] = sizeof(__u32),
+      [SLOT_MAP_FREE] = sizeof(__u32),
+      [SLOT_MAP_CONTROL] = sizeof(__u32),
+  };
+  struct bpf_map_info info;
+  int err;
+
+  for (size_t i = 0; i < NR_SLOT_MAPS; i++) {
+    err = map_info(ki->fd[i], slot_map_names[i], &info);
+    if (err)
+      return err;
+    if (value_sizes[i] && info.value_size != value_sizes[i]) {
+      fprintf(stderr, "%s has %u byte values, expected %u\n",
+              slot_map_names[i], info.value_size, value_sizes[i]);
+      return -EINVAL;
+    }
+    if (i == SLOT_MAP_INPUT)
+      ki->nr_slots = info.max_entries;
+    if (i == SLOT_MAP_OUTPUT &&
+        info.type == BPF_MAP_TYPE_PERCPU_ARRAY) {
+      ki->nr_cpus = libbpf_num_possible_cpus();
+      if (ki->nr_cpus <= 0) {
+        fprintf(stderr, "Failed to get number of possible CPUs\n");
+        return -EINVAL;
+      }
+    }
+  }
+
+  if (!ki->nr_slots || ki->nr_slots > MNIST_MAX_SLOTS) {
+    fprintf(stderr, "mnist_input has %u slots, expected 1-%d\n", ki->nr_slots,
+            MNIST_MAX_SLOTS);
+    return -EINVAL;
+  }
+  return 0;
+}
+
+static struct kerinfer *kerinfer_new(unsigned int flags) {
+  struct kerinfer *ki = calloc(1, sizeof(*ki));
+
+  if (!ki)
+    return NULL;
+  for (size_t i = 0; i < NR_SLOT_MAPS; i++)
+    ki->fd[i] = -1;
+  ki->flags = flags;
+  // seq doubles as the gating generation, so it must never be 0 and should
+  // differ from what other clients use. Seeding from the thread id keeps
+  // handles opened by the threads of one process apart as well.
+  ki->next_seq = (__u32)syscall(SYS_gettid) << 16 | 1;
+  return ki;
+}
+
+// Common part of both open paths, once the map fds are known
+static int kerinfer_init(struct kerinfer *ki) {
+  int err = probe_slot_maps(ki);
+
+  if (!err && (ki->flags & KERINFER_F_MMAP))
+    err = mmap_slot_maps(ki) ? -ENOMEM : 0;
+  if (err)
+    return err;
+
+  if (ki->flags & KERINFER_F_RINGBUF) {
+    ki->rb =
+        ring_buffer__new(ki->fd[SLOT_MAP_RESULTS], handle_result, ki, NULL);
+    err = libbpf_get_error(ki->rb);
+    if (err) {
+      fprintf(stderr, "Failed to open results ring buffer: %s\n",
+              strerror(-err));
+      ki->rb = NULL;
+      return err;
+    }
+  }
+  return 0;
+}
+
+struct kerinfer *kerinfer_open_pinned(const char *pin_dir,
+                                      unsigned int flags) {
+  struct kerinfer *ki = kerinfer_new(flags);
+  char path[PATH_MAX];
+  int err = 0;
+
+  if (!ki)
+    return NULL;
+  ki->owns_fds = 1;
+  if (!pin_dir)
+    pin_dir = KERINFER_DEFAULT_PIN_DIR;
+
+  for (size_t i = 0; i < NR_SLOT_MAPS && !err; i++) {
+    snprintf(path, sizeof(path), "%s/%s", pin_dir, slot_map_names[i]);
+    ki->fd[i] = bpf_obj_get(path);
+    if (ki->fd[i] < 0) {
+      err = -errno;
+      fprintf(stderr, "Failed to open pinned map %s: %s\n", path,
+              strerror(errno));
+    }
+  }
+  if (!err)
+    err = kerinfer_init(ki);
+  if (err) {
+    kerinfer_close(ki);
+    errno = -err;
+    return NULL;
+  }
+  return ki;
+}
+
+struct kerinfer *kerinfer_open_object(struct bpf_object *obj,
+                                      unsigned int flags) {
+  struct kerinfer *ki = kerinfer_new(flags);
+  int err = 0;
+
+  if (!ki)
+    return NULL;
+
+  for (size_t i = 0; i < NR_SLOT_MAPS && !err; i++) {
+    ki->fd[i] =
+        bpf_object__find_map_fd_by_name(obj, slot_map_names[i]);
+    if (ki->fd[i] < 0) {
+      err = -ENOENT;
+      fprintf(stderr, "Couldn't find map '%s'\n", slot_map_names[i]);
+    }
+  }
+  if (!err)
+    err = kerinfer_init(ki);
+  if (err) {
+    kerinfer_close(ki);
+    errno = -err;
+    return NULL;
+  }
+  return ki;
+}
+
+void kerinfer_close(struct kerinfer *ki) {
+  if (!ki)
+    return;
+  ring_buffer__free(ki->rb);
+  munmap_slot_maps(ki);
+  if (ki->owns_fds) {
+    for (size_t i = 0; i < NR_SLOT_MAPS; i++) {
+      if (ki->fd[i] >= 0)
+        close(ki->fd[i]);
+    }
+  }
+  free(ki);
+}
+
+unsigned int kerinfer_nr_slots(const struct kerinfer *ki) {
+  return ki->nr_slots;
+}
+
+int kerinfer_seed_slots(struct kerinfer *ki) {
+  for (__u32 slot = 0; slot < ki->nr_slots; slot++) {
+    if (bpf_map_update_elem(ki->fd[SLOT_MAP_FREE], NULL, &slot, BPF_ANY)) {
+      fprintf(stderr, "Failed to queue free slot %u: %s\n", slot,
+              strerror(errno));
+      return -errno;
+    }
+  }
+  return 0;
+}
+
+int kerinfer_set_target(struct kerinfer *ki, uint32_t tgid) {
+  __u32 key = MNIST_CTL_TARGET_TGID;
+
+  if (ki->control_mem) {
+    __atomic_store_n(MMAP_VALUE(ki->control_mem, __u32, key), tgid,
+                     __ATOMIC_RELEASE);
+    return 0;
+  }
+  if (bpf_map_update_elem(ki->fd[SLOT_MAP_CONTROL], &key, &tgid, BPF_ANY)) {
+    fprintf(stderr, "Failed to set target process: %s\n", strerror(errno));
+    return -errno;
+  }
+  return 0;
+}
+
+int kerinfer_submit(struct kerinfer *ki, const uint8_t *image,
+                    struct kerinfer_request *req) {
+  struct input_val in;
+  __u32 state = MNIST_SLOT_PENDING;
+  __u32 slot;
+
+  if (bpf_map_lookup_and_delete_elem(ki->fd[SLOT_MAP_FREE], NULL, &slot)) {
+    if (errno == ENOENT)
+      return -EAGAIN;
+    fprintf(stderr, "Failed to claim a request slot: %s\n", strerror(errno));
+    return -errno;
+  }
+  if (slot >= ki->nr_slots) {
+    fprintf(stderr, "Free queue returned invalid slot %u\n", slot);
+    // Not ours to drop: a client sized for more slots may still use it
+    bpf_map_update_elem(ki->fd[SLOT_MAP_FREE], NULL, &slot, BPF_ANY);
+    return -EINVAL;
+  }
+
+  in.seq = ki->next_seq++;
+  if (!ki->next_seq)
+    ki->next_seq = 1;
+  memcpy(in.input, image, INPUT_SIZE);
+  ki->waits[slot] = (struct result_wait){.seq = in.seq};
+
+  if (ki->input_mem) {
+    // Release stores: the program must see the image before the pending
+    // state, and the pending state before the new generation
+    memcpy(MMAP_VALUE(ki->input_mem, struct input_val, slot), &in,
+           sizeof(in));
+    __atomic_store_n(MMAP_VALUE(ki->state_mem, __u32, slot), state,
+                     __ATOMIC_RELEASE);
+    __atomic_store_n(
+        MMAP_VALUE(ki->control_mem, __u32, MNIST_CTL_GENERATION), in.seq,
+        __ATOMIC_RELEASE);
+  } else {
+    // The new generation has to be published after the slot turned pending
+    __u32 gen_key = MNIST_CTL_GENERATION;
+    if (bpf_map_update_elem(ki->fd[SLOT_MAP_INPUT], &slot, &in, BPF_ANY) ||
+        bpf_map_update_elem(ki->fd[SLOT_MAP_STATE], &slot, &state, BPF_ANY)) {
+      int err = -errno;
+
+      fprintf(stderr, "Failed to submit request in slot %u: %s\n", slot,
+              strerror(-err));
+      // Still FREE and never published, so it can go straight back
+      bpf_map_update_elem(ki->fd[SLOT_MAP_FREE], NULL, &slot, BPF_ANY);
+      return err;
+    }
+    if (bpf_map_update_elem(ki->fd[SLOT_MAP_CONTROL], &gen_key, &in.seq,
+                            BPF_ANY)) {
+      int err = -errno;
+
+      fprintf(stderr, "Failed to publish request in slot %u: %s\n", slot,
+              strerror(-err));
+      // Pending already: another client's syscall may serve it at any time,
+      // so it stays claimed like a timed-out request
+      return err;
+    }
+  }
+
+  req->slot = slot;
+  req->seq = in.seq;
+  return 0;
+}
+
+// Read the result of req from mnist_output[slot]. For a per-CPU output
+// map, the copy written by whichever CPU served the request is the one
+// carrying the matching seq.
+static int read_slot_output(const struct kerinfer *ki,
+                            const struct kerinfer_request *req,
+                            int32_t *logits) {
+  struct output_val out;
+
+  if (ki->output_mem || ki->nr_cpus <= 0) {
+    if (ki->output_mem) {
+      // Ordered after the caller's acquire load of the DONE state
+      memcpy(&out, MMAP_VALUE(ki->output_mem, struct output_val, req->slot),
+             sizeof(out));
+    } else if (bpf_map_lookup_elem(ki->fd[SLOT_MAP_OUTPUT], &req->slot, &out)) {
+      fprintf(stderr, "Failed to read output map: %s\n", strerror(errno));
+      return -errno;
+    }
+    if (out.seq != req->seq) {
+      fprintf(stderr, "Slot %u holds result for seq %u, expected %u\n",
+              req->slot, out.seq, req->seq);
+      return -EIO;
+    }
+    memcpy(logits, out.output, sizeof(out.output));
+    return 0;
+  }
+
+  size_t stride = PERCPU_VALUE_SIZE(struct output_val);
+  uint8_t *values = calloc(ki->nr_cpus, stride);
+  int err = -EIO;
+
+  if (!values) {
+    fprintf(stderr, "Failed to allocate per-CPU output buffer\n");
+    return -ENOMEM;
+  }
+  if (bpf_map_lookup_elem(ki->fd[SLOT_MAP_OUTPUT], &req->slot, values)) {
+    err = -errno;
+    fprintf(stderr, "Failed to read output map: %s\n", strerror(errno));
+    goto out;
+  }
+  for (int cpu = 0; cpu < ki->nr_cpus; cpu++) {
+    memcpy(&out, values + cpu * stride, sizeof(out));
+    if (out.seq == req->seq) {
+      memcpy(logits, out.output, sizeof(out.output));
+      err = 0;
+      goto out;
+    }
+  }
+  fprintf(stderr, "No CPU holds a result for seq %u in slot %u\n", req->seq,
+          req->slot);
+out:
+  free(values);
+  return err;
+}
+
+// Mark a served slot free again and return it to the free queue
+static int release_slot(const struct kerinfer *ki, __u32 slot) {
+  __u32 state = MNIST_SLOT_FREE;
+  int err = 0;
+
+  if (ki->state_mem)
+    __atomic_store_n(MMAP_VALUE(ki->state_mem, __u32, slot), state,
+                     __ATOMIC_RELEASE);
+  else
+    err = bpf_map_update_elem(ki->fd[SLOT_MAP_STATE], &slot, &state, BPF_ANY);
+  // The free queue has no mmap() interface, so this push stays a syscall
+  if (!err)
+    err = bpf_map_update_elem(ki->fd[SLOT_MAP_FREE], NULL, &slot, BPF_ANY);
+  if (err) {
+    fprintf(stderr, "Failed to release slot %u: %s\n", slot,
+            strerror(errno));
+    return -errno;
+  }
+  return 0;
+}
+
+static int read_slot_state(const struct kerinfer *ki, __u32 slot,
+                           __u32 *state) {
+  if (ki->state_mem) {
+    *state = __atomic_load_n(MMAP_VALUE(ki->state_mem, __u32, slot),
+                             __ATOMIC_ACQUIRE);
+    return 0;
+  }
+  if (bpf_map_lookup_elem(ki->fd[SLOT_MAP_STATE], &slot, state)) {
+    fprintf(stderr, "Failed to read state of slot %u: %s\n", slot,
+            strerror(errno));
+    return -errno;
+  }
+  return 0;
+}
+
+// Trigger syscalls until the program has served the slot, then read back
+// the logits from mnist_output. The state is checked at least once, so a
+// timeout of 0 only collects a slot that is already served.
+static int poll_slot(struct kerinfer *ki, const struct kerinfer_request *req,
+                     int32_t *logits, int timeout_ms) {
+  __u32 state = MNIST_SLOT_PENDING;
+  int err;
+
+  for (long waited_us = 0;; waited_us += SLOT_POLL_INTERVAL_US) {
+    getpid();
+    err = read_slot_state(ki, req->slot, &state);
+    if (err)
+      return err;
+    if (state == MNIST_SLOT_DONE || state == MNIST_SLOT_ERROR ||
+        waited_us >= timeout_ms * 1000L)
+      break;
+    usleep(SLOT_POLL_INTERVAL_US);
+  }
+
+  if (state == MNIST_SLOT_PENDING || state == MNIST_SLOT_BUSY) {
+    fprintf(stderr, "Request in slot %u timed out\n", req->slot);
+    return -ETIMEDOUT;
+  }
+  // Anything else (a slot freed behind our back) may already be queued
+  // again, and pushing it a second time would hand it to two clients
+  if (state != MNIST_SLOT_DONE && state != MNIST_SLOT_ERROR) {
+    fprintf(stderr, "Slot %u is in unexpected state %u\n", req->slot, state);
+    return -EIO;
+  }
+
+  if (state == MNIST_SLOT_ERROR) {
+    fprintf(stderr, "Request in slot %u failed\n", req->slot);
+    err = -EIO;
+  } else {
+    err = read_slot_output(ki, req, logits);
+  }
+  // A timed-out slot may still be picked up by the program later, so it is
+  // only recycled once it has actually been served
+  int rel = release_slot(ki, req->slot);
+  return err ? err : rel;
+}
+
+// Block on the mnist_results ring buffer until the completion record for
+// req arrives. In tracepoint mode the epoll_wait() issued by
+// ring_buffer__poll() is itself a syscall, so waiting also triggers the
+// program. The record may never come: another client sharing the consumer
+// position can consume it, and the program drops it when the ring buffer is
+// full. An interval without records therefore checks the slot state, and
+// a served slot is collected from mnist_output like in poll_slot().
+static int wait_for_result(struct kerinfer *ki,
+                           const struct kerinfer_request *req,
+                           int32_t *logits, int timeout_ms) {
+  struct result_wait *wait = &ki->waits[req->slot];
+  __u32 state;
+  int err;
+
+  for (int waited_ms = 0; !wait->done && waited_ms < timeout_ms;
+       waited_ms += RESULT_POLL_INTERVAL_MS) {
+    err = ring_buffer__poll(ki->rb, RESULT_POLL_INTERVAL_MS);
+    if (err < 0 && err != -EINTR) {
+      fprintf(stderr, "Failed to poll results ring buffer: %s\n",
+              strerror(-err));
+      return err;
+    }
+    if (err == 0 && !wait->done) {
+      err = read_slot_state(ki, req->slot, &state);
+      if (err)
+        return err;
+      if (state == MNIST_SLOT_DONE || state == MNIST_SLOT_ERROR)
+        break;
+    }
+  }
+
+  // Leaves the slot claimed if it timed out, as the program may still pick
+  // it up later
+  if (!wait->done)
+    return poll_slot(ki, req, logits, 0);
+
+  memcpy(logits, wait->result.logits, sizeof(wait->result.logits));
+  return release_slot(ki, req->slot);
+}
+
+int kerinfer_collect(struct kerinfer *ki, const struct kerinfer_request *req,
+                     int32_t *logits, int timeout_ms) {
+  if (req->slot >= ki->nr_slots || ki->waits[req->slot].seq != req->seq)
+    return -EINVAL;
+  if (ki->rb)
+    return wait_for_result(ki, req, logits, timeout_ms);
+  return poll_slot(ki, req, logits, timeout_ms);
+}
+
+int kerinfer_infer_batch(struct kerinfer *ki, const uint8_t *images,
+                         unsigned int count, int32_t *logits, int timeout_ms) {
+  struct kerinfer_request reqs[MNIST_MAX_SLOTS];
+  unsigned int submitted = 0, collected = 0;
+  int err = 0;
+
+  // Keep every slot busy, collecting in submission order
+  while (collected < count) {
+    while (submitted < count && submitted - collected < ki->nr_slots) {
+      err = kerinfer_submit(ki, images + (size_t)submitted * INPUT_SIZE,
+                            &reqs[submitted % MNIST_MAX_SLOTS]);
+      // Slots held by other clients: drain our own requests first
+      if (err == -EAGAIN && submitted > collected) {
+        err = 0;
+        break;
+      }
+      if (err)
+        goto drain;
+      submitted++;
+    }
+
+    err = kerinfer_collect(ki, &reqs[collected % MNIST_MAX_SLOTS],
+                           logits + (size_t)collected * OUTPUT_SIZE,
+                           timeout_ms);
+    collected++;
+    if (err)
+      goto drain;
+  }
+  return 0;
+
+drain:
+  if (err == -EAGAIN)
+    fprintf(stderr, "No free request slot\n");
+  // Do not leave requests behind in slots we still hold
+  for (; collected < submitted; collected++) {
+    int32_t discard[OUTPUT_SIZE];
+    kerinfer_collect(ki, &reqs[collected % MNIST_MAX_SLOTS], discard,
+                     timeout_ms);
+  }
+  return err;
+}
+
+int kerinfer_run_program(int prog_fd, void *ctx, size_t ctx_size) {
+  LIBBPF_OPTS(bpf_test_run_opts, opts, .ctx_in = ctx,
+              .ctx_size_in = ctx_size);
+
+  for (int tries = 0;; tries++) {
+    if (bpf_prog_test_run_opts(prog_fd, &opts))
+      return -errno;
+    if (opts.retval != MNIST_RUN_EBUSY || tries == BUSY_RETRIES)
+      return opts.retval;
+    // Let the preempted run finish and release the CPU's scratch
+    sched_yield();
+  }
+}
+
+// A kerinfer_dispatch() call, queued until its last chunk is claimed
+struct dispatch_job {
+  const uint8_t *images;
+  int32_t *logits;
+  unsigned int count;
+  unsigned int nr_chunks;
+  unsigned int next_chunk; // next one to claim
+  unsigned int finished;   // chunks run, or skipped after an error
+  int err;                 // first error of any chunk
+  struct dispatch_job *next;
+};
+
+struct dispatch_worker {
+  pthread_t thread;
+  struct kerinfer_dispatcher *d;
+  int cpu;
+};
+
+struct kerinfer_dispatcher {
+  int prog_fd;
+  unsigned int batch;
+  unsigned int nr_workers; // started so far
+  pthread_mutex_t lock;    // protects everything below, and the jobs
+  pthread_cond_t work;     // a job was queued, or stop was set
+  pthread_cond_t done;     // some job finished its last chunk
+  struct dispatch_job *head, *tail;
+  int stop;
+  struct dispatch_worker workers[];
+};
+
+// Run one chunk of job through the worker's own context
+static int run_chunk(const struct kerinfer_dispatcher *d,
+                     const struct dispatch_job *job, unsigned int chunk,
+                     struct mnist_run_ctx *ctx) {
+  unsigned int first = chunk * d->batch;
+  unsigned int count = job->count - first;
+
+  if (count > d->batch)
+    count = d->batch;
+  ctx->count = count;
+  memcpy(ctx->input, job->images + (size_t)first * INPUT_SIZE,
+         (size_t)count * INPUT_SIZE);
+
+  int ret = kerinfer_run_program(d->prog_fd, ctx, sizeof(*ctx));
+  if (ret < 0) {
+    fprintf(stderr, "Failed to run inference program: %s\n",
+            strerror(-ret));
+    return ret;
+  }
+  if (ret != MNIST_RUN_OK) {
+    fprintf(stderr, "Inference program returned %d\n", ret);
+    return -EIO;
+  }
+  memcpy(job->logits + (size_t)first * OUTPUT_SIZE, ctx->output,
+         (size_t)count * sizeof(ctx->output[0]));
+  return 0;
+}
+
+// Claim chunks of the oldest queued job until the dispatcher stops. A job
+// is only dequeued once its last chunk is claimed, and its caller only
+// returns once every chunk has finished, so it outlives all our uses.
+static void *dispatch_worker_fn(void *arg) {
+  struct dispatch_worker *w = arg;
+  struct kerinfer_dispatcher *d = w->d;
+  struct mnist_run_ctx ctx;
+
+  pthread_mutex_lock(&d->lock);
+  for (;;) {
+    while (!d->head && !d->stop)
+      pthread_cond_wait(&d->work, &d->lock);
+    if (d->stop)
+      break;
+
+    struct dispatch_job *job = d->head;
+    unsigned int chunk = job->next_chunk++;
+    if (job->next_chunk == job->nr_chunks) {
+      d->head = job->next;
+      if (!d->head)
+        d->tail = NULL;
+    }
+    int skip = job->err;
+    pthread_mutex_unlock(&d->lock);
+
+    int err = skip ? 0 : run_chunk(d, job, chunk, &ctx);
+
+    pthread_mutex_lock(&d->lock);
+    if (err && !job->err)
+      job->err = err;
+    if (++job->finished == job->nr_chunks)
+      pthread_cond_broadcast(&d->done);
+  }
+  pthread_mutex_unlock(&d->lock);
+  return NULL;
+}
+
+struct kerinfer_dispatcher *kerinfer_dispatcher_new(int prog_fd,
+                                                    unsigned int nr_workers,
+                                                    unsigned int batch) {
+  cpu_set_t allowed;
+
+  if (!batch || batch > MNIST_BATCH_SIZE) {
+    fprintf(stderr, "Invalid dispatch batch of %u images (max %d)\n", batch,
+            MNIST_BATCH_SIZE);
+    errno = EINVAL;
+    return NULL;
+  }
+  if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+    fprintf(stderr, "Failed to get the CPU affinity: %s\n", strerror(errno));
+    return NULL;
+  }
+  unsigned int nr_cpus = CPU_COUNT(&allowed);
+  if (!nr_workers)
+    nr_workers = nr_cpus;
+  if (nr_workers > nr_cpus) {
+    fprintf(stderr, "Cannot pin %u dispatch workers to %u CPUs\n",
+            nr_workers, nr_cpus);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  struct kerinfer_dispatcher *d =
+      calloc(1, sizeof(*d) + nr_workers * sizeof(d->workers[0]));
+  if (!d)
+    return NULL;
+  d->prog_fd = prog_fd;
+  d->batch = batch;
+  pthread_mutex_init(&d->lock, NULL);
+  pthread_cond_init(&d->work, NULL);
+  pthread_cond_init(&d->done, NULL);
+
+  for (int cpu = -1; d->nr_workers < nr_workers; d->nr_workers++) {
+    struct dispatch_worker *w = &d->workers[d->nr_workers];
+    pthread_attr_t attr;
+    cpu_set_t cpus;
+    int err;
+
+    do {
+      cpu++;
+    } while (!CPU_ISSET(cpu, &allowed));
+    w->d = d;
+    w->cpu = cpu;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    pthread_attr_init(&attr);
+    err = pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    if (!err)
+      err = pthread_create(&w->thread, &attr, dispatch_worker_fn, w);
+    pthread_attr_destroy(&attr);
+    if (err) {
+      fprintf(stderr, "Failed to start a dispatch worker on CPU %d: %s\n",
+              cpu, strerror(err));
+      kerinfer_dispatcher_free(d);
+      errno = err;
+      return NULL;
+    }
+  }
+  return d;
+}
+
+void kerinfer_dispatcher_free(struct kerinfer_dispatcher *d) {
+  if (!d)
+    return;
+  pthread_mutex_lock(&d->lock);
+  d->stop = 1;
+  pthread_cond_broadcast(&d->work);
+  pthread_mutex_unlock(&d->lock);
+  for (unsigned int i = 0; i < d->nr_workers; i++)
+    pthread_join(d->workers[i].thread, NULL);
+
+  pthread_cond_destroy(&d->done);
+  pthread_cond_destroy(&d->work);
+  pthread_mutex_destroy(&d->lock);
+  free(d);
+}
+
+unsigned int
+kerinfer_dispatcher_nr_workers(const struct kerinfer_dispatcher *d) {
+  return d->nr_workers;
+}
+
+int kerinfer_dispatch(struct kerinfer_dispatcher *d, const uint8_t *images,
+                      unsigned int count, int32_t *logits) {
+  struct dispatch_job job = {
+      .images = images,
+      .logits = logits,
+      .count = count,
+      .nr_chunks = (count + d->batch - 1) / d->batch,
+  };
+
+  if (!count)
+    return 0;
+  pthread_mutex_lock(&d->lock);
+  if (d->tail)
+    d->tail->next = &job;
+  else
+    d->head = &job;
+  d->tail = &job;
+  pthread_cond_broadcast(&d->work);
+  while (job.finished < job.nr_chunks)
+    pthread_cond_wait(&d->done, &d->lock);
+  pthread_mutex_unlock(&d->lock);
+  return job.err;
+}
+
+int kerinfer_read_records(const char *path, size_t record_size, uint8_t **data,
+                          size_t *count) {
+  FILE *f = fopen(path, "rb");
+  long size;
+
+  if (!f) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  if (fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0 ||
+      fseek(f, 0, SEEK_SET)) {
+    fprintf(stderr, "Failed to size %s: %s\n", path, strerror(errno));
+    fclose(f);
+    return -1;
+  }
+  if (size == 0 || size % record_size) {
+    fprintf(stderr, "%s holds %ld bytes, not a whole number of %zu byte "
+                    "records\n",
+            path, size, record_size);
+    fclose(f);
+    return -1;
+  }
+
+  *data = malloc(size);
+  if (!*data || fread(*data, 1, size, f) != (size_t)size) {
+    fprintf(stderr, "Failed to read %s\n", path);
+    free(*data);
+    *data = NULL;
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+  *count = size / record_size;
+  return 0;
+}
@@ -0,0 +1,119 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// libkerinfer.h
+// Client library for the map-based (tracepoint) interface: submits images
+// into request slots and collects the logits with direct bpf() syscalls, or
+// plain loads and stores on mmap()ed maps. Also runs the on-demand programs
+// on every CPU through a dispatcher. Used by the loader, loadgen and,
+// through ctypes, by infer.py.
+
+#ifndef __LIBKERINFER_H
+#define __LIBKERINFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kerinferencel.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct bpf_object;
+struct kerinfer;
+struct kerinfer_dispatcher;
+
+// Directory holding the pinned maps (one file per map, named after it)
+#define KERINFER_DEFAULT_PIN_DIR "/sys/fs/bpf/kerinferencel"
+
+// kerinfer_open_*() flags. By default requests are collected by polling
+// their slot states. KERINFER_F_RINGBUF waits on the mnist_results ring
+// buffer instead, whose consumer position is shared: with several clients
+// each one also consumes the others' records, which then only find their
+// results once the wait falls back to the slot state.
+#define KERINFER_F_MMAP (1U << 0)    // access the slot maps through mmap()
+#define KERINFER_F_RINGBUF (1U << 1) // wait on the results ring buffer
+
+// One submitted request, filled in by kerinfer_submit()
+struct kerinfer_request {
+  uint32_t slot;
+  uint32_t seq;
+};
+
+// Both return NULL with errno set on failure. kerinfer_open_object() uses
+// the maps of a loaded object without taking ownership of their fds.
+struct kerinfer *kerinfer_open_pinned(const char *pin_dir, unsigned int flags);
+struct kerinfer *kerinfer_open_object(struct bpf_object *obj,
+                                      unsigned int flags);
+void kerinfer_close(struct kerinfer *ki);
+
+unsigned int kerinfer_nr_slots(const struct kerinfer *ki);
+
+// Queue every slot index as free; done once by whoever loaded the object
+int kerinfer_seed_slots(struct kerinfer *ki);
+
+// Restrict the tracepoint program to syscalls made by tgid (0: any process)
+int kerinfer_set_target(struct kerinfer *ki, uint32_t tgid);
+
+// Claim a free slot and publish an INPUT_SIZE byte image in it. Returns
+// -EAGAIN, without printing anything, when every slot is in use. A slot
+// that failed to publish after turning pending stays claimed.
+int kerinfer_submit(struct kerinfer *ki, const uint8_t *image,
+                    struct kerinfer_request *req);
+
+// Trigger syscalls until req has been served, copy its OUTPUT_SIZE logits
+// and free the slot. A timed-out slot stays claimed, since the program may
+// still serve it later. With KERINFER_F_RINGBUF, a record that never
+// arrives (consumed by another client, or dropped on a full ring buffer)
+// falls back to the slot state and mnist_output.
+int kerinfer_collect(struct kerinfer *ki, const struct kerinfer_request *req,
+                     int32_t *logits, int timeout_ms);
+
+// Run count images (count * INPUT_SIZE bytes) and store count * OUTPUT_SIZE
+// logits, keeping up to kerinfer_nr_slots() requests in flight.
+int kerinfer_infer_batch(struct kerinfer *ki, const uint8_t *images,
+                         unsigned int count, int32_t *logits, int timeout_ms);
+
+// Run an on-demand program once through BPF_PROG_RUN on ctx (ctx_size bytes,
+// which syscall programs update in place). MNIST_RUN_EBUSY, returned while a
+// preempted run on the same CPU holds its scratch, is retried after yielding
+// the CPU, a bounded number of times. Returns the program's MNIST_RUN_*
+// value, or -errno if the call itself failed.
+int kerinfer_run_program(int prog_fd, void *ctx, size_t ctx_size);
+
+// Dispatcher for the on-demand programs taking a struct mnist_run_ctx
+// (bpf_mnist_infer_run and its variants), with one worker thread pinned to
+// each CPU. Syscall programs run on the CPU of the calling thread, so the
+// workers do not contend with each other for a CPU's scratch. Anything else
+// running the programs on that CPU still can, and the workers retry through
+// kerinfer_run_program() when it holds the scratch.
+// Requests are split into chunks of batch images (1-MNIST_BATCH_SIZE),
+// which idle workers claim in order, so faster CPUs take more of them.
+//
+// nr_workers 0 starts one worker per CPU we may run on, otherwise they go
+// to the first nr_workers of them. prog_fd stays owned by the caller.
+// Returns NULL with errno set on failure.
+struct kerinfer_dispatcher *kerinfer_dispatcher_new(int prog_fd,
+                                                    unsigned int nr_workers,
+                                                    unsigned int batch);
+void kerinfer_dispatcher_free(struct kerinfer_dispatcher *d);
+
+unsigned int
+kerinfer_dispatcher_nr_workers(const struct kerinfer_dispatcher *d);
+
+// Run count images (count * INPUT_SIZE bytes) across the workers and store
+// count * OUTPUT_SIZE logits. May be called from several threads at once;
+// requests are served in the order they were queued.
+int kerinfer_dispatch(struct kerinfer_dispatcher *d, const uint8_t *images,
+                      unsigned int count, int32_t *logits);
+
+// Read path, a whole number of record_size byte records (INPUT_SIZE for raw
+// images), into a malloc()ed buffer. Returns -1 after printing why not.
+int kerinfer_read_records(const char *path, size_t record_size, uint8_t **data,
+                          size_t *count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __LIBKERINFER_H
@@ -1,35 +1,80 @@
 // loader.c
 // user-space loader
 
+// CPU affinity and pthread_setaffinity_np() for --syscall-bench
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
+#include <net/if.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "kerinferencel.h"
+#include "libkerinfer.h"
+#include "refinfer.h"
+
+// MNIST_FOR_EACH_SHAPE, generated by make from HIDDEN_SHAPES
+#include "kerinferencel_shapes.h"
+
+// One BPF object per hidden layer width, each embedded with ld -r -b binary
+#define DECLARE_EMBEDDED_OBJECT(hidden)                                        \
+  extern const unsigned char _binary_kerinferencel_h##hidden##_bpf_o_start[]; \
+  extern const unsigned char _binary_kerinferencel_h##hidden##_bpf_o_end[];
+MNIST_FOR_EACH_SHAPE(DECLARE_EMBEDDED_OBJECT)
 
-extern const unsigned char _binary_kerinferencel_bpf_o_start[];
-extern const unsigned char _binary_kerinferencel_bpf_o_end[];
+struct embedded_object {
+  __u32 hidden;
+  const unsigned char *start;
+  const unsigned char *end;
+};
 
-#define INPUT_SIZE 784
-#define HIDDEN_SIZE 32
-#define OUTPUT_SIZE 10
+#define EMBEDDED_OBJECT(hidden)                                                \
+  {hidden, _binary_kerinferencel_h##hidden##_bpf_o_start,                      \
+   _binary_kerinferencel_h##hidden##_bpf_o_end},
+static const struct embedded_object embedded_objects[] = {
+    MNIST_FOR_EACH_SHAPE(EMBEDDED_OBJECT)};
 
-#define HIDDEN_WEIGHTS_FILE "hweights8.bin"
-#define HIDDEN_BIAS_FILE "hbias32.bin"
-#define OUTPUT_WEIGHTS_FILE "outweights8.bin"
-#define OUTPUT_BIAS_FILE "outbias32.bin"
+#define NR_EMBEDDED_OBJECTS                                                    \
+  (sizeof(embedded_objects) / sizeof(embedded_objects[0]))
+
+// The embedded object built for a hidden layer of the given width, or NULL
+static const struct embedded_object *find_embedded_object(__u32 hidden) {
+  for (size_t i = 0; i < NR_EMBEDDED_OBJECTS; i++)
+    if (embedded_objects[i].hidden == hidden)
+      return &embedded_objects[i];
+  return NULL;
+}
+
+#define DEFAULT_MODEL_FILE "mnist_model.bin" // from train.py
 #define TEST_IMAGE_FILE "sean.png" // Optional test image
 
 #define TP_NAME "raw_syscalls"
 #define TP_EVENT "sys_enter"
 
+#define SLOT_TIMEOUT_MS 1000
+
+// Interval between checks for runs still reading a replaced weight set, and
+// how long to wait for them before giving up
+#define WEIGHT_SET_POLL_US 100
+#define WEIGHT_SET_TIMEOUT_US 1000000
+
 static int set_memlock_limit(void) {
   struct rlimit rlim = {
       .rlim_cur = RLIM_INFINITY,
@@ -62,9 +107,8 @@ static int read_binary_file(const char *filename, void *buffer, size_t size) {
   return 0;
 }
 
-static int update_map_with_data(int map_fd, void *data, size_t size,
-                                const char *map_name) {
-  __u32 key = 0;
+static int update_map_with_data(int map_fd, __u32 key, const void *data,
+                                size_t size, const char *map_name) {
   int err = bpf_map_update_elem(map_fd, &key, data, 0);
   if (err) {
     fprintf(stderr, "Failed to update %s map: %s\n", map_name, strerror(errno));
@@ -74,238 +118,2778 @@ static int update_map_with_data(int map_fd, void *data, size_t size,
   return 0;
 }
 
-static int load_model_parameters(int map_fd_input, int map_fd_hidW,
-                                 int map_fd_hidB, int map_fd_outW,
-                                 int map_fd_outB) {
-  int err = 0;
+// File descriptors of the model parameter maps
+struct param_maps {
+  int hidden_weights;
+  int hidden_bias;
+  int output_weights;
+  int output_bias;
+  int hidden_requant;
+  int output_requant;
+  int hidden_blocks; // kept pixel blocks, in PRUNED builds only
+  int model;   // mnist_model, descriptor of the generic network
+  int net;     // mnist_net_weights, blob of the generic network
+  int control;      // mnist_control, holding the active weight set
+  int readers;      // mnist_set_readers, runs in flight per weight set
+  __u32 generation; // MNIST_CTL_WEIGHT_SET value that activates set
+  __u32 set;        // weight set being written
+};
 
-  int8_t *hidden_weights = malloc(INPUT_SIZE * HIDDEN_SIZE);
-  int32_t *hidden_bias = malloc(HIDDEN_SIZE * sizeof(int32_t));
-  int8_t *output_weights = malloc(HIDDEN_SIZE * OUTPUT_SIZE);
-  int32_t *output_bias = malloc(OUTPUT_SIZE * sizeof(int32_t));
-  uint8_t *input_image = malloc(INPUT_SIZE);
+// A model file mapped read-only into memory
+struct model_file {
+  const char *path;
+  const uint8_t *data;
+  size_t size;
+  const struct mnist_model_header *hdr;
+};
 
-  if (!hidden_weights || !hidden_bias || !output_weights || !output_bias ||
-      !input_image) {
-    fprintf(stderr, "Failed to allocate memory for model parameters\n");
-    err = -ENOMEM;
-    goto cleanup;
+static const char *const tensor_names[MNIST_NR_TENSORS] = {
+    [MNIST_TENSOR_HIDDEN_WEIGHTS] = "hidden weights",
+    [MNIST_TENSOR_HIDDEN_BIAS] = "hidden bias",
+    [MNIST_TENSOR_OUTPUT_WEIGHTS] = "output weights",
+    [MNIST_TENSOR_OUTPUT_BIAS] = "output bias",
+    [MNIST_TENSOR_HIDDEN_SCALES] = "hidden weight scales",
+    [MNIST_TENSOR_OUTPUT_SCALES] = "output weight scales",
+    [MNIST_TENSOR_NET] = "network",
+    [MNIST_TENSOR_HIDDEN_REQUANT] = "hidden requantization",
+    [MNIST_TENSOR_OUTPUT_REQUANT] = "output requantization",
+    [MNIST_TENSOR_HIDDEN_BLOCKS] = "hidden blocks",
+};
+
+// CRC-32 as computed by zlib.crc32, chainable across buffers
+static __u32 crc32_update(__u32 crc, const void *buf, size_t len) {
+  const uint8_t *p = buf;
+
+  crc = ~crc;
+  while (len--) {
+    crc ^= *p++;
+    for (int k = 0; k < 8; k++)
+      crc = (crc >> 1) ^ (0xedb88320U & -(crc & 1));
   }
+  return ~crc;
+}
 
-  int have_params = 1;
+// Reject anything but a complete, intact model file: every later step
+// reads tensors straight out of the mapping
+static int check_model_file(const struct model_file *model) {
+  const struct mnist_model_header *hdr = model->hdr;
 
-  // Hidden layer weights and bias
-  if (read_binary_file(HIDDEN_WEIGHTS_FILE, hidden_weights,
-                       INPUT_SIZE * HIDDEN_SIZE) < 0) {
-    have_params = 0;
-    printf("Couldn't load %s, using dummy values for hidden weights\n",
-           HIDDEN_WEIGHTS_FILE);
-    memset(hidden_weights, 1, INPUT_SIZE * HIDDEN_SIZE);
+  if (hdr->magic != MNIST_MODEL_MAGIC) {
+    fprintf(stderr, "%s is not a model file (bad magic)\n", model->path);
+    return -EINVAL;
+  }
+  if (hdr->version != MNIST_MODEL_VERSION ||
+      hdr->header_size != sizeof(*hdr)) {
+    fprintf(stderr, "%s has unsupported version %u (expected %d)\n",
+            model->path, hdr->version, MNIST_MODEL_VERSION);
+    return -EINVAL;
   }
 
-  if (read_binary_file(HIDDEN_BIAS_FILE, hidden_bias,
-                       HIDDEN_SIZE * sizeof(int32_t)) < 0) {
-    have_params = 0;
-    printf("Couldn't load %s, using dummy values for hidden bias\n",
-           HIDDEN_BIAS_FILE);
-    for (int i = 0; i < HIDDEN_SIZE; i++)
-      hidden_bias[i] = 1;
+  struct mnist_model_header zeroed = *hdr;
+  zeroed.checksum = 0;
+  __u32 crc = crc32_update(0, &zeroed, sizeof(zeroed));
+  crc = crc32_update(crc, model->data + sizeof(*hdr),
+                     model->size - sizeof(*hdr));
+  if (crc != hdr->checksum) {
+    fprintf(stderr, "%s is corrupt (checksum %08x, expected %08x)\n",
+            model->path, crc, hdr->checksum);
+    return -EINVAL;
   }
 
-  // Output layer weights and bias
-  if (read_binary_file(OUTPUT_WEIGHTS_FILE, output_weights,
-                       HIDDEN_SIZE * OUTPUT_SIZE) < 0) {
-    have_params = 0;
-    printf("Couldn't load %s, using dummy values for output weights\n",
-           OUTPUT_WEIGHTS_FILE);
-    memset(output_weights, 1, HIDDEN_SIZE * OUTPUT_SIZE);
+  for (int t = 0; t < MNIST_NR_TENSORS; t++) {
+    const struct mnist_tensor_desc *td = &hdr->tensors[t];
+    if (!td->size)
+      continue;
+    if (td->offset % MNIST_MODEL_ALIGN || td->offset < sizeof(*hdr) ||
+        td->offset > model->size || td->size > model->size - td->offset) {
+      fprintf(stderr, "%s: %s section out of bounds\n", model->path,
+              tensor_names[t]);
+      return -EINVAL;
+    }
   }
 
-  if (read_binary_file(OUTPUT_BIAS_FILE, output_bias,
-                       OUTPUT_SIZE * sizeof(int32_t)) < 0) {
-    have_params = 0;
-    printf("Couldn't load %s, using dummy values for output bias\n",
-           OUTPUT_BIAS_FILE);
-    for (int i = 0; i < OUTPUT_SIZE; i++)
-      output_bias[i] = 1;
+  if (hdr->layout == MNIST_LAYOUT_BLOCKED
+          ? !hdr->weight_block || hdr->hidden_size % hdr->weight_block
+          : hdr->layout != MNIST_LAYOUT_ROW_MAJOR) {
+    fprintf(stderr, "%s: bad hidden weights layout %u (block %u)\n",
+            model->path, hdr->layout, hdr->weight_block);
+    return -EINVAL;
   }
+  if (hdr->hidden_bits && hdr->hidden_bits != 8 && hdr->hidden_bits != 4) {
+    fprintf(stderr, "%s: unsupported %u-bit hidden weights\n", model->path,
+            hdr->hidden_bits);
+    return -EINVAL;
+  }
+  return 0;
+}
 
-  // Try to load a test image, otherwise use dummy input
-  if (read_binary_file(TEST_IMAGE_FILE, input_image, INPUT_SIZE) < 0) {
-    printf("Couldn't load %s, using dummy input image\n", TEST_IMAGE_FILE);
+static void close_model_file(struct model_file *model) {
+  if (model->data)
+    munmap((void *)model->data, model->size);
+  model->data = NULL;
+}
+
+static int open_model_file(const char *path, struct model_file *model) {
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0) {
+    int err = -errno;
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(-err));
+    fprintf(stderr, "Run train.py first to generate it, or pass "
+                    "--dummy-model.\n");
+    return err;
+  }
+  if (fstat(fd, &st)) {
+    int err = -errno;
+    fprintf(stderr, "Failed to stat %s: %s\n", path, strerror(-err));
+    close(fd);
+    return err;
+  }
+  if ((size_t)st.st_size < sizeof(struct mnist_model_header)) {
+    fprintf(stderr, "%s is truncated (%lld bytes)\n", path,
+            (long long)st.st_size);
+    close(fd);
+    return -EINVAL;
+  }
+
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  int err = data == MAP_FAILED ? -errno : 0;
+  close(fd);
+  if (err) {
+    fprintf(stderr, "Failed to map %s: %s\n", path, strerror(-err));
+    return err;
+  }
+
+  model->path = path;
+  model->data = data;
+  model->size = st.st_size;
+  model->hdr = data;
+
+  err = check_model_file(model);
+  if (err)
+    close_model_file(model);
+  return err;
+}
+
+// Pointer to tensor t inside the mapping, or NULL if the model file does
+// not carry it at the expected size
+static const void *model_tensor(const struct model_file *model,
+                                enum mnist_tensor t, size_t size) {
+  const struct mnist_tensor_desc *td = &model->hdr->tensors[t];
+
+  if (td->size != size) {
+    fprintf(stderr, "%s: %s section is %llu bytes, expected %zu\n",
+            model->path, tensor_names[t], (unsigned long long)td->size,
+            size);
+    return NULL;
+  }
+  return model->data + td->offset;
+}
+
+// Index of weight (j, i) in hidden weights stored in the given layout
+static size_t hidden_w_index(__u32 layout, __u32 block, int j, int i) {
+  if (layout == MNIST_LAYOUT_BLOCKED)
+    return ((size_t)(j / block) * INPUT_SIZE + i) * block + j % block;
+  return (size_t)j * INPUT_SIZE + i;
+}
+
+// Repack hidden weights from a model file's layout into the one the BPF
+// object was built for (MNIST_HIDDEN_W_INDEX)
+static void pack_hidden_weights(const int8_t *src, __u32 layout, __u32 block,
+                                __u32 hidden, int8_t *packed) {
+  for (__u32 j = 0; j < hidden; j++)
     for (int i = 0; i < INPUT_SIZE; i++)
-      input_image[i] = (i % 255); // More varied pattern
+      packed[MNIST_HIDDEN_W_INDEX(j, i)] =
+          src[hidden_w_index(layout, block, j, i)];
+}
+
+// Expand INT4 hidden weights, in the model file's layout, into int8 weights
+// shifted left by their unit's shift (see MNIST_HIDDEN_WEIGHT_BITS)
+static int expand_int4_weights(const struct model_file *model,
+                               const uint8_t *nibbles, const uint8_t *shifts,
+                               int8_t **weightsp) {
+  const struct mnist_model_header *hdr = model->hdr;
+  int8_t *weights = malloc(INPUT_SIZE * hdr->hidden_size);
+
+  if (!weights) {
+    fprintf(stderr, "Failed to allocate memory for the hidden weights\n");
+    return -ENOMEM;
   }
+  for (int j = 0; j < (int)hdr->hidden_size; j++) {
+    if (shifts[j] > MNIST_MAX_HIDDEN_SHIFT) {
+      fprintf(stderr, "%s: hidden unit %d has shift %u (at most %d)\n",
+              model->path, j, shifts[j], MNIST_MAX_HIDDEN_SHIFT);
+      free(weights);
+      return -EINVAL;
+    }
+    for (int i = 0; i < INPUT_SIZE; i++) {
+      size_t k = hidden_w_index(hdr->layout, hdr->weight_block, j, i);
+      // Sign-extend the nibble from the top of an int8
+      int8_t q = (int8_t)(nibbles[k / 2] << (k & 1 ? 0 : 4)) >> 4;
 
-  if (!have_params) {
-    printf("Warning: Using dummy parameters. Models won't produce meaningful "
-           "predictions.\n");
-    printf("Run train.py first to generate parameter files.\n");
+      weights[k] = q * (1 << shifts[j]);
+    }
   }
+  *weightsp = weights;
+  return 0;
+}
 
-  // Update maps with entire parameter arrays
-  if (update_map_with_data(map_fd_hidW, hidden_weights,
-                           INPUT_SIZE * HIDDEN_SIZE, "hidden_weights") < 0 ||
-      update_map_with_data(map_fd_hidB, hidden_bias,
-                           HIDDEN_SIZE * sizeof(int32_t), "hidden_bias") < 0 ||
-      update_map_with_data(map_fd_outW, output_weights,
-                           HIDDEN_SIZE * OUTPUT_SIZE, "output_weights") < 0 ||
-      update_map_with_data(map_fd_outB, output_bias,
-                           OUTPUT_SIZE * sizeof(int32_t), "output_bias") < 0 ||
-      update_map_with_data(map_fd_input, input_image, INPUT_SIZE,
-                           "mnist_input") < 0) {
-    err = -1;
-    goto cleanup;
+#if MNIST_HIDDEN_WEIGHT_BITS == 4
+// Pack int8 hidden weights, each an int4 value shifted left by its unit's
+// shift (all 0 if shifts is NULL), into a hidden_weights map value
+static int pack_int4_weights(const int8_t *weights, const uint8_t *shifts,
+                             __u32 hidden, uint8_t *value) {
+  uint8_t *unit_shifts = value + INPUT_SIZE * hidden / 2;
+
+  memset(value, 0, MNIST_HIDDEN_WEIGHTS_SIZE(4, hidden));
+  for (int j = 0; j < (int)hidden; j++) {
+    unit_shifts[j] = shifts ? shifts[j] : 0;
+    for (int i = 0; i < INPUT_SIZE; i++) {
+      size_t k = MNIST_HIDDEN_W_INDEX(j, i);
+      int q = weights[k] / (1 << unit_shifts[j]);
+
+      if (q < -8 || q > 7 || q * (1 << unit_shifts[j]) != weights[k]) {
+        fprintf(stderr, "Hidden weight %d of unit %d does not fit in 4 bits\n",
+                i, j);
+        return -ERANGE;
+      }
+      value[k / 2] |= (q & 0xf) << (k & 1 ? 4 : 0);
+    }
   }
+  return 0;
+}
+#endif
 
-cleanup:
-  free(hidden_weights);
-  free(hidden_bias);
-  free(output_weights);
-  free(output_bias);
-  free(input_image);
-  return err;
+// Check the fixed-point multipliers of one layer's requantization (a
+// struct mnist_layer_requant followed by units per-unit multipliers): the
+// programs shift by them unchecked
+static int valid_requant(const struct mnist_requant *rq) {
+  return rq->multiplier >= 0 && rq->shift >= 1 &&
+         rq->shift <= MNIST_MAX_REQUANT_SHIFT;
 }
 
-static void predict_digit(int *output, int output_size) {
-  int max_idx = 0;
-  int max_val = output[0];
+static int valid_layer_requant(const void *requant, __u32 units) {
+  const struct mnist_layer_requant *layer = requant;
+  const struct mnist_requant *unit = (const void *)(layer + 1);
 
-  for (int i = 1; i < output_size; i++) {
-    if (output[i] > max_val) {
-      max_val = output[i];
-      max_idx = i;
+  if (!valid_requant(&layer->pos) || !valid_requant(&layer->neg))
+    return 0;
+  for (__u32 j = 0; j < units; j++)
+    if (!valid_requant(&unit[j]))
+      return 0;
+  return 1;
+}
+
+// Check that a network descriptor chains up from INPUT_SIZE to OUTPUT_SIZE,
+// that every tensor lies inside the blob, which may be at most max_blob
+// bytes, and that its requantization is sane
+static int validate_net_model(const struct mnist_model_desc *desc,
+                              const void *blob, size_t max_blob) {
+  if (desc->nr_layers == 0 || desc->nr_layers > MNIST_NET_MAX_LAYERS ||
+      desc->blob_size > max_blob) {
+    fprintf(stderr, "Invalid network: %u layers, %u-byte blob\n",
+            desc->nr_layers, desc->blob_size);
+    return -EINVAL;
+  }
+
+  __u32 prev_dim = INPUT_SIZE;
+  for (__u32 l = 0; l < desc->nr_layers; l++) {
+    const struct mnist_layer_desc *ld = &desc->layers[l];
+    __u64 weights_end = ld->weight_off + (__u64)ld->in_dim * ld->out_dim;
+    __u64 bias_end = ld->bias_off + (__u64)ld->out_dim * sizeof(int32_t);
+    __u64 requant_end = ld->requant_off + MNIST_LAYER_REQUANT_SIZE(ld->out_dim);
+
+    if (ld->in_dim != prev_dim || ld->out_dim == 0 ||
+        ld->out_dim > MNIST_NET_MAX_DIM || ld->activation >= MNIST_NR_ACT ||
+        ld->bias_off % sizeof(int32_t) || weights_end > desc->blob_size ||
+        bias_end > desc->blob_size || ld->requant_off % sizeof(int32_t) ||
+        requant_end > desc->blob_size) {
+      fprintf(stderr, "Invalid network: bad layer %u (%u -> %u)\n", l,
+              ld->in_dim, ld->out_dim);
+      return -EINVAL;
     }
+    if (!valid_layer_requant((const uint8_t *)blob + ld->requant_off,
+                             ld->out_dim)) {
+      fprintf(stderr, "Invalid network: bad requantization in layer %u\n", l);
+      return -EINVAL;
+    }
+    prev_dim = ld->out_dim;
+  }
+  if (prev_dim != OUTPUT_SIZE) {
+    fprintf(stderr, "Invalid network: %u outputs, expected %d\n", prev_dim,
+            OUTPUT_SIZE);
+    return -EINVAL;
+  }
+  return 0;
+}
+
+// Copy the MNIST_TENSOR_NET section of a model file out of the mapping,
+// the blob into blob of up to max_blob bytes. mnist_net_weights needs slack
+// past the blob, so this one is not zero-copy.
+static int read_net_tensor(const struct model_file *model,
+                           struct mnist_model_desc *desc, uint8_t *blob_out,
+                           size_t max_blob) {
+  const struct mnist_tensor_desc *td = &model->hdr->tensors[MNIST_TENSOR_NET];
+
+  if (td->size < sizeof(*desc)) {
+    fprintf(stderr, "%s: network section is truncated\n", model->path);
+    return -EINVAL;
+  }
+  memcpy(desc, model->data + td->offset, sizeof(*desc));
+  if (td->size != sizeof(*desc) + (__u64)desc->blob_size) {
+    fprintf(stderr, "%s: network section is %llu bytes, expected %zu\n",
+            model->path, (unsigned long long)td->size,
+            sizeof(*desc) + desc->blob_size);
+    return -EINVAL;
   }
 
-  printf("Predicted digit: %d (confidence value: %d)\n", max_idx, max_val);
+  const uint8_t *blob = model->data + td->offset + sizeof(*desc);
+  if (validate_net_model(desc, blob, max_blob))
+    return -EINVAL;
+  memcpy(blob_out, blob, desc->blob_size);
+  return 0;
 }
 
-int main(int argc, char **argv) {
-  int err;
-  struct bpf_object *obj = NULL;
-  struct bpf_program *prog = NULL;
-  struct bpf_link *link = NULL;
-  int map_fd_input = -1, map_fd_output = -1;
-  int map_fd_hidW = -1, map_fd_hidB = -1;
-  int map_fd_outW = -1, map_fd_outB = -1;
+// Describe the fixed two-layer model as a generic network. The hidden layer
+// uses LeakyReLU and the output layer none, like the specialized programs,
+// so the logits are bit-identical. hidden_weights is in the layout the BPF
+// object was built for.
+static void pack_two_layer_net(struct mnist_model_desc *desc, uint8_t *blob,
+                               __u32 hidden, const int8_t *hidden_weights,
+                               const int32_t *hidden_bias,
+                               const int8_t *output_weights,
+                               const int32_t *output_bias,
+                               const void *hidden_requant,
+                               const void *output_requant) {
+  __u32 off = 0;
 
-  err = set_memlock_limit();
-  if (err) {
-    return 1;
+  memset(desc, 0, sizeof(*desc));
+  desc->nr_layers = 2;
+  desc->layers[0] = (struct mnist_layer_desc){
+      .in_dim = INPUT_SIZE,
+      .out_dim = hidden,
+      .activation = MNIST_ACT_LEAKY_RELU,
+  };
+  desc->layers[1] = (struct mnist_layer_desc){
+      .in_dim = hidden,
+      .out_dim = OUTPUT_SIZE,
+      .activation = MNIST_ACT_NONE,
+  };
+
+  desc->layers[0].weight_off = off;
+  for (__u32 j = 0; j < hidden; j++)
+    for (int i = 0; i < INPUT_SIZE; i++)
+      blob[off++] = hidden_weights[MNIST_HIDDEN_W_INDEX(j, i)];
+
+  desc->layers[1].weight_off = off;
+  memcpy(&blob[off], output_weights, hidden * OUTPUT_SIZE);
+  off += hidden * OUTPUT_SIZE;
+
+  off = (off + sizeof(int32_t) - 1) & ~(__u32)(sizeof(int32_t) - 1);
+  desc->layers[0].bias_off = off;
+  memcpy(&blob[off], hidden_bias, hidden * sizeof(int32_t));
+  off += hidden * sizeof(int32_t);
+
+  desc->layers[1].bias_off = off;
+  memcpy(&blob[off], output_bias, OUTPUT_SIZE * sizeof(int32_t));
+  off += OUTPUT_SIZE * sizeof(int32_t);
+
+  desc->layers[0].requant_off = off;
+  memcpy(&blob[off], hidden_requant, MNIST_LAYER_REQUANT_SIZE(hidden));
+  off += MNIST_LAYER_REQUANT_SIZE(hidden);
+
+  desc->layers[1].requant_off = off;
+  memcpy(&blob[off], output_requant, MNIST_LAYER_REQUANT_SIZE(OUTPUT_SIZE));
+  off += MNIST_LAYER_REQUANT_SIZE(OUTPUT_SIZE);
+
+  desc->blob_size = off;
+}
+
+// The two-layer parameters, with the hidden weights in the layout the BPF
+// object was built for. They point into the model file mapping, or into the
+// buffers in owned for repacked and dummy parameters.
+struct model_params {
+  __u32 hidden; // hidden units, selecting the embedded object
+  const int8_t *hidden_weights; // NULL if the model only holds a network
+  const uint8_t *hidden_shifts; // per-unit shifts of INT4 models, or NULL
+  const int32_t *hidden_bias;
+  const int8_t *output_weights;
+  const int32_t *output_bias;
+  const void *hidden_requant; // struct mnist_layer_requant + [hidden]
+  const void *output_requant; // struct mnist_layer_requant + [OUTPUT_SIZE]
+  const uint8_t *hidden_blocks; // MNIST_TENSOR_HIDDEN_BLOCKS, PRUNED only
+  void *owned[7];
+};
+
+static void free_model_params(struct model_params *p) {
+  for (size_t i = 0; i < sizeof(p->owned) / sizeof(p->owned[0]); i++)
+    free(p->owned[i]);
+  memset(p, 0, sizeof(*p));
+}
+
+#ifdef MNIST_PRUNED_BLOCKS
+// Find the pixel blocks each hidden unit keeps, and check them against the
+// dense hidden weights (already in the build's layout) so that
+// bpf_mnist_infer_pruned computes exactly what the other programs do
+static int read_hidden_blocks(const struct model_file *model,
+                              struct model_params *p) {
+  const struct mnist_tensor_desc *td =
+      &model->hdr->tensors[MNIST_TENSOR_HIDDEN_BLOCKS];
+  __u64 row = (__u64)p->hidden * (1 + MNIST_PRUNE_BLOCK);
+
+  if (!td->size) {
+    fprintf(stderr, "%s is not pruned, but this build expects %d blocks per "
+                    "hidden unit (train.py --prune-blocks %d)\n",
+            model->path, MNIST_PRUNED_BLOCKS, MNIST_PRUNED_BLOCKS);
+    return -EINVAL;
+  }
+  if (td->size != MNIST_HIDDEN_BLOCKS_SIZE(p->hidden, MNIST_PRUNED_BLOCKS)) {
+    fprintf(stderr, "%s keeps %llu blocks per hidden unit, but this build "
+                    "expects %d (make PRUNED=%llu)\n",
+            model->path, (unsigned long long)(td->size / row),
+            MNIST_PRUNED_BLOCKS, (unsigned long long)(td->size / row));
+    return -EINVAL;
   }
 
-  printf("Start pointer (raw): %p\n",
-         (void *)_binary_kerinferencel_bpf_o_start);
-  printf("End pointer (raw): %p\n", (void *)_binary_kerinferencel_bpf_o_end);
-  printf("Computed size: %zu\n", (size_t)(_binary_kerinferencel_bpf_o_end -
-                                          _binary_kerinferencel_bpf_o_start));
+  const uint8_t *blocks = model->data + td->offset;
+  const int8_t *weights =
+      (const int8_t *)blocks + p->hidden * MNIST_PRUNED_BLOCKS;
 
-  // Create in-memory BPF object from embedded bytecode
-  if (!_binary_kerinferencel_bpf_o_start || !_binary_kerinferencel_bpf_o_end) {
-    fprintf(stderr, "Error: BPF bytecode start or end is NULL\n");
-    return 1;
+  for (__u32 j = 0; j < p->hidden; j++) {
+    const uint8_t *blk = &blocks[j * MNIST_PRUNED_BLOCKS];
+    int8_t dense[INPUT_SIZE] = {0};
+
+    for (int k = 0; k < MNIST_PRUNED_BLOCKS; k++) {
+      if (blk[k] >= MNIST_NR_PIXEL_BLOCKS || (k && blk[k] <= blk[k - 1])) {
+        fprintf(stderr, "%s: blocks of hidden unit %u are not ascending "
+                        "pixel block indices\n",
+                model->path, j);
+        return -EINVAL;
+      }
+      memcpy(&dense[blk[k] * MNIST_PRUNE_BLOCK],
+             &weights[(j * MNIST_PRUNED_BLOCKS + k) * MNIST_PRUNE_BLOCK],
+             MNIST_PRUNE_BLOCK);
+    }
+    for (int i = 0; i < INPUT_SIZE; i++) {
+      if (p->hidden_weights[MNIST_HIDDEN_W_INDEX(j, i)] != dense[i]) {
+        fprintf(stderr, "%s: blocks of hidden unit %u disagree with its "
+                        "dense weights\n",
+                model->path, j);
+        return -EINVAL;
+      }
+    }
   }
+  p->hidden_blocks = blocks;
+  return 0;
+}
+#endif
 
-  size_t obj_size =
-      (size_t)((const uint8_t *)_binary_kerinferencel_bpf_o_end -
-               (const uint8_t *)_binary_kerinferencel_bpf_o_start);
-  if (obj_size == 0) {
-    fprintf(stderr, "Error: Computed BPF object size is 0\n");
-    return 1;
+// Check the model's dimensions against the build and find its two-layer
+// tensors; only hidden weights in a different layout than the BPF objects'
+// are copied, to be repacked. With net set, a model holding only a generic
+// network is accepted too, and runs on the object for the default width.
+static int read_model_params(const struct model_file *model, int net,
+                             struct model_params *p) {
+  const struct mnist_model_header *hdr = model->hdr;
+
+  if (hdr->input_size != INPUT_SIZE || hdr->output_size != OUTPUT_SIZE) {
+    fprintf(stderr, "%s is a %u -> %u model, expected %d -> %d\n",
+            model->path, hdr->input_size, hdr->output_size, INPUT_SIZE,
+            OUTPUT_SIZE);
+    return -EINVAL;
   }
-  struct bpf_object_open_opts open_opts = {
-      .sz = sizeof(struct bpf_object_open_opts),
-      .object_name = "mnist_inference_8bit_small",
+
+  if (!hdr->hidden_size) {
+    if (!net) {
+      fprintf(stderr, "%s only holds a generic network; run with --net\n",
+              model->path);
+      return -EINVAL;
+    }
+    p->hidden = HIDDEN_SIZE;
+    return 0;
+  }
+  if (!find_embedded_object(hdr->hidden_size)) {
+    fprintf(stderr, "%s has %u hidden units, but this build has no object "
+                    "for them (make MODEL=%s)\n",
+            model->path, hdr->hidden_size, model->path);
+    return -EINVAL;
+  }
+  p->hidden = hdr->hidden_size;
+
+  __u32 bits = hdr->hidden_bits ? hdr->hidden_bits : 8;
+  if (bits > MNIST_HIDDEN_WEIGHT_BITS) {
+    fprintf(stderr,
+            "%s has %u-bit hidden weights, but this build packs %d-bit ones "
+            "(make WEIGHTS=int%u)\n",
+            model->path, bits, MNIST_HIDDEN_WEIGHT_BITS, bits);
+    return -EINVAL;
+  }
+
+  p->hidden_weights = model_tensor(model, MNIST_TENSOR_HIDDEN_WEIGHTS,
+                                   MNIST_HIDDEN_WEIGHTS_SIZE(bits, p->hidden));
+  p->hidden_bias = model_tensor(model, MNIST_TENSOR_HIDDEN_BIAS,
+                                p->hidden * sizeof(int32_t));
+  p->output_weights = model_tensor(model, MNIST_TENSOR_OUTPUT_WEIGHTS,
+                                   p->hidden * OUTPUT_SIZE);
+  p->output_bias = model_tensor(model, MNIST_TENSOR_OUTPUT_BIAS,
+                                OUTPUT_SIZE * sizeof(int32_t));
+  p->hidden_requant = model_tensor(model, MNIST_TENSOR_HIDDEN_REQUANT,
+                                   MNIST_LAYER_REQUANT_SIZE(p->hidden));
+  p->output_requant = model_tensor(model, MNIST_TENSOR_OUTPUT_REQUANT,
+                                   MNIST_LAYER_REQUANT_SIZE(OUTPUT_SIZE));
+  if (!p->hidden_weights || !p->hidden_bias || !p->output_weights ||
+      !p->output_bias || !p->hidden_requant || !p->output_requant)
+    return -EINVAL;
+  if (!valid_layer_requant(p->hidden_requant, p->hidden) ||
+      !valid_layer_requant(p->output_requant, OUTPUT_SIZE)) {
+    fprintf(stderr, "%s: requantization shifts out of range\n", model->path);
+    return -EINVAL;
+  }
+
+  // Everything but the map value itself works on the int8 expansion
+  if (bits == 4) {
+    const uint8_t *nibbles = (const uint8_t *)p->hidden_weights;
+    int8_t *expanded;
+    int err;
+
+    p->hidden_shifts = nibbles + INPUT_SIZE * p->hidden / 2;
+    err = expand_int4_weights(model, nibbles, p->hidden_shifts, &expanded);
+    if (err)
+      return err;
+    p->hidden_weights = p->owned[0] = expanded;
+    if (MNIST_HIDDEN_WEIGHT_BITS == 8)
+      printf("Running the 4-bit hidden weights of %s as int8 (make "
+             "WEIGHTS=int4 keeps them packed)\n",
+             model->path);
+  }
+
+  if (hdr->layout != MNIST_HIDDEN_LAYOUT ||
+      (hdr->layout == MNIST_LAYOUT_BLOCKED &&
+       hdr->weight_block != MNIST_WEIGHT_BLOCK)) {
+    int8_t *packed = malloc(INPUT_SIZE * p->hidden);
+    if (!packed) {
+      fprintf(stderr, "Failed to allocate memory for the hidden weights\n");
+      return -ENOMEM;
+    }
+    printf("Repacking the hidden weights of %s for this build's layout\n",
+           model->path);
+    pack_hidden_weights(p->hidden_weights, hdr->layout, hdr->weight_block,
+                        p->hidden, packed);
+    free(p->owned[0]);
+    p->hidden_weights = p->owned[0] = packed;
+  }
+#ifdef MNIST_PRUNED_BLOCKS
+  return read_hidden_blocks(model, p);
+#else
+  return 0;
+#endif
+}
+
+// Placeholder requantization: every unit scaled by 2^-shift, LeakyReLU
+// passing positive values through and dividing negative ones by 128
+static void dummy_requant(struct mnist_layer_requant *layer, __u32 units,
+                          __u32 shift) {
+  struct mnist_requant *unit = (void *)(layer + 1);
+
+  *layer = (struct mnist_layer_requant){
+      .pos = {1 << 30, 30},
+      .neg = {1 << 30, 37},
   };
-  printf("BPF bytecode start: %p\n", _binary_kerinferencel_bpf_o_start);
-  printf("BPF bytecode end: %p\n", _binary_kerinferencel_bpf_o_end);
-  printf("Computed object size: %zu bytes\n", obj_size);
+  for (__u32 j = 0; j < units; j++)
+    unit[j] = (struct mnist_requant){1 << 30, 30 + shift};
+}
 
-  obj = bpf_object__open_mem((const void *)_binary_kerinferencel_bpf_o_start,
-                             obj_size, &open_opts);
-  if (!obj) {
-    fprintf(stderr, "Failed to open BPF object: %s\n", strerror(errno));
-    return 1;
+// Placeholder parameters for smoke-testing without a trained model, for the
+// default hidden layer width
+static int dummy_model_params(struct model_params *p) {
+  int8_t *hidden_weights = malloc(INPUT_SIZE * HIDDEN_SIZE);
+  int32_t *hidden_bias = malloc(HIDDEN_SIZE * sizeof(int32_t));
+  int8_t *output_weights = malloc(HIDDEN_SIZE * OUTPUT_SIZE);
+  int32_t *output_bias = malloc(OUTPUT_SIZE * sizeof(int32_t));
+  void *hidden_requant = malloc(MNIST_LAYER_REQUANT_SIZE(HIDDEN_SIZE));
+  void *output_requant = malloc(MNIST_LAYER_REQUANT_SIZE(OUTPUT_SIZE));
+
+  p->owned[0] = hidden_weights;
+  p->owned[1] = hidden_bias;
+  p->owned[2] = output_weights;
+  p->owned[3] = output_bias;
+  p->owned[4] = hidden_requant;
+  p->owned[5] = output_requant;
+  if (!hidden_weights || !hidden_bias || !output_weights || !output_bias ||
+      !hidden_requant || !output_requant) {
+    fprintf(stderr, "Failed to allocate memory for model parameters\n");
+    free_model_params(p);
+    return -ENOMEM;
   }
 
-  prog = bpf_object__find_program_by_name(obj, "bpf_mnist_infer");
-  if (!prog) {
-    fprintf(stderr, "Couldn't find BPF program 'bpf_mnist_infer'.\n");
-    goto cleanup;
+  printf("Warning: Using dummy parameters. Models won't produce meaningful "
+         "predictions.\n");
+  p->hidden = HIDDEN_SIZE;
+  memset(hidden_weights, 1, INPUT_SIZE * HIDDEN_SIZE);
+  for (int i = 0; i < HIDDEN_SIZE; i++)
+    hidden_bias[i] = 1;
+  memset(output_weights, 1, HIDDEN_SIZE * OUTPUT_SIZE);
+  for (int i = 0; i < OUTPUT_SIZE; i++)
+    output_bias[i] = 1;
+  // Scale sums of up to 784 * 255, and HIDDEN_SIZE * 255, to uint8 range
+  dummy_requant(hidden_requant, HIDDEN_SIZE, 10);
+  dummy_requant(output_requant, OUTPUT_SIZE, 5);
+
+  p->hidden_weights = hidden_weights;
+  p->hidden_bias = hidden_bias;
+  p->output_weights = output_weights;
+  p->output_bias = output_bias;
+  p->hidden_requant = hidden_requant;
+  p->output_requant = output_requant;
+
+#ifdef MNIST_PRUNED_BLOCKS
+  // Keep the first MNIST_PRUNED_BLOCKS pixel blocks of every unit
+  uint8_t *blocks = p->owned[6] =
+      malloc(MNIST_HIDDEN_BLOCKS_SIZE(HIDDEN_SIZE, MNIST_PRUNED_BLOCKS));
+  if (!blocks) {
+    fprintf(stderr, "Failed to allocate memory for model parameters\n");
+    free_model_params(p);
+    return -ENOMEM;
   }
-  printf("Found program %s\n", bpf_program__name(prog));
+  for (int j = 0; j < HIDDEN_SIZE; j++) {
+    for (int k = 0; k < MNIST_PRUNED_BLOCKS; k++)
+      blocks[j * MNIST_PRUNED_BLOCKS + k] = k;
+    for (int i = MNIST_PRUNED_BLOCKS * MNIST_PRUNE_BLOCK; i < INPUT_SIZE; i++)
+      hidden_weights[MNIST_HIDDEN_W_INDEX(j, i)] = 0;
+  }
+  memset(blocks + HIDDEN_SIZE * MNIST_PRUNED_BLOCKS, 1,
+         HIDDEN_SIZE * MNIST_PRUNED_BLOCKS * MNIST_PRUNE_BLOCK);
+  p->hidden_blocks = blocks;
+#endif
+  return 0;
+}
 
-  bpf_program__set_type(prog, BPF_PROG_TYPE_TRACEPOINT);
-  if (bpf_program__get_type(prog) != BPF_PROG_TYPE_TRACEPOINT) {
-    fprintf(stderr, "Program type mismatch: expected TRACEPOINT\n");
-    goto cleanup;
+// Describe the model as a generic network, with a blob of up to max_blob
+// bytes: the model file's network section if use_net_section is set and
+// there is one, otherwise the two-layer parameters (model may be NULL for
+// dummy parameters)
+static int build_net_model(const struct model_file *model, int use_net_section,
+                           const struct model_params *p,
+                           struct mnist_model_desc *desc, uint8_t *blob,
+                           size_t max_blob) {
+  if (use_net_section && model && model->hdr->tensors[MNIST_TENSOR_NET].size)
+    return read_net_tensor(model, desc, blob, max_blob);
+  if (!p->hidden_weights) {
+    fprintf(stderr, "The model has no parameters for --net\n");
+    return -EINVAL;
   }
+  pack_two_layer_net(desc, blob, p->hidden, p->hidden_weights, p->hidden_bias,
+                     p->output_weights, p->output_bias, p->hidden_requant,
+                     p->output_requant);
+  return validate_net_model(desc, blob, max_blob);
+}
 
-  err = bpf_object__load(obj);
-  if (err) {
-    fprintf(stderr, "Failed to load BPF object: %s\n", strerror(errno));
-    goto cleanup;
+// Fill mnist_model and mnist_net_weights from the model file's network
+// section, or failing that from the two-layer parameters
+static int load_net_model(const struct model_file *model,
+                          const struct param_maps *maps,
+                          const struct model_params *p) {
+  struct mnist_model_desc desc;
+  struct mnist_net_weights *weights = calloc(1, sizeof(*weights));
+  int err;
+
+  if (!weights) {
+    fprintf(stderr, "Failed to allocate the network weights\n");
+    return -ENOMEM;
   }
 
-  // Retrieve map FDs (map names must match those in the BPF program)
-  map_fd_input = bpf_object__find_map_fd_by_name(obj, "mnist_input");
-  map_fd_hidW = bpf_object__find_map_fd_by_name(obj, "hidden_weights");
-  map_fd_hidB = bpf_object__find_map_fd_by_name(obj, "hidden_bias");
-  map_fd_outW = bpf_object__find_map_fd_by_name(obj, "output_weights");
-  map_fd_outB = bpf_object__find_map_fd_by_name(obj, "output_bias");
-  map_fd_output = bpf_object__find_map_fd_by_name(obj, "mnist_output");
-
-  if (map_fd_input < 0 || map_fd_hidW < 0 || map_fd_hidB < 0 ||
-      map_fd_outW < 0 || map_fd_outB < 0 || map_fd_output < 0) {
-    fprintf(stderr, "Failed to get map FDs: %s\n", strerror(errno));
+  if (!model || !model->hdr->tensors[MNIST_TENSOR_NET].size)
+    printf("No network section in the model, running the two-layer model "
+           "as a network\n");
+  err = build_net_model(model, 1, p, &desc, weights->data,
+                        MNIST_NET_BLOB_SIZE);
+  if (err)
     goto cleanup;
+
+  printf("Network:");
+  for (__u32 l = 0; l < desc.nr_layers; l++)
+    printf(" %u ->", desc.layers[l].in_dim);
+  printf(" %d\n", OUTPUT_SIZE);
+
+  if (update_map_with_data(maps->model, maps->set, &desc, sizeof(desc),
+                           "mnist_model") < 0 ||
+      update_map_with_data(maps->net, maps->set, weights, desc.blob_size,
+                           "mnist_net_weights") < 0)
+    err = -1;
+
+cleanup:
+  free(weights);
+  return err;
+}
+
+static int update_parameter_maps(const struct param_maps *maps,
+                                 const struct model_params *p) {
+  const void *hidden_weights = p->hidden_weights;
+
+#if MNIST_HIDDEN_WEIGHT_BITS == 4
+  static uint8_t packed[MNIST_HIDDEN_WEIGHTS_SIZE(4, MNIST_MAX_HIDDEN)];
+
+  if (pack_int4_weights(p->hidden_weights, p->hidden_shifts, p->hidden, packed))
+    return -1;
+  hidden_weights = packed;
+#endif
+
+  // Update maps with entire parameter arrays
+  if (update_map_with_data(maps->hidden_weights, maps->set, hidden_weights,
+                           MNIST_HIDDEN_WEIGHTS_SIZE(MNIST_HIDDEN_WEIGHT_BITS,
+                                                     p->hidden),
+                           "hidden_weights") < 0 ||
+      update_map_with_data(maps->hidden_bias, maps->set, p->hidden_bias,
+                           p->hidden * sizeof(int32_t), "hidden_bias") < 0 ||
+      update_map_with_data(maps->output_weights, maps->set, p->output_weights,
+                           p->hidden * OUTPUT_SIZE, "output_weights") < 0 ||
+      update_map_with_data(maps->output_bias, maps->set, p->output_bias,
+                           OUTPUT_SIZE * sizeof(int32_t), "output_bias") < 0 ||
+      update_map_with_data(maps->hidden_requant, maps->set, p->hidden_requant,
+                           MNIST_LAYER_REQUANT_SIZE(p->hidden),
+                           "hidden_requant") < 0 ||
+      update_map_with_data(maps->output_requant, maps->set, p->output_requant,
+                           MNIST_LAYER_REQUANT_SIZE(OUTPUT_SIZE),
+                           "output_requant") < 0)
+    return -1;
+#ifdef MNIST_PRUNED_BLOCKS
+  if (update_map_with_data(maps->hidden_blocks, maps->set, p->hidden_blocks,
+                           MNIST_HIDDEN_BLOCKS_SIZE(p->hidden,
+                                                    MNIST_PRUNED_BLOCKS),
+                           "hidden_blocks") < 0)
+    return -1;
+#endif
+  return 0;
+}
+
+static int set_control_word(int control_fd, __u32 key, __u32 value) {
+  if (bpf_map_update_elem(control_fd, &key, &value, BPF_ANY)) {
+    fprintf(stderr, "Failed to set mnist_control[%u]: %s\n", key,
+            strerror(errno));
+    return -1;
   }
+  return 0;
+}
 
-  err = load_model_parameters(map_fd_input, map_fd_hidW, map_fd_hidB,
-                              map_fd_outW, map_fd_outB);
-  if (err) {
-    fprintf(stderr, "Error loading parameters into maps.\n");
-    goto cleanup;
+// Pick the weight set the programs are not using as the one to write. The
+// generation counter only moves forward, so results cached under the
+// current model can never match again once it is replaced.
+static int select_inactive_weight_set(struct param_maps *maps) {
+  __u32 key = MNIST_CTL_WEIGHT_SET;
+  __u32 active;
+
+  if (bpf_map_lookup_elem(maps->control, &key, &active)) {
+    fprintf(stderr, "Failed to read the active weight set: %s\n",
+            strerror(errno));
+    return -1;
   }
+  maps->generation = active + 1;
+  maps->set = maps->generation % MNIST_NR_WEIGHT_SETS;
+  return 0;
+}
 
-  // Attach program to tracepoint
-  link = bpf_program__attach_tracepoint(prog, TP_NAME, TP_EVENT);
-  err = libbpf_get_error(link);
-  if (err) {
-    fprintf(stderr, "Failed to attach tracepoint: %s\n", strerror(-err));
-    link = NULL;
-    goto cleanup;
+// Number of runs reading weight set set, summed over the per-CPU counts of
+// mnist_set_readers
+static int count_set_readers(int readers_fd, __u32 set, __u64 *readers) {
+  int nr_cpus = libbpf_num_possible_cpus();
+  if (nr_cpus <= 0) {
+    fprintf(stderr, "Failed to get number of possible CPUs\n");
+    return -1;
+  }
+
+  __u64 *values = calloc(nr_cpus, sizeof(*values));
+  if (!values) {
+    fprintf(stderr, "Failed to allocate per-CPU readers buffer\n");
+    return -ENOMEM;
   }
-  printf("program attached to %s:%s tracepoint.\n", TP_NAME, TP_EVENT);
 
-  printf("Triggering inference by executing a syscall...\n");
-  getpid();
-  usleep(100000);
+  int err = 0;
+  if (bpf_map_lookup_elem(readers_fd, &set, values)) {
+    fprintf(stderr, "Failed to read mnist_set_readers: %s\n",
+            strerror(errno));
+    err = -1;
+  } else {
+    *readers = 0;
+    for (int cpu = 0; cpu < nr_cpus; cpu++)
+      *readers += values[cpu];
+  }
+  free(values);
+  return err;
+}
 
-  int output[OUTPUT_SIZE] = {0};
-  uint32_t key = 0;
+// Switch the programs over to the weight set just written. Requests that
+// started before the switch may still be reading the old set, so wait until
+// mnist_set_readers shows none left before returning and letting anyone
+// rewrite it. The wait is bounded by WEIGHT_SET_TIMEOUT_US; past that the
+// old set is only best-effort quiescent, and we say so.
+static int activate_weight_set(const struct param_maps *maps) {
+  __u32 old_set = (maps->generation - 1) % MNIST_NR_WEIGHT_SETS;
+  __u64 readers = 0;
 
-  err = bpf_map_lookup_elem(map_fd_output, &key, output);
-  if (err) {
-    fprintf(stderr, "Failed to read output map: %s\n", strerror(errno));
-    goto cleanup;
+  if (set_control_word(maps->control, MNIST_CTL_WEIGHT_SET,
+                       maps->generation))
+    return -1;
+  for (long waited_us = 0;; waited_us += WEIGHT_SET_POLL_US) {
+    if (count_set_readers(maps->readers, old_set, &readers))
+      return -1;
+    if (!readers)
+      break;
+    if (waited_us >= WEIGHT_SET_TIMEOUT_US) {
+      fprintf(stderr,
+              "Warning: %llu runs still read weight set %u after %d ms\n",
+              (unsigned long long)readers, old_set,
+              WEIGHT_SET_TIMEOUT_US / 1000);
+      break;
+    }
+    usleep(WEIGHT_SET_POLL_US);
   }
+  printf("Activated weight set %u (model generation %u)\n", maps->set,
+         maps->generation);
+  return 0;
+}
 
-  printf("MNIST Output:\n");
-  for (int i = 0; i < OUTPUT_SIZE; i++) {
-    printf(" %d", output[i]);
+// Write the parameter maps, and with net set also the generic network
+// (model may be NULL for dummy parameters)
+static int load_model_parameters(const struct model_file *model,
+                                 const struct model_params *p,
+                                 const struct param_maps *maps, int net) {
+  int err = 0;
+
+  if (p->hidden_weights)
+    err = update_parameter_maps(maps, p);
+  if (!err && net)
+    err = load_net_model(model, maps, p);
+  return err;
+}
+
+// Set up the user-space reference engine on the network the BPF programs
+// run: the network section for use_net_section (--net) or a model holding
+// nothing else, otherwise the two-layer model
+static struct refinfer *open_reference(const struct model_file *model,
+                                       const struct model_params *p,
+                                       int use_net_section,
+                                       enum refinfer_kernel kernel) {
+  struct mnist_model_desc desc;
+  uint8_t *blob = malloc(MNIST_NET_MAX_BLOB_SIZE);
+  struct refinfer *ref = NULL;
+
+  if (!blob) {
+    fprintf(stderr, "Failed to allocate the network weights\n");
+    return NULL;
   }
-  printf("\n");
+  if (!build_net_model(model, use_net_section || !p->hidden_weights, p, &desc,
+                       blob, MNIST_NET_MAX_BLOB_SIZE)) {
+    ref = refinfer_open(&desc, blob, kernel);
+    if (ref)
+      printf("User-space reference: %s kernel\n",
+             refinfer_kernel_name(refinfer_get_kernel(ref)));
+    else
+      fprintf(stderr, "Failed to set up the %s reference kernel: %s\n",
+              refinfer_kernel_name(kernel), strerror(errno));
+  }
+  free(blob);
+  return ref;
+}
 
-  // Determine the predicted digit
-  predict_digit(output, OUTPUT_SIZE);
+static void load_test_image(uint8_t *input_image) {
+  // Try to load a test image, otherwise use dummy input
+  if (read_binary_file(TEST_IMAGE_FILE, input_image, INPUT_SIZE) < 0) {
+    printf("Couldn't load %s, using dummy input image\n", TEST_IMAGE_FILE);
+    for (int i = 0; i < INPUT_SIZE; i++)
+      input_image[i] = (i % 255); // More varied pattern
+  }
+}
 
-cleanup:
-  if (link)
-    bpf_link__destroy(link);
-  if (obj)
-    bpf_object__close(obj);
+// Run the on-demand program once over count images (at most
+// MNIST_BATCH_SIZE) via BPF_PROG_RUN, filling count rows of outputs. Syscall
+// programs do not support ctx_out, so the logits come back in ctx_in.
+static int run_inference(int prog_fd, const uint8_t (*images)[INPUT_SIZE],
+                         __u32 count, int (*outputs)[OUTPUT_SIZE]) {
+  struct mnist_run_ctx ctx = {.count = count};
+
+  if (count == 0 || count > MNIST_BATCH_SIZE) {
+    fprintf(stderr, "Invalid batch of %u images (max %d)\n", count,
+            MNIST_BATCH_SIZE);
+    return -1;
+  }
+  memcpy(ctx.input, images, count * sizeof(ctx.input[0]));
+
+  int ret = kerinfer_run_program(prog_fd, &ctx, sizeof(ctx));
+  if (ret < 0) {
+    fprintf(stderr, "Failed to run inference program: %s\n",
+            strerror(-ret));
+    return -1;
+  }
+  if (ret != MNIST_RUN_OK) {
+    fprintf(stderr, "Inference program returned %d\n", ret);
+    return -1;
+  }
+
+  memcpy(outputs, ctx.output, count * sizeof(ctx.output[0]));
+  return 0;
+}
+
+// Index of the largest logit, the first one on ties like torch.argmax
+static int top1(const int *output, int output_size) {
+  int max_idx = 0;
+
+  for (int i = 1; i < output_size; i++) {
+    if (output[i] > output[max_idx])
+      max_idx = i;
+  }
+  return max_idx;
+}
+
+static void predict_digit(int *output, int output_size) {
+  int max_idx = top1(output, output_size);
+
+  printf("Predicted digit: %d (confidence value: %d)\n", max_idx,
+         output[max_idx]);
+}
+
+static void print_output(int *output) {
+  printf("MNIST Output:\n");
+  for (int i = 0; i < OUTPUT_SIZE; i++) {
+    printf(" %d", output[i]);
+  }
+  printf("\n");
+
+  // Determine the predicted digit
+  predict_digit(output, OUTPUT_SIZE);
+}
+
+static const char *const stat_names[MNIST_NR_STATS] = {
+    [MNIST_STAT_INVOCATIONS] = "invocations",
+    [MNIST_STAT_SKIPPED] = "skipped",
+    [MNIST_STAT_IMAGES] = "images",
+    [MNIST_STAT_INFER_NS] = "inference_ns",
+    [MNIST_STAT_ERRORS] = "errors",
+    [MNIST_STAT_BUSY] = "busy",
+    [MNIST_STAT_LAYER0_NS] = "layer0_ns",
+    [MNIST_STAT_LAYER1_NS] = "layer1_ns",
+    [MNIST_STAT_CACHE_HITS] = "cache_hits",
+    [MNIST_STAT_CACHE_MISSES] = "cache_misses",
+};
+
+// Sum the per-CPU mnist_stats counters into totals
+static int read_stats(int map_fd_stats, __u64 *totals) {
+  int nr_cpus = libbpf_num_possible_cpus();
+  if (nr_cpus <= 0) {
+    fprintf(stderr, "Failed to get number of possible CPUs\n");
+    return -1;
+  }
+
+  __u64 *values = calloc(nr_cpus, sizeof(*values));
+  if (!values) {
+    fprintf(stderr, "Failed to allocate per-CPU stats buffer\n");
+    return -ENOMEM;
+  }
+
+  int err = 0;
+  for (__u32 key = 0; key < MNIST_NR_STATS; key++) {
+    if (bpf_map_lookup_elem(map_fd_stats, &key, values)) {
+      fprintf(stderr, "Failed to read %s counter: %s\n", stat_names[key],
+              strerror(errno));
+      err = -1;
+      break;
+    }
+    totals[key] = 0;
+    for (int cpu = 0; cpu < nr_cpus; cpu++)
+      totals[key] += values[cpu];
+  }
+  free(values);
+  return err;
+}
+
+static int print_stats(int map_fd_stats) {
+  __u64 totals[MNIST_NR_STATS];
+
+  if (read_stats(map_fd_stats, totals))
+    return -1;
+
+  printf("Inference stats:\n");
+  for (int i = 0; i < MNIST_NR_STATS; i++)
+    printf("  %-12s %llu\n", stat_names[i], (unsigned long long)totals[i]);
+  if (totals[MNIST_STAT_IMAGES])
+    printf("  %-12s %.1f\n", "ns/image",
+           (double)totals[MNIST_STAT_INFER_NS] / totals[MNIST_STAT_IMAGES]);
+  return 0;
+}
+
+// Pack the non-zero pixels of an image into a sparse context. Returns the
+// pixel count, or -1 if the image is too dense for MNIST_MAX_NNZ.
+static int pack_sparse_input(const uint8_t *input_image,
+                             struct mnist_sparse_ctx *ctx) {
+  __u32 nnz = 0;
+
+  for (int i = 0; i < INPUT_SIZE; i++) {
+    if (!input_image[i])
+      continue;
+    if (nnz == MNIST_MAX_NNZ)
+      return -1;
+    ctx->pixels[nnz].index = i;
+    ctx->pixels[nnz].value = input_image[i];
+    ctx->pixels[nnz].reserved = 0;
+    nnz++;
+  }
+  ctx->nnz = nnz;
+  return nnz;
+}
+
+// Run the sparse program over input_image, falling back to the dense
+// program when the image has more than MNIST_MAX_NNZ non-zero pixels
+static int run_sparse_inference(int sparse_fd, int dense_fd,
+                                const uint8_t *input_image, int *output) {
+  struct mnist_sparse_ctx ctx = {0};
+
+  int nnz = pack_sparse_input(input_image, &ctx);
+  if (nnz < 0) {
+    printf("Image has more than %d non-zero pixels, running it dense\n",
+           MNIST_MAX_NNZ);
+    return run_inference(dense_fd,
+                         (const uint8_t (*)[INPUT_SIZE])input_image, 1,
+                         (int (*)[OUTPUT_SIZE])output);
+  }
+  printf("Packed %d non-zero pixels\n", nnz);
+
+  int ret = kerinfer_run_program(sparse_fd, &ctx, sizeof(ctx));
+  if (ret < 0) {
+    fprintf(stderr, "Failed to run sparse inference program: %s\n",
+            strerror(-ret));
+    return -1;
+  }
+  if (ret != MNIST_RUN_OK) {
+    fprintf(stderr, "Sparse inference program returned %d\n", ret);
+    return -1;
+  }
+
+  memcpy(output, ctx.output, sizeof(ctx.output));
+  return 0;
+}
+
+// Size every per-slot map before the object is loaded
+static int configure_slots(struct bpf_object *obj, __u32 nr_slots) {
+  static const char *const slot_maps[] = {"mnist_input", "mnist_output",
+                                          "mnist_slot_state",
+                                          "mnist_free_slots"};
+
+  for (size_t i = 0; i < sizeof(slot_maps) / sizeof(slot_maps[0]); i++) {
+    struct bpf_map *map = bpf_object__find_map_by_name(obj, slot_maps[i]);
+    if (!map) {
+      fprintf(stderr, "Couldn't find map '%s'\n", slot_maps[i]);
+      return -ENOENT;
+    }
+    int err = bpf_map__set_max_entries(map, nr_slots);
+    if (err) {
+      fprintf(stderr, "Failed to size %s to %u slots: %s\n", slot_maps[i],
+              nr_slots, strerror(-err));
+      return err;
+    }
+  }
+  return 0;
+}
+
+// Size the tracepoint program's result cache
+static int configure_cache(struct bpf_object *obj, __u32 nr_entries) {
+  struct bpf_map *map = bpf_object__find_map_by_name(obj, "mnist_cache");
+  if (!map) {
+    fprintf(stderr, "Couldn't find map 'mnist_cache'\n");
+    return -ENOENT;
+  }
+  int err = bpf_map__set_max_entries(map, nr_entries);
+  if (err)
+    fprintf(stderr, "Failed to size mnist_cache to %u entries: %s\n",
+            nr_entries, strerror(-err));
+  return err;
+}
+
+// Switch mnist_output to a per-CPU array, so each core writes its own copy
+// of the result instead of bouncing a shared cache line between cores.
+// Per-CPU arrays cannot be mmap()ed, so that flag goes.
+static int configure_percpu_output(struct bpf_object *obj) {
+  struct bpf_map *map = bpf_object__find_map_by_name(obj, "mnist_output");
+  if (!map) {
+    fprintf(stderr, "Couldn't find map 'mnist_output'\n");
+    return -ENOENT;
+  }
+  int err = bpf_map__set_type(map, BPF_MAP_TYPE_PERCPU_ARRAY);
+  if (!err)
+    err = bpf_map__set_map_flags(map,
+                                 bpf_map__map_flags(map) & ~BPF_F_MMAPABLE);
+  if (err)
+    fprintf(stderr, "Failed to make mnist_output per-CPU: %s\n",
+            strerror(-err));
+  return err;
+}
+
+static int attach_tracepoint(struct bpf_program *prog,
+                             struct bpf_link **linkp) {
+  struct bpf_link *link =
+      bpf_program__attach_tracepoint(prog, TP_NAME, TP_EVENT);
+  int err = libbpf_get_error(link);
+  if (err) {
+    fprintf(stderr, "Failed to attach tracepoint: %s\n", strerror(-err));
+    return err;
+  }
+  *linkp = link;
+  printf("program attached to %s:%s tracepoint.\n", TP_NAME, TP_EVENT);
+  return 0;
+}
+
+static int attach_xdp(struct bpf_program *prog, const char *ifname,
+                      struct bpf_link **linkp) {
+  int ifindex = if_nametoindex(ifname);
+
+  if (!ifindex) {
+    fprintf(stderr, "Unknown interface %s: %s\n", ifname, strerror(errno));
+    return -errno;
+  }
+  struct bpf_link *link = bpf_program__attach_xdp(prog, ifindex);
+  int err = libbpf_get_error(link);
+  if (err) {
+    fprintf(stderr, "Failed to attach XDP to %s: %s\n", ifname,
+            strerror(-err));
+    return err;
+  }
+  *linkp = link;
+  printf("program attached to %s (XDP).\n", ifname);
+  return 0;
+}
+
+// Legacy mode: with the program attached to the syscall tracepoint, publish
+// the image in a request slot and let the next syscall run the network.
+static int run_tracepoint_inference(struct kerinfer *ki,
+                                    const uint8_t *input_image, int *output) {
+  struct kerinfer_request req;
+
+  int err = kerinfer_submit(ki, input_image, &req);
+  if (err) {
+    fprintf(stderr, "Failed to submit request: %s\n", strerror(-err));
+    return err;
+  }
+  printf("Submitted request %u in slot %u, triggering inference...\n",
+         req.seq, req.slot);
+
+  err = kerinfer_collect(ki, &req, output, SLOT_TIMEOUT_MS);
+  if (!err)
+    printf("Result for request %u from slot %u\n", req.seq, req.slot);
+  return err;
+}
+
+enum infer_mode {
+  MODE_RUN,           // batched bpf_mnist_infer_run via BPF_PROG_RUN
+  MODE_SPARSE,        // bpf_mnist_infer_sparse, falling back to MODE_RUN
+  MODE_SWAR,          // batched bpf_mnist_infer_swar via BPF_PROG_RUN
+  MODE_NET,           // batched bpf_mnist_infer_net via BPF_PROG_RUN
+  MODE_ARENA,         // bpf_mnist_infer_arena on images in the arena
+  MODE_PRUNED,        // batched bpf_mnist_infer_pruned via BPF_PROG_RUN
+  MODE_TRACEPOINT,    // bpf_mnist_infer on raw_syscalls:sys_enter
+  MODE_BENCH,         // time every on-demand variant
+  MODE_SYSCALL_BENCH, // syscall overhead of bpf_mnist_infer
+  MODE_USERSPACE,     // reference engine only, no BPF at all
+  MODE_XDP,           // bpf_mnist_infer_xdp serving UDP requests
+};
+
+// Programs to load for each mode, the one driving the mode first
+#define MAX_MODE_PROGRAMS 5
+static const char *const *const mode_programs[] = {
+    [MODE_RUN] = (const char *const[]){"bpf_mnist_infer_run", NULL},
+    [MODE_SPARSE] = (const char *const[]){"bpf_mnist_infer_sparse",
+                                          "bpf_mnist_infer_run", NULL},
+    [MODE_SWAR] = (const char *const[]){"bpf_mnist_infer_swar",
+                                        "bpf_mnist_infer_run", NULL},
+    [MODE_NET] = (const char *const[]){"bpf_mnist_infer_net",
+                                       "bpf_mnist_infer_run", NULL},
+    [MODE_ARENA] = (const char *const[]){"bpf_mnist_infer_arena",
+                                         "bpf_mnist_infer_run", NULL},
+    [MODE_PRUNED] = (const char *const[]){"bpf_mnist_infer_pruned",
+                                          "bpf_mnist_infer_run", NULL},
+    [MODE_TRACEPOINT] = (const char *const[]){"bpf_mnist_infer", NULL},
+    [MODE_SYSCALL_BENCH] = (const char *const[]){"bpf_mnist_infer", NULL},
+    [MODE_USERSPACE] = (const char *const[]){NULL},
+    [MODE_XDP] = (const char *const[]){"bpf_mnist_infer_xdp", NULL},
+    [MODE_BENCH] = (const char *const[]){"bpf_mnist_infer_run",
+                                         "bpf_mnist_infer_sparse",
+                                         "bpf_mnist_infer_net",
+#if MNIST_HAVE_SWAR
+                                         "bpf_mnist_infer_swar",
+#endif
+#ifdef MNIST_PRUNED_BLOCKS
+                                         "bpf_mnist_infer_pruned",
+#endif
+                                         NULL},
+};
+
+#define BENCH_WARMUP_RUNS 100
+
+static int compare_u64(const void *a, const void *b) {
+  __u64 x = *(const __u64 *)a, y = *(const __u64 *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+// Invoke prog_fd runs times on ctx, after a warm-up, storing the latency of
+// each BPF_PROG_RUN call as seen from user space. Syscall programs reject
+// opts.repeat, so every run is its own call; MNIST_RUN_EBUSY retries count
+// towards the latency of the run they delay.
+static int time_program(int prog_fd, void *ctx, size_t ctx_size, long runs,
+                        __u64 *lat_ns) {
+  struct timespec t0, t1;
+
+  for (long r = -BENCH_WARMUP_RUNS; r < runs; r++) {
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int ret = kerinfer_run_program(prog_fd, ctx, ctx_size);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (ret < 0) {
+      fprintf(stderr, "Failed to run inference program: %s\n",
+              strerror(-ret));
+      return -1;
+    }
+    if (ret != MNIST_RUN_OK) {
+      fprintf(stderr, "Inference program returned %d\n", ret);
+      return -1;
+    }
+    if (r >= 0)
+      lat_ns[r] = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec -
+                  t0.tv_nsec;
+  }
+  return 0;
+}
+
+struct bench_variant {
+  const char *name;
+  int prog_fd;
+  int sparse; // bpf_mnist_infer_sparse context instead of mnist_run_ctx
+  __u32 batch;
+};
+
+union bench_ctx {
+  struct mnist_run_ctx run;
+  struct mnist_sparse_ctx sparse;
+};
+
+static void print_per_image(__u64 total_ns, __u64 images) {
+  if (total_ns)
+    printf(" %9.1f", (double)total_ns / images);
+  else
+    printf(" %9s", "-");
+}
+
+// Print the user-space columns of a benchmark row; sorts lat_ns
+static void print_latencies(const char *name, __u32 batch, __u64 *lat_ns,
+                            long runs) {
+  __u64 total_ns = 0;
+
+  for (long r = 0; r < runs; r++)
+    total_ns += lat_ns[r];
+  qsort(lat_ns, runs, sizeof(*lat_ns), compare_u64);
+
+  double ns_per_call = (double)total_ns / runs;
+
+  printf("%-10s %5u %9.0f %9.1f %11.0f %8llu %8llu", name, batch,
+         ns_per_call, ns_per_call / batch, 1e9 * batch / ns_per_call,
+         (unsigned long long)lat_ns[runs / 2],
+         (unsigned long long)lat_ns[runs * 99 / 100]);
+}
+
+static int bench_variant(const struct bench_variant *v, int map_fd_stats,
+                         const uint8_t *image, long runs, __u64 *lat_ns) {
+  static union bench_ctx ctx;
+  __u64 before[MNIST_NR_STATS], after[MNIST_NR_STATS];
+  size_t ctx_size;
+
+  memset(&ctx, 0, sizeof(ctx));
+  if (v->sparse) {
+    if (pack_sparse_input(image, &ctx.sparse) < 0) {
+      printf("%-10s skipped: test image has more than %d pixels set\n",
+             v->name, MNIST_MAX_NNZ);
+      return 0;
+    }
+    ctx_size = sizeof(ctx.sparse);
+  } else {
+    ctx.run.count = v->batch;
+    for (__u32 b = 0; b < v->batch; b++)
+      memcpy(ctx.run.input[b], image, INPUT_SIZE);
+    ctx_size = sizeof(ctx.run);
+  }
+
+  if (read_stats(map_fd_stats, before) ||
+      time_program(v->prog_fd, &ctx, ctx_size, runs, lat_ns) ||
+      read_stats(map_fd_stats, after))
+    return -1;
+
+  // The kernel counters include the warm-up runs
+  __u64 images = after[MNIST_STAT_IMAGES] - before[MNIST_STAT_IMAGES];
+
+  print_latencies(v->name, v->batch, lat_ns, runs);
+  print_per_image(after[MNIST_STAT_INFER_NS] - before[MNIST_STAT_INFER_NS],
+                  images);
+  print_per_image(after[MNIST_STAT_LAYER0_NS] - before[MNIST_STAT_LAYER0_NS],
+                  images);
+  print_per_image(after[MNIST_STAT_LAYER1_NS] - before[MNIST_STAT_LAYER1_NS],
+                  images);
+  printf("\n");
+  return 0;
+}
+
+// Time runs calls of the user-space engine on a full batch with every
+// kernel the CPU supports, for comparison with the in-kernel cost
+static int bench_reference(struct refinfer *ref, const uint8_t *image,
+                           long runs, __u64 *lat_ns) {
+  static uint8_t images[MNIST_BATCH_SIZE][INPUT_SIZE];
+  static int32_t logits[MNIST_BATCH_SIZE][OUTPUT_SIZE];
+  struct timespec t0, t1;
+  char name[16];
+
+  for (int b = 0; b < MNIST_BATCH_SIZE; b++)
+    memcpy(images[b], image, INPUT_SIZE);
+
+  for (int k = REFINFER_KERNEL_SCALAR; k < REFINFER_NR_KERNELS; k++) {
+    if (refinfer_set_kernel(ref, k))
+      continue;
+    for (long r = -BENCH_WARMUP_RUNS; r < runs; r++) {
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      refinfer_infer(ref, images[0], MNIST_BATCH_SIZE, logits[0]);
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      if (r >= 0)
+        lat_ns[r] = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec -
+                    t0.tv_nsec;
+    }
+    snprintf(name, sizeof(name), "ref-%s", refinfer_kernel_name(k));
+    print_latencies(name, MNIST_BATCH_SIZE, lat_ns, runs);
+    printf(" %9s %9s %9s\n", "-", "-", "-");
+  }
+  return 0;
+}
+
+// Benchmark every on-demand variant in the build, at batch sizes 1, 2, 4,
+// ... up to MNIST_BATCH_SIZE, then the user-space reference engine.
+// prog_fds follows mode_programs[MODE_BENCH].
+static int run_benchmarks(const int *prog_fds, int map_fd_stats,
+                          struct refinfer *ref, const uint8_t *image,
+                          long runs) {
+  static const struct {
+    const char *name;
+    int prog; // index into prog_fds
+  } dense[] = {
+      {"run", 0},
+      {"net", 2},
+#if MNIST_HAVE_SWAR
+      {"swar", 3},
+#endif
+#ifdef MNIST_PRUNED_BLOCKS
+      {"pruned", 3 + MNIST_HAVE_SWAR},
+#endif
+  };
+  struct bench_variant variants[sizeof(dense) / sizeof(dense[0]) * 8 + 1];
+  int nr_variants = 0;
+  int err = 0;
+
+  for (size_t p = 0; p < sizeof(dense) / sizeof(dense[0]); p++) {
+    for (__u32 batch = 1;; batch *= 2) {
+      if (batch > MNIST_BATCH_SIZE)
+        batch = MNIST_BATCH_SIZE;
+      variants[nr_variants++] = (struct bench_variant){
+          .name = dense[p].name,
+          .prog_fd = prog_fds[dense[p].prog],
+          .batch = batch,
+      };
+      if (batch == MNIST_BATCH_SIZE)
+        break;
+    }
+  }
+  variants[nr_variants++] = (struct bench_variant){
+      .name = "sparse", .prog_fd = prog_fds[1], .sparse = 1, .batch = 1};
+
+  __u64 *lat_ns = calloc(runs, sizeof(*lat_ns));
+  if (!lat_ns) {
+    fprintf(stderr, "Failed to allocate the latency buffer\n");
+    return -ENOMEM;
+  }
+
+  printf("Benchmarking %ld runs per variant (after %d warm-up runs)\n", runs,
+         BENCH_WARMUP_RUNS);
+  printf("%-10s %5s %9s %9s %11s %8s %8s %9s %9s %9s\n", "variant", "batch",
+         "ns/call", "ns/image", "images/s", "p50", "p99", "kernel",
+         "layer0", "layer1");
+  for (int i = 0; i < nr_variants && !err; i++)
+    err = bench_variant(&variants[i], map_fd_stats, image, runs, lat_ns);
+  if (!err)
+    err = bench_reference(ref, image, runs, lat_ns);
+  printf("ns/call, p50 and p99 are BPF_PROG_RUN (ref-*: refinfer_infer) "
+         "latencies seen\nfrom user space; kernel, layer0 and layer1 are "
+         "in-kernel ns per image\n(layers need make PROFILE=1)\n");
+
+  free(lat_ns);
+  return err;
+}
+
+// Syscalls issued between two checks of the stop flag
+#define SYSCALL_BENCH_BATCH 1024
+
+struct syscall_worker {
+  pthread_t thread;
+  int cpu;
+  __u64 calls;
+};
+
+static int syscall_bench_stop;
+
+static void *syscall_worker_fn(void *arg) {
+  struct syscall_worker *w = arg;
+  cpu_set_t cpus;
+  __u64 calls = 0;
+
+  // Best effort: an unpinned worker still loads its share of the machine
+  CPU_ZERO(&cpus);
+  CPU_SET(w->cpu, &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+  while (!__atomic_load_n(&syscall_bench_stop, __ATOMIC_RELAXED)) {
+    for (int i = 0; i < SYSCALL_BENCH_BATCH; i++)
+      syscall(SYS_getpid);
+    calls += SYSCALL_BENCH_BATCH;
+  }
+  w->calls = calls;
+  return NULL;
+}
+
+// Issue getpid() in a tight loop on every CPU we may run on for duration_ms,
+// and report the mean cost of one syscall on one CPU
+static int measure_syscalls(long duration_ms, double *ns_per_call,
+                            double *calls_per_sec) {
+  struct syscall_worker *workers;
+  struct timespec t0, t1;
+  cpu_set_t allowed;
+  int nr_workers = 0;
+  int err = 0;
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+    fprintf(stderr, "Failed to get the CPU affinity: %s\n", strerror(errno));
+    return -1;
+  }
+  workers = calloc(CPU_COUNT(&allowed), sizeof(*workers));
+  if (!workers) {
+    fprintf(stderr, "Failed to allocate the benchmark workers\n");
+    return -ENOMEM;
+  }
+
+  __atomic_store_n(&syscall_bench_stop, 0, __ATOMIC_RELAXED);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed))
+      continue;
+    workers[nr_workers].cpu = cpu;
+    err = pthread_create(&workers[nr_workers].thread, NULL, syscall_worker_fn,
+                         &workers[nr_workers]);
+    if (err) {
+      fprintf(stderr, "Failed to start a benchmark worker: %s\n",
+              strerror(err));
+      break;
+    }
+    nr_workers++;
+  }
+  if (!err)
+    usleep(duration_ms * 1000);
+  __atomic_store_n(&syscall_bench_stop, 1, __ATOMIC_RELAXED);
+
+  __u64 calls = 0;
+  for (int i = 0; i < nr_workers; i++) {
+    pthread_join(workers[i].thread, NULL);
+    calls += workers[i].calls;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  free(workers);
+  if (err || !calls)
+    return -1;
+
+  double elapsed_ns =
+      (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+  *ns_per_call = elapsed_ns * nr_workers / calls;
+  *calls_per_sec = calls * 1e9 / elapsed_ns;
+  return 0;
+}
+
+// Measure what the tracepoint program adds to every syscall on the machine:
+// first with it detached, then attached but gated (no request waiting), then
+// running the network on every syscall
+static int run_syscall_bench(struct bpf_program *prog, int control_fd,
+                             int map_fd_stats, long duration_ms) {
+  static const char *const phases[] = {"detached", "gated", "computing"};
+  double ns[3], rate[3];
+  __u64 before[MNIST_NR_STATS], after[MNIST_NR_STATS];
+  struct bpf_link *link = NULL;
+  int err;
+
+  printf("Running getpid() on every CPU for %ld ms per phase...\n",
+         duration_ms);
+  err = measure_syscalls(duration_ms, &ns[0], &rate[0]);
+  if (!err)
+    err = attach_tracepoint(prog, &link);
+  if (!err)
+    err = measure_syscalls(duration_ms, &ns[1], &rate[1]);
+  if (!err)
+    err = read_stats(map_fd_stats, before) ||
+          set_control_word(control_fd, MNIST_CTL_FORCE_COMPUTE, 1);
+  if (!err) {
+    err = measure_syscalls(duration_ms, &ns[2], &rate[2]);
+    if (set_control_word(control_fd, MNIST_CTL_FORCE_COMPUTE, 0))
+      err = -1;
+  }
+  if (!err)
+    err = read_stats(map_fd_stats, after);
+  if (link)
+    bpf_link__destroy(link);
+  if (err)
+    return err;
+
+  printf("%-10s %12s %14s %14s\n", "phase", "ns/syscall", "overhead ns",
+         "syscalls/s");
+  for (int i = 0; i < 3; i++)
+    printf("%-10s %12.1f %14.1f %14.0f\n", phases[i], ns[i], ns[i] - ns[0],
+           rate[i]);
+
+  __u64 images = after[MNIST_STAT_IMAGES] - before[MNIST_STAT_IMAGES];
+  if (images)
+    printf("Network time while computing: %.1f ns per syscall\n",
+           (double)(after[MNIST_STAT_INFER_NS] - before[MNIST_STAT_INFER_NS]) /
+               images);
+  return 0;
+}
+
+// Compare count rows of logits against the reference program's
+static int verify_outputs(int ref_fd, const uint8_t (*images)[INPUT_SIZE],
+                          __u32 count, int (*outputs)[OUTPUT_SIZE]) {
+  int ref[MNIST_BATCH_SIZE][OUTPUT_SIZE];
+  int mismatches = 0;
+
+  if (run_inference(ref_fd, images, count, ref))
+    return -1;
+
+  for (__u32 b = 0; b < count; b++) {
+    if (memcmp(ref[b], outputs[b], sizeof(ref[b]))) {
+      fprintf(stderr, "Image %u differs from the reference kernel\n", b);
+      mismatches++;
+    }
+  }
+  if (mismatches)
+    return -1;
+  printf("Verified %u image(s): bit-identical to the reference kernel\n",
+         count);
+  return 0;
+}
+
+// Compare count rows of logits against the user-space reference engine
+static int verify_reference(const struct refinfer *ref,
+                            const uint8_t (*images)[INPUT_SIZE], __u32 count,
+                            int (*outputs)[OUTPUT_SIZE]) {
+  int32_t logits[MNIST_BATCH_SIZE][OUTPUT_SIZE];
+  int mismatches = 0;
+
+  refinfer_infer(ref, images[0], count, logits[0]);
+  for (__u32 b = 0; b < count; b++) {
+    if (memcmp(logits[b], outputs[b], sizeof(logits[b]))) {
+      fprintf(stderr, "Image %u differs from the user-space reference\n", b);
+      mismatches++;
+    }
+  }
+  if (mismatches)
+    return -1;
+  printf("Verified %u image(s): bit-identical to the user-space %s "
+         "reference\n",
+         count, refinfer_kernel_name(refinfer_get_kernel(ref)));
+  return 0;
+}
+
+// Run the reference engine over count copies of the test image, for hosts
+// where no BPF program can be loaded
+static void run_userspace_inference(const struct refinfer *ref,
+                                    const uint8_t *image, __u32 count,
+                                    int (*outputs)[OUTPUT_SIZE]) {
+  uint8_t images[MNIST_BATCH_SIZE][INPUT_SIZE];
+
+  for (__u32 b = 0; b < count; b++)
+    memcpy(images[b], image, INPUT_SIZE);
+  printf("Running inference on a batch of %u in user space...\n", count);
+  refinfer_infer(ref, images[0], count, (int32_t *)outputs);
+}
+
+// Test set written by train.py --dump-test PREFIX: PREFIX.images holds the
+// raw images, PREFIX.labels two bytes per image, its label and the digit the
+// PyTorch int8 model predicted
+struct dataset {
+  uint8_t *images;
+  uint8_t *labels;
+  size_t count;
+};
+
+static int read_dataset(const char *prefix, struct dataset *ds) {
+  char path[PATH_MAX];
+  size_t nr_labels;
+
+  snprintf(path, sizeof(path), "%s.images", prefix);
+  if (kerinfer_read_records(path, INPUT_SIZE, &ds->images, &ds->count))
+    return -1;
+  snprintf(path, sizeof(path), "%s.labels", prefix);
+  if (kerinfer_read_records(path, 2, &ds->labels, &nr_labels))
+    return -1;
+  if (nr_labels != ds->count) {
+    fprintf(stderr, "%s has %zu labels for %zu images\n", path, nr_labels,
+            ds->count);
+    return -1;
+  }
+  if (ds->count > UINT_MAX) {
+    fprintf(stderr, "%s holds too many images\n", prefix);
+    return -1;
+  }
+  return 0;
+}
+
+// Stream a whole test set through the kernel: through the on-demand
+// program split across a dispatcher's pinned workers in batches of batch
+// images, or with ki through the request slots, all of them in flight.
+// Report the throughput and the in-kernel time from mnist_stats, then flag
+// every image whose logits differ from the reference engine's, which fails
+// the run, and every one whose top-1 prediction differs from the PyTorch
+// int8 model's. The latter is only reported: our half-up fixed-point
+// rounding and PyTorch's half-to-even float requantization can legitimately
+// break ties between uint8 logits differently.
+static int run_dataset(const char *prefix, int prog_fd, struct kerinfer *ki,
+                       long batch, long nr_workers, int map_fd_stats,
+                       const struct refinfer *ref) {
+  __u64 before[MNIST_NR_STATS], after[MNIST_NR_STATS];
+  struct kerinfer_dispatcher *d = NULL;
+  int32_t *logits = NULL, *ref_logits = NULL;
+  struct dataset ds = {0};
+  struct timespec t0, t1;
+  int err = -1;
+
+  if (read_dataset(prefix, &ds))
+    goto out;
+  logits = calloc(ds.count, OUTPUT_SIZE * sizeof(*logits));
+  ref_logits = calloc(ds.count, OUTPUT_SIZE * sizeof(*ref_logits));
+  if (!logits || !ref_logits) {
+    fprintf(stderr, "Failed to allocate the logits of %zu images\n",
+            ds.count);
+    goto out;
+  }
+
+  if (!ki) {
+    d = kerinfer_dispatcher_new(prog_fd, nr_workers, batch);
+    if (!d)
+      goto out;
+    printf("Streaming %zu images from %s through %u pinned worker(s), in "
+           "batches of %ld...\n",
+           ds.count, prefix, kerinfer_dispatcher_nr_workers(d), batch);
+  } else {
+    printf("Streaming %zu images from %s through %u request slots...\n",
+           ds.count, prefix, kerinfer_nr_slots(ki));
+  }
+
+  if (read_stats(map_fd_stats, before))
+    goto out;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  if (d)
+    err = kerinfer_dispatch(d, ds.images, ds.count, logits);
+  else
+    err = kerinfer_infer_batch(ki, ds.images, ds.count, logits,
+                               SLOT_TIMEOUT_MS);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  if (err || read_stats(map_fd_stats, after)) {
+    err = -1;
+    goto out;
+  }
+
+  double elapsed_s =
+      (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  __u64 kernel_ns = after[MNIST_STAT_INFER_NS] - before[MNIST_STAT_INFER_NS];
+  printf("%zu images in %.3f s: %.0f images/s\n", ds.count, elapsed_s,
+         ds.count / elapsed_s);
+  printf("Kernel time %.3f s summed over CPUs, %.1f ns/image\n",
+         kernel_ns / 1e9, (double)kernel_ns / ds.count);
+
+  size_t agree = 0, correct = 0, ref_mismatches = 0;
+  refinfer_infer(ref, ds.images, ds.count, ref_logits);
+  for (size_t i = 0; i < ds.count; i++) {
+    const int32_t *out = &logits[i * OUTPUT_SIZE];
+    int digit = top1(out, OUTPUT_SIZE);
+    int label = ds.labels[2 * i], expected = ds.labels[2 * i + 1];
+
+    correct += digit == label;
+    if (digit == expected)
+      agree++;
+    else
+      printf("Image %zu: predicted %d, PyTorch int8 %d, label %d\n", i,
+             digit, expected, label);
+    if (memcmp(out, &ref_logits[i * OUTPUT_SIZE],
+               OUTPUT_SIZE * sizeof(*out))) {
+      printf("Image %zu differs from the user-space reference\n", i);
+      ref_mismatches++;
+    }
+  }
+  printf("Top-1 agreement with PyTorch int8: %zu/%zu (%.2f%%), accuracy "
+         "%.2f%%\n",
+         agree, ds.count, 100.0 * agree / ds.count,
+         100.0 * correct / ds.count);
+  printf("Bit-identical to the user-space %s reference: %zu/%zu\n",
+         refinfer_kernel_name(refinfer_get_kernel(ref)),
+         ds.count - ref_mismatches, ds.count);
+  err = ref_mismatches ? -1 : 0;
+
+out:
+  kerinfer_dispatcher_free(d);
+  free(ref_logits);
+  free(logits);
+  free(ds.labels);
+  free(ds.images);
+  return err;
+}
+
+// Enable autoload for exactly the listed programs, so that only the
+// variants in use get verified and loaded. Returns the first one.
+static struct bpf_program *select_programs(struct bpf_object *obj,
+                                           const char *const *names) {
+  struct bpf_program *prog;
+
+  bpf_object__for_each_program(prog, obj) {
+    bool wanted = false;
+    for (const char *const *name = names; *name; name++)
+      wanted |= !strcmp(bpf_program__name(prog), *name);
+    bpf_program__set_autoload(prog, wanted);
+  }
+
+  for (const char *const *name = names; *name; name++) {
+    if (!bpf_object__find_program_by_name(obj, *name)) {
+      fprintf(stderr, "Couldn't find BPF program '%s'.\n", *name);
+      return NULL;
+    }
+  }
+  return bpf_object__find_program_by_name(obj, names[0]);
+}
+
+// Open (but do not load) the BPF object embedded in the loader for a hidden
+// layer of the given width
+static struct bpf_object *open_embedded_object(__u32 hidden) {
+  const struct embedded_object *emb = find_embedded_object(hidden);
+
+  if (!emb) {
+    fprintf(stderr, "Error: no embedded BPF object for %u hidden units\n",
+            hidden);
+    return NULL;
+  }
+  printf("Using the BPF object for %u hidden units\n", hidden);
+
+  // Create in-memory BPF object from embedded bytecode
+  if (!emb->start || !emb->end) {
+    fprintf(stderr, "Error: BPF bytecode start or end is NULL\n");
+    return NULL;
+  }
+
+  size_t obj_size = (size_t)(emb->end - emb->start);
+  if (obj_size == 0) {
+    fprintf(stderr, "Error: Computed BPF object size is 0\n");
+    return NULL;
+  }
+  struct bpf_object_open_opts open_opts = {
+      .sz = sizeof(struct bpf_object_open_opts),
+      .object_name = "mnist_inference_8bit_small",
+  };
+  printf("BPF bytecode start: %p\n", (const void *)emb->start);
+  printf("BPF bytecode end: %p\n", (const void *)emb->end);
+  printf("Computed object size: %zu bytes\n", obj_size);
+
+  struct bpf_object *obj =
+      bpf_object__open_mem((const void *)emb->start, obj_size, &open_opts);
+  if (!obj)
+    fprintf(stderr, "Failed to open BPF object: %s\n", strerror(errno));
+  return obj;
+}
+
+// Links of bpf_mnist_infer and bpf_mnist_infer_xdp, pinned next to the maps
+// and programs
+#define PIN_LINK_NAME "bpf_mnist_infer_link"
+#define PIN_XDP_LINK_NAME "bpf_mnist_infer_xdp_link"
+
+// Pin name of the link the mode attaches, or NULL if it attaches nothing
+static const char *mode_link_name(enum infer_mode mode) {
+  if (mode == MODE_TRACEPOINT)
+    return PIN_LINK_NAME;
+  if (mode == MODE_XDP)
+    return PIN_XDP_LINK_NAME;
+  return NULL;
+}
+
+static int pin_path(char *path, const char *dir, const char *name) {
+  int len = snprintf(path, PATH_MAX, "%s/%s", dir, name);
+
+  if (len < 0 || len >= PATH_MAX) {
+    fprintf(stderr, "Pin path %s/%s is too long\n", dir, name);
+    return -ENAMETOOLONG;
+  }
+  return 0;
+}
+
+static int is_pinned(const char *dir, const char *name) {
+  char path[PATH_MAX];
+
+  return !pin_path(path, dir, name) && !access(path, F_OK);
+}
+
+// Every program the mode needs (and the link it attaches, if any) is
+// pinned, so nothing has to be loaded or verified
+static int mode_is_pinned(const char *dir, enum infer_mode mode) {
+  const char *link_name = mode_link_name(mode);
+
+  for (const char *const *name = mode_programs[mode]; *name; name++) {
+    if (!is_pinned(dir, *name))
+      return 0;
+  }
+  return !link_name || is_pinned(dir, link_name);
+}
+
+// Open the map, program or link pinned as dir/name
+static int open_pinned(const char *dir, const char *name) {
+  char path[PATH_MAX];
+  int fd;
+
+  if (pin_path(path, dir, name))
+    return -1;
+  fd = bpf_obj_get(path);
+  if (fd < 0)
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+  return fd;
+}
+
+// Map fd from the loaded object, or from its pin when obj is NULL
+static int find_map_fd(struct bpf_object *obj, const char *dir,
+                       const char *name) {
+  if (obj)
+    return bpf_object__find_map_fd_by_name(obj, name);
+  return open_pinned(dir, name);
+}
+
+// Check that pinned maps were created by the object for a hidden layer of
+// the given width, going by the value size of hidden_bias
+static int check_pinned_width(int hidden_bias_fd, __u32 hidden) {
+  struct bpf_map_info info = {0};
+  __u32 len = sizeof(info);
+
+  if (bpf_obj_get_info_by_fd(hidden_bias_fd, &info, &len)) {
+    fprintf(stderr, "Failed to query hidden_bias: %s\n", strerror(errno));
+    return -errno;
+  }
+  if (info.value_size != hidden * sizeof(int32_t)) {
+    fprintf(stderr,
+            "The pinned objects have %zu hidden units, the model %u; "
+            "remove them with --unpin first\n",
+            info.value_size / sizeof(int32_t), hidden);
+    return -EINVAL;
+  }
+  return 0;
+}
+
+#ifdef MNIST_ARENA
+// Length of the arena mapping; max_entries counts kernel pages
+static size_t arena_length(void) {
+  return MNIST_ARENA_PAGES * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// Fault in every page of the arena. The programs never allocate arena
+// pages, and their stores to a page nobody has touched are dropped (loads
+// read 0), so the activation rows and all slots must be backed before the
+// first run. A read populates the page and leaves the contents of a pinned
+// arena that is already serving requests alone.
+static void populate_arena(struct mnist_arena *arena) {
+  const volatile uint8_t *mem = (const volatile uint8_t *)arena;
+  size_t page_size = sysconf(_SC_PAGESIZE);
+
+  for (size_t off = 0; off < arena_length(); off += page_size)
+    (void)mem[off];
+}
+
+// The arena, at MNIST_ARENA_ADDR like in the programs, with every page
+// populated. libbpf maps it when it loads the object; a pinned arena is
+// mapped here.
+static struct mnist_arena *map_arena(struct bpf_object *obj, const char *dir) {
+  void *mem;
+
+  if (obj) {
+    struct bpf_map *map = bpf_object__find_map_by_name(obj, "mnist_arena");
+    size_t size;
+
+    mem = map ? bpf_map__initial_value(map, &size) : NULL;
+    if (!mem) {
+      fprintf(stderr, "The mnist_arena map is not mapped\n");
+      return NULL;
+    }
+  } else {
+    int fd = open_pinned(dir, "mnist_arena");
+    if (fd < 0)
+      return NULL;
+    mem = mmap((void *)MNIST_ARENA_ADDR, arena_length(),
+               PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd,
+               0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+      fprintf(stderr, "Failed to mmap mnist_arena: %s\n", strerror(errno));
+      return NULL;
+    }
+  }
+  populate_arena(mem);
+  return mem;
+}
+
+// Write the generic network straight into weight set maps->set of the
+// arena; activate_weight_set() then publishes it
+static int load_arena_model(struct mnist_arena *arena,
+                            const struct param_maps *maps,
+                            const struct model_file *model,
+                            const struct model_params *p) {
+  struct mnist_arena_model *m = &arena->models[maps->set];
+  struct mnist_model_desc desc;
+  int err;
+
+  err = build_net_model(model, 1, p, &desc, m->blob, MNIST_ARENA_BLOB_SIZE);
+  if (err)
+    return err;
+  m->desc = desc;
+  printf("Loaded a %u-layer network (%u bytes) into the arena\n",
+         desc.nr_layers, desc.blob_size);
+  return 0;
+}
+
+// Run bpf_mnist_infer_arena over count images stored in the first count
+// arena slots, and read their logits back out of the same slots
+static int run_arena_inference(int prog_fd, struct mnist_arena *arena,
+                               const uint8_t (*images)[INPUT_SIZE],
+                               __u32 count, int (*outputs)[OUTPUT_SIZE]) {
+  struct mnist_arena_ctx ctx = {.first = 0, .count = count};
+
+  if (count == 0 || count > MNIST_ARENA_SLOTS) {
+    fprintf(stderr, "Invalid batch of %u images (max %d)\n", count,
+            MNIST_ARENA_SLOTS);
+    return -1;
+  }
+  for (__u32 b = 0; b < count; b++)
+    memcpy(arena->slots[b].input, images[b], INPUT_SIZE);
+
+  int ret = kerinfer_run_program(prog_fd, &ctx, sizeof(ctx));
+  if (ret < 0) {
+    fprintf(stderr, "Failed to run inference program: %s\n",
+            strerror(-ret));
+    return -1;
+  }
+  if (ret != MNIST_RUN_OK) {
+    fprintf(stderr, "Inference program returned %d\n", ret);
+    return -1;
+  }
+
+  for (__u32 b = 0; b < count; b++)
+    memcpy(outputs[b], arena->slots[b].output, sizeof(outputs[b]));
+  return 0;
+}
+#endif
+
+// Make libbpf reuse maps already pinned under dir, or pin the ones it
+// creates there, when the object is loaded
+static int set_pin_paths(struct bpf_object *obj, const char *dir) {
+  char path[PATH_MAX];
+  struct bpf_map *map;
+
+  bpf_object__for_each_map(map, obj) {
+    if (bpf_map__is_internal(map))
+      continue;
+    int err = pin_path(path, dir, bpf_map__name(map));
+    if (!err)
+      err = bpf_map__set_pin_path(map, path);
+    if (err) {
+      fprintf(stderr, "Failed to set pin path of %s: %s\n",
+              bpf_map__name(map), strerror(-err));
+      return err;
+    }
+  }
+  return 0;
+}
+
+// Pin the loaded programs, and the link as link_name, under dir, replacing
+// older pins. The link is disconnected, so it outlives the loader.
+static int pin_programs(struct bpf_object *obj, struct bpf_link *link,
+                        const char *link_name, const char *dir) {
+  char path[PATH_MAX];
+  struct bpf_program *prog;
+  int err;
+
+  bpf_object__for_each_program(prog, obj) {
+    if (!bpf_program__autoload(prog))
+      continue;
+    err = pin_path(path, dir, bpf_program__name(prog));
+    if (err)
+      return err;
+    unlink(path);
+    err = bpf_program__pin(prog, path);
+    if (err) {
+      fprintf(stderr, "Failed to pin %s: %s\n", path, strerror(-err));
+      return err;
+    }
+  }
+
+  if (link) {
+    err = pin_path(path, dir, link_name);
+    if (err)
+      return err;
+    unlink(path);
+    err = bpf_link__pin(link, path);
+    if (err) {
+      fprintf(stderr, "Failed to pin %s: %s\n", path, strerror(-err));
+      return err;
+    }
+    bpf_link__disconnect(link);
+  }
+  printf("Pinned maps and programs in %s\n", dir);
+  return 0;
+}
+
+// Remove every pin pin_programs() and set_pin_paths() may have created.
+// The names come from an embedded object, which is opened but not loaded;
+// they are the same for every hidden layer width.
+static int unpin_objects(const char *dir) {
+  struct bpf_object *obj = open_embedded_object(HIDDEN_SIZE);
+  char path[PATH_MAX];
+  struct bpf_program *prog;
+  struct bpf_map *map;
+  int err = 0;
+
+  if (!obj)
+    return -EINVAL;
+
+  bpf_object__for_each_map(map, obj) {
+    if (!bpf_map__is_internal(map) &&
+        !pin_path(path, dir, bpf_map__name(map)) && unlink(path) &&
+        errno != ENOENT) {
+      fprintf(stderr, "Failed to unpin %s: %s\n", path, strerror(errno));
+      err = -errno;
+    }
+  }
+  bpf_object__for_each_program(prog, obj) {
+    if (!pin_path(path, dir, bpf_program__name(prog)) && unlink(path) &&
+        errno != ENOENT) {
+      fprintf(stderr, "Failed to unpin %s: %s\n", path, strerror(errno));
+      err = -errno;
+    }
+  }
+  static const char *const link_names[] = {PIN_LINK_NAME, PIN_XDP_LINK_NAME};
+  for (size_t i = 0; i < sizeof(link_names) / sizeof(link_names[0]); i++) {
+    if (!pin_path(path, dir, link_names[i]) && unlink(path) &&
+        errno != ENOENT) {
+      fprintf(stderr, "Failed to unpin %s: %s\n", path, strerror(errno));
+      err = -errno;
+    }
+  }
+  // Only succeeds if nothing else lives there, e.g. not for /sys/fs/bpf
+  rmdir(dir);
+  bpf_object__close(obj);
+
+  if (!err)
+    printf("Removed the pins in %s\n", dir);
+  return err;
+}
+
+static volatile sig_atomic_t stop_serving;
+
+static void handle_stop_signal(int sig) { stop_serving = 1; }
+
+static void wait_for_stop_signal(void) {
+  struct sigaction sa = {.sa_handler = handle_stop_signal};
+
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  while (!stop_serving)
+    pause();
+}
+
+// Daemon mode: keep serving through the pinned objects until SIGINT or
+// SIGTERM, then remove the pins so the program detaches
+static int serve_until_signalled(const char *dir) {
+  printf("Serving from %s, send SIGINT or SIGTERM to stop\n", dir);
+  wait_for_stop_signal();
+  return unpin_objects(dir);
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -t, --tracepoint  attach to %s:%s and run on every syscall\n"
+          "                    (default: run on demand via BPF_PROG_RUN)\n"
+          "  -z, --sparse      run on demand with the sparse-input program,\n"
+          "                    passing only the non-zero pixels\n"
+          "  -w, --swar        run on demand with the SWAR first-layer kernel\n"
+          "                    (needs make LAYOUT=blocked BLOCK=8)\n"
+          "  -n, --net         run on demand with the generic N-layer program,\n"
+          "                    using the model's network section if present\n"
+          "  -a, --arena       like --net, with the network, images and\n"
+          "                    logits in a BPF arena (needs make ARENA=1)\n"
+          "  -r, --pruned      run on demand with the block-sparse first\n"
+          "                    layer of a pruned model (needs make PRUNED=K)\n"
+          "  -X, --xdp IFACE   attach bpf_mnist_infer_xdp to IFACE and answer\n"
+          "                    UDP inference requests until SIGINT or SIGTERM\n"
+          "  -o, --udp-port PORT  UDP port served in XDP mode (default %d)\n"
+          "  -V, --verify      check the results against the user-space\n"
+          "                    reference engine, and --sparse/--swar/--net/\n"
+          "                    --arena/--pruned results against the reference\n"
+          "                    kernel too\n"
+          "  -u, --userspace   run the network with the user-space reference\n"
+          "                    engine only, without loading any BPF\n"
+          "  -K, --ref-kernel NAME  reference engine kernel: auto, scalar,\n"
+          "                    avx2 or vnni (default auto: the fastest one\n"
+          "                    the CPU supports)\n"
+          "  -s, --slots N     number of concurrent request slots for the\n"
+          "                    map interface (1-%d, default %d)\n"
+          "  -p, --percpu      use a per-CPU mnist_output map\n"
+          "  -M, --mmap        in tracepoint mode, write requests and read\n"
+          "                    results through mmap()ed maps, not syscalls\n"
+          "  -R, --ringbuf     in tracepoint mode, wait on the mnist_results\n"
+          "                    ring buffer instead of polling the slot state\n"
+          "  -b, --batch N     images per BPF_PROG_RUN invocation (1-%d,\n"
+          "                    default 1; the maximum is set at build time)\n"
+          "  -C, --cache N     in tracepoint mode, serve repeated images from\n"
+          "                    an N-entry LRU result cache (up to %d)\n"
+          "  -T, --target-pid PID  in tracepoint mode, only run for syscalls\n"
+          "                    made by process PID ('self': the loader)\n"
+          "  -m, --model FILE  model file written by train.py (default %s)\n"
+          "  -D, --dummy-model use placeholder parameters instead of a model\n"
+          "  -S, --stats       print the in-kernel counters after the run\n"
+          "  -x, --bench RUNS  time RUNS calls of every on-demand variant\n"
+          "                    (dense, generic net, SWAR and pruned if built,\n"
+          "                    sparse) at each batch size up to the build's\n"
+          "                    maximum\n"
+          "  -y, --syscall-bench MS  measure the syscall overhead of the\n"
+          "                    tracepoint program, detached, gated and\n"
+          "                    computing, for MS ms each on every CPU\n"
+          "  -E, --dataset PREFIX  stream the test set written by train.py\n"
+          "                    --dump-test PREFIX through the kernel (in the\n"
+          "                    default, --swar, --net, --pruned or\n"
+          "                    --tracepoint mode), failing on any logits\n"
+          "                    that differ from the reference engine's and\n"
+          "                    reporting top-1 agreement with PyTorch int8\n"
+          "  -j, --workers N   pinned worker threads for --dataset in the\n"
+          "                    on-demand modes (default: one per CPU)\n"
+          "  -L, --pin         pin maps, programs and the tracepoint or XDP\n"
+          "                    link in the pin directory and leave them\n"
+          "                    running; if they are pinned already, reuse\n"
+          "                    them and only swap in the model\n"
+          "  -d, --daemon      like --pin, but stay resident until SIGINT or\n"
+          "                    SIGTERM, then remove the pins\n"
+          "  -B, --pin-dir DIR bpffs directory for the pins (default %s)\n"
+          "  -U, --unpin       remove the pins and exit\n"
+          "  -h, --help        show this help\n",
+          prog, TP_NAME, TP_EVENT, MNIST_UDP_DEFAULT_PORT, MNIST_MAX_SLOTS,
+          MNIST_DEFAULT_SLOTS, MNIST_BATCH_SIZE, MNIST_MAX_CACHE_ENTRIES,
+          DEFAULT_MODEL_FILE, KERINFER_DEFAULT_PIN_DIR);
+}
+
+int main(int argc, char **argv) {
+  static const struct option long_options[] = {
+      {"tracepoint", no_argument, NULL, 't'},
+      {"sparse", no_argument, NULL, 'z'},
+      {"swar", no_argument, NULL, 'w'},
+      {"net", no_argument, NULL, 'n'},
+      {"arena", no_argument, NULL, 'a'},
+      {"pruned", no_argument, NULL, 'r'},
+      {"xdp", required_argument, NULL, 'X'},
+      {"udp-port", required_argument, NULL, 'o'},
+      {"verify", no_argument, NULL, 'V'},
+      {"userspace", no_argument, NULL, 'u'},
+      {"ref-kernel", required_argument, NULL, 'K'},
+      {"slots", required_argument, NULL, 's'},
+      {"percpu", no_argument, NULL, 'p'},
+      {"mmap", no_argument, NULL, 'M'},
+      {"ringbuf", no_argument, NULL, 'R'},
+      {"batch", required_argument, NULL, 'b'},
+      {"cache", required_argument, NULL, 'C'},
+      {"target-pid", required_argument, NULL, 'T'},
+      {"model", required_argument, NULL, 'm'},
+      {"dummy-model", no_argument, NULL, 'D'},
+      {"stats", no_argument, NULL, 'S'},
+      {"bench", required_argument, NULL, 'x'},
+      {"syscall-bench", required_argument, NULL, 'y'},
+      {"dataset", required_argument, NULL, 'E'},
+      {"workers", required_argument, NULL, 'j'},
+      {"pin", no_argument, NULL, 'L'},
+      {"daemon", no_argument, NULL, 'd'},
+      {"pin-dir", required_argument, NULL, 'B'},
+      {"unpin", no_argument, NULL, 'U'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+  enum infer_mode mode = MODE_RUN;
+  long nr_slots = MNIST_DEFAULT_SLOTS;
+  long batch = 1;
+  int percpu_output = 0;
+  int use_mmap = 0;
+  int use_ringbuf = 0;
+  int show_stats = 0;
+  long target_pid = 0;
+  long cache_entries = 0;
+  const char *xdp_ifname = NULL;
+  long udp_port = 0;
+  int verify = 0;
+  enum refinfer_kernel ref_kernel = REFINFER_KERNEL_AUTO;
+  const char *model_path = DEFAULT_MODEL_FILE;
+  int dummy_model = 0;
+  long bench_runs = 0;
+  long syscall_bench_ms = 0;
+  const char *dataset = NULL;
+  long nr_workers = 0;
+  int pin = 0;
+  int daemon_mode = 0;
+  int unpin = 0;
+  const char *pin_dir = KERINFER_DEFAULT_PIN_DIR;
+  char *end;
+  int opt;
+
+  while ((opt = getopt_long(argc, argv,
+                            "tzwnarX:o:VuK:s:pMRb:C:T:m:DSx:y:E:j:LdB:Uh",
+                            long_options, NULL)) != -1) {
+    switch (opt) {
+    case 't':
+      mode = MODE_TRACEPOINT;
+      break;
+    case 'z':
+      mode = MODE_SPARSE;
+      break;
+    case 'w':
+      if (!MNIST_HAVE_SWAR) {
+        fprintf(stderr, "The SWAR kernel needs a build with "
+                        "LAYOUT=blocked, BLOCK a multiple of 8 and "
+                        "8-bit weights\n");
+        return 1;
+      }
+      mode = MODE_SWAR;
+      break;
+    case 'n':
+      mode = MODE_NET;
+      break;
+    case 'a':
+#ifndef MNIST_ARENA
+      fprintf(stderr, "The arena program needs a build with ARENA=1\n");
+      return 1;
+#endif
+      mode = MODE_ARENA;
+      break;
+    case 'r':
+#ifndef MNIST_PRUNED_BLOCKS
+      fprintf(stderr, "The pruned program needs a build with PRUNED=K\n");
+      return 1;
+#endif
+      mode = MODE_PRUNED;
+      break;
+    case 'X':
+      xdp_ifname = optarg;
+      mode = MODE_XDP;
+      break;
+    case 'o':
+      udp_port = strtol(optarg, &end, 10);
+      if (*end || udp_port < 1 || udp_port > UINT16_MAX) {
+        fprintf(stderr, "Invalid UDP port '%s'\n", optarg);
+        return 1;
+      }
+      break;
+    case 'V':
+      verify = 1;
+      break;
+    case 'u':
+      mode = MODE_USERSPACE;
+      break;
+    case 'K':
+      if (refinfer_parse_kernel(optarg, &ref_kernel)) {
+        fprintf(stderr, "Unknown reference kernel '%s'\n", optarg);
+        return 1;
+      }
+      if (!refinfer_kernel_supported(ref_kernel)) {
+        fprintf(stderr, "This CPU or build lacks the %s kernel\n", optarg);
+        return 1;
+      }
+      break;
+    case 's':
+      nr_slots = strtol(optarg, &end, 10);
+      if (*end || nr_slots < 1 || nr_slots > MNIST_MAX_SLOTS) {
+        fprintf(stderr, "Invalid slot count '%s' (expected 1-%d)\n", optarg,
+                MNIST_MAX_SLOTS);
+        return 1;
+      }
+      break;
+    case 'p':
+      percpu_output = 1;
+      break;
+    case 'M':
+      use_mmap = 1;
+      break;
+    case 'R':
+      use_ringbuf = 1;
+      break;
+    case 'b':
+      batch = strtol(optarg, &end, 10);
+      if (*end || batch < 1 || batch > MNIST_BATCH_SIZE) {
+        fprintf(stderr, "Invalid batch size '%s' (expected 1-%d)\n", optarg,
+                MNIST_BATCH_SIZE);
+        return 1;
+      }
+      break;
+    case 'C':
+      cache_entries = strtol(optarg, &end, 10);
+      if (*end || cache_entries < 1 ||
+          cache_entries > MNIST_MAX_CACHE_ENTRIES) {
+        fprintf(stderr, "Invalid cache size '%s' (expected 1-%d)\n", optarg,
+                MNIST_MAX_CACHE_ENTRIES);
+        return 1;
+      }
+      break;
+    case 'T':
+      if (!strcmp(optarg, "self")) {
+        target_pid = getpid();
+        break;
+      }
+      target_pid = strtol(optarg, &end, 10);
+      if (*end || target_pid < 0 || target_pid > UINT32_MAX) {
+        fprintf(stderr, "Invalid target pid '%s'\n", optarg);
+        return 1;
+      }
+      break;
+    case 'm':
+      model_path = optarg;
+      break;
+    case 'D':
+      dummy_model = 1;
+      break;
+    case 'S':
+      show_stats = 1;
+      break;
+    case 'x':
+      bench_runs = strtol(optarg, &end, 10);
+      if (*end || bench_runs < 1) {
+        fprintf(stderr, "Invalid run count '%s'\n", optarg);
+        return 1;
+      }
+      mode = MODE_BENCH;
+      break;
+    case 'y':
+      syscall_bench_ms = strtol(optarg, &end, 10);
+      if (*end || syscall_bench_ms < 1) {
+        fprintf(stderr, "Invalid duration '%s'\n", optarg);
+        return 1;
+      }
+      mode = MODE_SYSCALL_BENCH;
+      break;
+    case 'E':
+      dataset = optarg;
+      break;
+    case 'j':
+      nr_workers = strtol(optarg, &end, 10);
+      if (*end || nr_workers < 1 || nr_workers > CPU_SETSIZE) {
+        fprintf(stderr, "Invalid worker count '%s'\n", optarg);
+        return 1;
+      }
+      break;
+    case 'L':
+      pin = 1;
+      break;
+    case 'd':
+      pin = daemon_mode = 1;
+      break;
+    case 'B':
+      pin_dir = optarg;
+      break;
+    case 'U':
+      unpin = 1;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  int err;
+  struct bpf_object *obj = NULL;
+  struct bpf_program *prog = NULL;
+  struct bpf_link *link = NULL;
+  struct kerinfer *ki = NULL;
+  struct refinfer *ref = NULL;
+  struct param_maps params = {-1, -1, -1, -1, -1, -1,
+                              -1, -1, -1, -1, -1, 0, 0};
+  struct model_file model = {0};
+  struct model_params model_params = {0};
+#ifdef MNIST_ARENA
+  struct mnist_arena *arena = NULL;
+#endif
+  int map_fd_stats = -1;
+  // fds of mode_programs[mode], owned by us only when reusing pins
+  int prog_fds[MAX_MODE_PROGRAMS] = {-1, -1, -1, -1, -1};
+  int reuse = 0;
+  int seed_slots = 1;
+  unsigned int ki_flags = (use_mmap ? KERINFER_F_MMAP : 0) |
+                          (use_ringbuf ? KERINFER_F_RINGBUF : 0);
+
+  if (unpin)
+    return unpin_objects(pin_dir) ? 1 : 0;
+
+  if (cache_entries && mode != MODE_TRACEPOINT) {
+    fprintf(stderr, "--cache needs --tracepoint\n");
+    return 1;
+  }
+
+  if (dataset && mode != MODE_RUN && mode != MODE_SWAR && mode != MODE_NET &&
+      mode != MODE_PRUNED && mode != MODE_TRACEPOINT) {
+    fprintf(stderr, "--dataset runs in the default, --swar, --net, --pruned "
+                    "or --tracepoint mode only\n");
+    return 1;
+  }
+
+  if (udp_port && mode != MODE_XDP) {
+    fprintf(stderr, "--udp-port needs --xdp\n");
+    return 1;
+  }
+  if (!udp_port)
+    udp_port = MNIST_UDP_DEFAULT_PORT;
+
+  // The benchmark attaches and detaches its own link
+  if (pin && (mode == MODE_SYSCALL_BENCH || mode == MODE_USERSPACE)) {
+    fprintf(stderr, "--%s cannot be combined with --pin\n",
+            mode == MODE_USERSPACE ? "userspace" : "syscall-bench");
+    return 1;
+  }
+
+  int load_net = mode == MODE_NET || mode == MODE_BENCH;
+
+  // Validate the model before paying for verification
+  if (!dummy_model) {
+    if (open_model_file(model_path, &model))
+      return 1;
+    printf("Loaded model %s (%zu bytes)\n", model_path, model.size);
+    err = read_model_params(&model, load_net || mode == MODE_USERSPACE,
+                            &model_params);
+  } else {
+    err = dummy_model_params(&model_params);
+  }
+  if (err)
+    goto cleanup;
+
+  uint8_t input_images[MNIST_BATCH_SIZE][INPUT_SIZE];
+  int outputs[MNIST_BATCH_SIZE][OUTPUT_SIZE] = {{0}};
+  int *output = outputs[0];
+
+  load_test_image(input_images[0]);
+
+  if (verify || dataset || mode == MODE_BENCH || mode == MODE_USERSPACE) {
+    ref = open_reference(dummy_model ? NULL : &model, &model_params,
+                         mode == MODE_NET || mode == MODE_ARENA, ref_kernel);
+    if (!ref) {
+      err = -EINVAL;
+      goto cleanup;
+    }
+  }
+
+  if (mode == MODE_USERSPACE) {
+    run_userspace_inference(ref, input_images[0], batch, outputs);
+    print_output(output);
+    goto cleanup;
+  }
+
+  err = set_memlock_limit();
+  if (err)
+    goto cleanup;
+
+  if (pin) {
+    reuse = mode_is_pinned(pin_dir, mode);
+    // Reused slot maps already hold their free slot indices
+    seed_slots = !is_pinned(pin_dir, "mnist_free_slots");
+  }
+
+  if (reuse) {
+    printf("Reusing the maps and programs pinned in %s\n", pin_dir);
+    for (int i = 0; mode_programs[mode][i]; i++) {
+      prog_fds[i] = open_pinned(pin_dir, mode_programs[mode][i]);
+      if (prog_fds[i] < 0) {
+        err = -ENOENT;
+        goto cleanup;
+      }
+    }
+  } else {
+    obj = open_embedded_object(model_params.hidden);
+    if (!obj) {
+      err = -EINVAL;
+      goto cleanup;
+    }
+
+    prog = select_programs(obj, mode_programs[mode]);
+    if (!prog) {
+      err = -ENOENT;
+      goto cleanup;
+    }
+    printf("Found program %s\n", bpf_program__name(prog));
+
+    if (mode == MODE_TRACEPOINT || mode == MODE_SYSCALL_BENCH) {
+      bpf_program__set_type(prog, BPF_PROG_TYPE_TRACEPOINT);
+      if (bpf_program__get_type(prog) != BPF_PROG_TYPE_TRACEPOINT) {
+        fprintf(stderr, "Program type mismatch: expected TRACEPOINT\n");
+        err = -EINVAL;
+        goto cleanup;
+      }
+    }
+
+    err = configure_slots(obj, nr_slots);
+    if (!err && percpu_output)
+      err = configure_percpu_output(obj);
+    if (!err && cache_entries)
+      err = configure_cache(obj, cache_entries);
+    if (!err && pin)
+      err = set_pin_paths(obj, pin_dir);
+    if (err)
+      goto cleanup;
+
+    err = bpf_object__load(obj);
+    if (err) {
+      fprintf(stderr, "Failed to load BPF object: %s\n", strerror(errno));
+      goto cleanup;
+    }
+
+    for (int i = 0; mode_programs[mode][i]; i++)
+      prog_fds[i] = bpf_program__fd(
+          bpf_object__find_program_by_name(obj, mode_programs[mode][i]));
+
+    if (mode == MODE_TRACEPOINT)
+      err = attach_tracepoint(prog, &link);
+    else if (mode == MODE_XDP)
+      err = attach_xdp(prog, xdp_ifname, &link);
+    if (err)
+      goto cleanup;
+    if (pin) {
+      err = pin_programs(obj, link, mode_link_name(mode), pin_dir);
+      if (err)
+        goto cleanup;
+    }
+  }
+
+  // Retrieve map FDs (map names must match those in the BPF program)
+  params.hidden_weights = find_map_fd(obj, pin_dir, "hidden_weights");
+  params.hidden_bias = find_map_fd(obj, pin_dir, "hidden_bias");
+  params.output_weights = find_map_fd(obj, pin_dir, "output_weights");
+  params.output_bias = find_map_fd(obj, pin_dir, "output_bias");
+  params.hidden_requant = find_map_fd(obj, pin_dir, "hidden_requant");
+  params.output_requant = find_map_fd(obj, pin_dir, "output_requant");
+  params.model = find_map_fd(obj, pin_dir, "mnist_model");
+  params.net = find_map_fd(obj, pin_dir, "mnist_net_weights");
+  params.control = find_map_fd(obj, pin_dir, "mnist_control");
+  params.readers = find_map_fd(obj, pin_dir, "mnist_set_readers");
+  map_fd_stats = find_map_fd(obj, pin_dir, "mnist_stats");
+
+  if (params.hidden_weights < 0 || params.hidden_bias < 0 ||
+      params.output_weights < 0 || params.output_bias < 0 ||
+      params.hidden_requant < 0 || params.output_requant < 0 ||
+      params.model < 0 || params.net < 0 || params.control < 0 ||
+      params.readers < 0 || map_fd_stats < 0) {
+    fprintf(stderr, "Failed to get map FDs: %s\n", strerror(errno));
+    err = -ENOENT;
+    goto cleanup;
+  }
+#ifdef MNIST_PRUNED_BLOCKS
+  params.hidden_blocks = find_map_fd(obj, pin_dir, "hidden_blocks");
+  if (params.hidden_blocks < 0) {
+    fprintf(stderr, "Failed to get the hidden_blocks map FD: %s\n",
+            strerror(errno));
+    err = -ENOENT;
+    goto cleanup;
+  }
+#endif
+  if (reuse && model_params.hidden_weights) {
+    err = check_pinned_width(params.hidden_bias, model_params.hidden);
+    if (err)
+      goto cleanup;
+  }
+#ifdef MNIST_ARENA
+  if (mode == MODE_ARENA) {
+    arena = map_arena(obj, pin_dir);
+    if (!arena) {
+      err = -ENOMEM;
+      goto cleanup;
+    }
+  }
+#endif
+
+  // Write the model into the inactive weight set and switch over to it, the
+  // same way a new model replaces one that is serving requests
+  err = select_inactive_weight_set(&params);
+  if (!err)
+    err = load_model_parameters(dummy_model ? NULL : &model, &model_params,
+                                &params, load_net);
+#ifdef MNIST_ARENA
+  if (!err && arena)
+    err = load_arena_model(arena, &params, dummy_model ? NULL : &model,
+                           &model_params);
+#endif
+  if (!err)
+    err = activate_weight_set(&params);
+  close_model_file(&model);
+  if (err) {
+    fprintf(stderr, "Error loading parameters into maps.\n");
+    goto cleanup;
+  }
+
+  ki = reuse ? kerinfer_open_pinned(pin_dir, ki_flags)
+             : kerinfer_open_object(obj, ki_flags);
+  if (!ki) {
+    err = -errno;
+    goto cleanup;
+  }
+  if (seed_slots)
+    err = kerinfer_seed_slots(ki);
+  if (!err && target_pid)
+    err = kerinfer_set_target(ki, target_pid);
+  // Written either way, so a reused object drops a cache it was pinned with
+  if (!err)
+    err = set_control_word(params.control, MNIST_CTL_CACHE, !!cache_entries);
+  if (err)
+    goto cleanup;
+
+  // The program answers requests by itself; all that is left is to tell it
+  // the port, then stay attached (or leave the pinned link behind)
+  if (mode == MODE_XDP) {
+    err = set_control_word(params.control, MNIST_CTL_UDP_PORT, udp_port);
+    if (err)
+      goto cleanup;
+    if (reuse)
+      printf("The pinned XDP link stays attached to its own interface\n");
+    printf("Answering inference requests on UDP port %ld\n", udp_port);
+    if (daemon_mode) {
+      err = serve_until_signalled(pin_dir);
+    } else if (!pin) {
+      printf("Send SIGINT or SIGTERM to stop\n");
+      wait_for_stop_signal();
+    }
+    if (!err && show_stats)
+      err = print_stats(map_fd_stats);
+    goto cleanup;
+  }
+
+  if (mode == MODE_SYSCALL_BENCH) {
+    err = run_syscall_bench(prog, params.control, map_fd_stats,
+                            syscall_bench_ms);
+    if (!err && show_stats)
+      err = print_stats(map_fd_stats);
+    goto cleanup;
+  }
+
+  if (mode == MODE_BENCH) {
+    err = run_benchmarks(prog_fds, map_fd_stats, ref, input_images[0],
+                         bench_runs);
+    if (!err && show_stats)
+      err = print_stats(map_fd_stats);
+    goto cleanup;
+  }
+
+  if (dataset) {
+    err = run_dataset(dataset, prog_fds[0],
+                      mode == MODE_TRACEPOINT ? ki : NULL, batch, nr_workers,
+                      map_fd_stats, ref);
+    if (!err && show_stats)
+      err = print_stats(map_fd_stats);
+    goto cleanup;
+  }
+
+  if (mode == MODE_TRACEPOINT) {
+    err = run_tracepoint_inference(ki, input_images[0], output);
+  } else if (mode == MODE_SPARSE) {
+    printf("Running sparse inference via BPF_PROG_RUN...\n");
+    err = run_sparse_inference(prog_fds[0], prog_fds[1], input_images[0],
+                               output);
+    if (!err && verify)
+      err = verify_outputs(prog_fds[1],
+                           (const uint8_t (*)[INPUT_SIZE])input_images, 1,
+                           outputs);
+  } else {
+    // Replicate the test image across the batch
+    for (long b = 1; b < batch; b++)
+      memcpy(input_images[b], input_images[0], INPUT_SIZE);
+
+    printf("Running inference on a batch of %ld via BPF_PROG_RUN...\n",
+           batch);
+#ifdef MNIST_ARENA
+    if (mode == MODE_ARENA)
+      err = run_arena_inference(prog_fds[0], arena,
+                                (const uint8_t (*)[INPUT_SIZE])input_images,
+                                batch, outputs);
+    else
+#endif
+      err = run_inference(prog_fds[0],
+                          (const uint8_t (*)[INPUT_SIZE])input_images, batch,
+                          outputs);
+    if (!err) {
+      for (long b = 1; b < batch; b++) {
+        if (memcmp(outputs[b], output, sizeof(outputs[b]))) {
+          fprintf(stderr, "Batch entry %ld disagrees with entry 0\n", b);
+          err = -1;
+        }
+      }
+    }
+    // bpf_mnist_infer_run comes second for these modes
+    if (!err && verify &&
+        (mode == MODE_SWAR || mode == MODE_NET || mode == MODE_ARENA ||
+         mode == MODE_PRUNED))
+      err = verify_outputs(prog_fds[1],
+                           (const uint8_t (*)[INPUT_SIZE])input_images, batch,
+                           outputs);
+  }
+  if (!err && verify)
+    err = verify_reference(ref, (const uint8_t (*)[INPUT_SIZE])input_images,
+                           mode == MODE_TRACEPOINT || mode == MODE_SPARSE
+                               ? 1
+                               : batch,
+                           outputs);
+  if (err)
+    goto cleanup;
+
+  print_output(output);
+
+  if (show_stats)
+    err = print_stats(map_fd_stats);
+
+  if (!err && daemon_mode)
+    err = serve_until_signalled(pin_dir);
+
+cleanup:
+  kerinfer_close(ki);
+  refinfer_close(ref);
+  if (link)
+    bpf_link__destroy(link);
+  if (obj) {
+    bpf_object__close(obj);
+  } else {
+    // Everything was opened from its pin
+    int *fds[] = {&params.hidden_weights, &params.hidden_bias,
+                  &params.output_weights, &params.output_bias,
+                  &params.hidden_requant, &params.output_requant,
+                  &params.model,          &params.net,
+                  &params.control,        &params.readers,
+                  &map_fd_stats,          &params.hidden_blocks};
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+      if (*fds[i] >= 0)
+        close(*fds[i]);
+    }
+    for (int i = 0; i < MAX_MODE_PROGRAMS; i++) {
+      if (prog_fds[i] >= 0)
+        close(prog_fds[i]);
+    }
+#ifdef MNIST_ARENA
+    if (arena)
+      munmap(arena, arena_length());
+#endif
+  }
+  free_model_params(&model_params);
+  close_model_file(&model);
 
   return err ? 1 : 0;
 }
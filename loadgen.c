@@ -0,0 +1,565 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// loadgen.c
+// Load generator for the pinned inference interfaces: N threads, each
+// pinned to a CPU, classify images from a file of raw INPUT_SIZE byte
+// records either back to back (closed loop) or at a fixed request rate
+// (open loop), and report throughput and a latency histogram.
+
+// CPU affinity and pthread_setaffinity_np()
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <pthread.h>
+
+#include "kerinferencel.h"
+#include "libkerinfer.h"
+
+#define DEFAULT_DURATION_S 10
+#define DEFAULT_TIMEOUT_MS 1000
+
+// Largest batch of either kind of interface
+#define LG_MAX_BATCH                                                           \
+  (MNIST_MAX_SLOTS > MNIST_BATCH_SIZE ? MNIST_MAX_SLOTS : MNIST_BATCH_SIZE)
+
+// Inference interface driven by every thread
+enum lg_interface {
+  LG_TRACEPOINT, // request slots through map syscalls (loader --tracepoint)
+  LG_MMAP,       // request slots through mmap()ed maps
+  LG_RUN,        // bpf_mnist_infer_run through BPF_PROG_RUN (loader default)
+  LG_DISPATCH,   // the same, split across kerinfer_dispatch() workers
+  LG_NR_INTERFACES,
+};
+
+static const char *const interface_names[LG_NR_INTERFACES] = {
+    [LG_TRACEPOINT] = "tracepoint",
+    [LG_MMAP] = "mmap",
+    [LG_RUN] = "run",
+    [LG_DISPATCH] = "dispatch",
+};
+
+// Latency histogram with HDR-style log-linear buckets: values below
+// 2^HIST_SUB_BITS ns are counted exactly, larger ones in 2^HIST_SUB_BITS
+// buckets per power of two, so every bucket is within 1% of its values
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1U << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct latency_hist {
+  __u64 counts[HIST_BUCKETS];
+  __u64 total;
+  __u64 sum_ns;
+  __u64 max_ns;
+};
+
+static unsigned int hist_bucket(__u64 ns) {
+  if (ns < HIST_SUB_COUNT)
+    return ns;
+  unsigned int exp = 63 - __builtin_clzll(ns);
+  unsigned int shift = exp - HIST_SUB_BITS;
+
+  return ((shift + 1) << HIST_SUB_BITS) + (ns >> shift) - HIST_SUB_COUNT;
+}
+
+// Largest value counted in bucket b
+static __u64 hist_bucket_max(unsigned int b) {
+  if (b < HIST_SUB_COUNT)
+    return b;
+  unsigned int shift = (b >> HIST_SUB_BITS) - 1;
+  __u64 sub = HIST_SUB_COUNT + (b & (HIST_SUB_COUNT - 1));
+
+  return ((sub + 1) << shift) - 1;
+}
+
+static void hist_record(struct latency_hist *h, __u64 ns) {
+  h->counts[hist_bucket(ns)]++;
+  h->total++;
+  h->sum_ns += ns;
+  if (ns > h->max_ns)
+    h->max_ns = ns;
+}
+
+static void hist_merge(struct latency_hist *dst,
+                       const struct latency_hist *src) {
+  for (unsigned int b = 0; b < HIST_BUCKETS; b++)
+    dst->counts[b] += src->counts[b];
+  dst->total += src->total;
+  dst->sum_ns += src->sum_ns;
+  if (src->max_ns > dst->max_ns)
+    dst->max_ns = src->max_ns;
+}
+
+// Smallest bucket bound at or below which a fraction q of the values lie
+static __u64 hist_quantile(const struct latency_hist *h, double q) {
+  __u64 rank = (__u64)(q * h->total + 0.5);
+  __u64 seen = 0;
+
+  if (rank == 0)
+    rank = 1;
+  for (unsigned int b = 0; b < HIST_BUCKETS; b++) {
+    seen += h->counts[b];
+    if (seen >= rank)
+      return hist_bucket_max(b) < h->max_ns ? hist_bucket_max(b) : h->max_ns;
+  }
+  return h->max_ns;
+}
+
+struct lg_config {
+  enum lg_interface interface;
+  const char *pin_dir;
+  const uint8_t *images;
+  size_t nr_images;
+  unsigned int batch;
+  double qps; // per thread, 0 for closed loop
+  int timeout_ms;
+  struct kerinfer_dispatcher *dispatcher; // shared by all threads
+};
+
+struct lg_worker {
+  pthread_t thread;
+  const struct lg_config *cfg;
+  int cpu;
+  size_t next_image;
+  __u64 requests;
+  __u64 images;
+  int err;
+  struct latency_hist hist;
+};
+
+static int lg_stop;
+
+static __u64 now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until_ns(__u64 ns) {
+  struct timespec ts = {.tv_sec = ns / 1000000000ULL,
+                        .tv_nsec = ns % 1000000000ULL};
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+// Copy the next batch of images, wrapping around the end of the file
+static void next_batch(struct lg_worker *w, uint8_t *dst) {
+  const struct lg_config *cfg = w->cfg;
+
+  for (unsigned int b = 0; b < cfg->batch; b++) {
+    memcpy(dst + (size_t)b * INPUT_SIZE,
+           cfg->images + w->next_image * INPUT_SIZE, INPUT_SIZE);
+    w->next_image = (w->next_image + 1) % cfg->nr_images;
+  }
+}
+
+static int open_run_program(const char *pin_dir) {
+  char path[PATH_MAX];
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/bpf_mnist_infer_run", pin_dir);
+  fd = bpf_obj_get(path);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return -errno;
+  }
+  return fd;
+}
+
+// One client of the interface, opened and used by a single thread
+struct lg_client {
+  struct kerinfer *ki;
+  int prog_fd;
+  struct mnist_run_ctx ctx;
+};
+
+static int client_open(struct lg_client *c, const struct lg_config *cfg) {
+  c->prog_fd = -1;
+  if (cfg->interface == LG_DISPATCH)
+    return 0;
+  if (cfg->interface != LG_RUN) {
+    // Slot states, not the shared ring buffer, which every thread's own
+    // consumer would drain of the others' completion records
+    unsigned int flags = cfg->interface == LG_MMAP ? KERINFER_F_MMAP : 0;
+
+    c->ki = kerinfer_open_pinned(cfg->pin_dir, flags);
+    return c->ki ? 0 : -errno;
+  }
+
+  c->prog_fd = open_run_program(cfg->pin_dir);
+  return c->prog_fd < 0 ? c->prog_fd : 0;
+}
+
+static void client_close(struct lg_client *c) {
+  kerinfer_close(c->ki);
+  if (c->prog_fd >= 0)
+    close(c->prog_fd);
+}
+
+// Classify one batch. Slot interfaces keep the batch in flight at once;
+// on the on-demand program it is one BPF_PROG_RUN call, or one per chunk of
+// MNIST_BATCH_SIZE images spread over the dispatcher's workers.
+static int client_infer(struct lg_client *c, const struct lg_config *cfg,
+                        const uint8_t *images) {
+  int32_t logits[LG_MAX_BATCH][OUTPUT_SIZE];
+
+  if (c->ki)
+    return kerinfer_infer_batch(c->ki, images, cfg->batch, &logits[0][0],
+                                cfg->timeout_ms);
+  if (cfg->dispatcher)
+    return kerinfer_dispatch(cfg->dispatcher, images, cfg->batch,
+                             &logits[0][0]);
+
+  c->ctx.count = cfg->batch;
+  memcpy(c->ctx.input, images, (size_t)cfg->batch * INPUT_SIZE);
+
+  int ret = kerinfer_run_program(c->prog_fd, &c->ctx, sizeof(c->ctx));
+  if (ret < 0) {
+    fprintf(stderr, "Failed to run inference program: %s\n",
+            strerror(-ret));
+    return ret;
+  }
+  if (ret != MNIST_RUN_OK) {
+    fprintf(stderr, "Inference program returned %d\n", ret);
+    return -EIO;
+  }
+  return 0;
+}
+
+static void *worker_fn(void *arg) {
+  struct lg_worker *w = arg;
+  const struct lg_config *cfg = w->cfg;
+  uint8_t images[LG_MAX_BATCH * INPUT_SIZE];
+  struct lg_client client = {0};
+  cpu_set_t cpus;
+
+  // Best effort, like the loader's syscall benchmark workers
+  CPU_ZERO(&cpus);
+  CPU_SET(w->cpu, &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+  w->err = client_open(&client, cfg);
+  if (w->err)
+    return NULL;
+
+  __u64 interval_ns = cfg->qps > 0 ? (__u64)(1e9 / cfg->qps) : 0;
+  __u64 next_ns = now_ns();
+
+  while (!__atomic_load_n(&lg_stop, __ATOMIC_RELAXED)) {
+    next_batch(w, images);
+    // Open loop: latency counts from the scheduled send time, so time a
+    // request spends queued behind a slow one is not hidden
+    // (coordinated omission)
+    if (interval_ns) {
+      sleep_until_ns(next_ns);
+    } else {
+      next_ns = now_ns();
+    }
+
+    w->err = client_infer(&client, cfg, images);
+    if (w->err)
+      break;
+    hist_record(&w->hist, now_ns() - next_ns);
+    w->requests++;
+    w->images += cfg->batch;
+    next_ns += interval_ns;
+  }
+  client_close(&client);
+  return NULL;
+}
+
+// Every thread keeps its whole batch in flight, so the pinned slot maps need
+// a slot for each of them; kerinfer_infer_batch() fails rather than queue
+static int check_slots(const struct lg_config *cfg, long nr_threads) {
+  struct kerinfer *ki = kerinfer_open_pinned(cfg->pin_dir, 0);
+
+  if (!ki)
+    return -errno;
+  unsigned int nr_slots = kerinfer_nr_slots(ki);
+  kerinfer_close(ki);
+
+  if (nr_threads * cfg->batch > nr_slots) {
+    fprintf(stderr, "%ld thread(s) with batches of %u need %ld request "
+                    "slots, the maps have %u (loader --slots)\n",
+            nr_threads, cfg->batch, nr_threads * cfg->batch, nr_slots);
+    return -ENOSPC;
+  }
+  return 0;
+}
+
+static void print_report(const struct lg_config *cfg,
+                         const struct lg_worker *workers, int nr_workers,
+                         double elapsed_s) {
+  static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+  static struct latency_hist hist;
+  __u64 requests = 0, images = 0;
+
+  for (int i = 0; i < nr_workers; i++) {
+    hist_merge(&hist, &workers[i].hist);
+    requests += workers[i].requests;
+    images += workers[i].images;
+  }
+
+  printf("%llu requests (%llu images) in %.2f s: %.0f requests/s, "
+         "%.0f images/s\n",
+         (unsigned long long)requests, (unsigned long long)images, elapsed_s,
+         requests / elapsed_s, images / elapsed_s);
+  if (cfg->qps > 0)
+    printf("target rate %.0f requests/s\n", cfg->qps * nr_workers);
+  if (!hist.total)
+    return;
+
+  printf("latency (us): mean %.1f", hist.sum_ns / 1e3 / hist.total);
+  for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+    printf(", p%g %.1f", quantiles[i] * 100,
+           hist_quantile(&hist, quantiles[i]) / 1e3);
+  printf(", max %.1f\n", hist.max_ns / 1e3);
+
+  // Cumulative distribution, one row per non-empty bucket
+  printf("\n%12s %10s %12s\n", "value (us)", "percentile", "count");
+  __u64 seen = 0;
+  for (unsigned int b = 0; b < HIST_BUCKETS; b++) {
+    if (!hist.counts[b])
+      continue;
+    seen += hist.counts[b];
+    printf("%12.3f %10.6f %12llu\n", hist_bucket_max(b) / 1e3,
+           (double)seen / hist.total, (unsigned long long)seen);
+  }
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options] IMAGES\n"
+          "Classify the raw %d byte records of IMAGES through the pinned\n"
+          "inference objects and report throughput and latencies.\n"
+          "  -i, --interface NAME  tracepoint (map syscalls), mmap (mmap()ed\n"
+          "                    slots), run (BPF_PROG_RUN) or dispatch\n"
+          "                    (BPF_PROG_RUN on a pinned worker per CPU);\n"
+          "                    default tracepoint\n"
+          "  -j, --threads N   client threads, pinned round-robin to the CPUs\n"
+          "                    we may run on (default 1)\n"
+          "  -q, --qps RATE    open loop: send RATE requests/s in total\n"
+          "                    (default: closed loop, back to back)\n"
+          "  -w, --workers N   dispatch workers, pinned to the first N of the\n"
+          "                    CPUs we may run on (default: all of them)\n"
+          "  -b, --batch N     images per request: per BPF_PROG_RUN call or\n"
+          "                    dispatch, or slots in flight per thread\n"
+          "                    (default 1)\n"
+          "  -d, --duration S  run for S seconds (default %d)\n"
+          "  -t, --timeout-ms MS  per-request timeout of slot interfaces\n"
+          "                    (default %d)\n"
+          "  -B, --pin-dir DIR bpffs directory of the pins (default %s)\n"
+          "  -h, --help        show this help\n",
+          prog, INPUT_SIZE, DEFAULT_DURATION_S, DEFAULT_TIMEOUT_MS,
+          KERINFER_DEFAULT_PIN_DIR);
+}
+
+int main(int argc, char **argv) {
+  static const struct option long_options[] = {
+      {"interface", required_argument, NULL, 'i'},
+      {"threads", required_argument, NULL, 'j'},
+      {"workers", required_argument, NULL, 'w'},
+      {"qps", required_argument, NULL, 'q'},
+      {"batch", required_argument, NULL, 'b'},
+      {"duration", required_argument, NULL, 'd'},
+      {"timeout-ms", required_argument, NULL, 't'},
+      {"pin-dir", required_argument, NULL, 'B'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+  struct lg_config cfg = {
+      .interface = LG_TRACEPOINT,
+      .pin_dir = KERINFER_DEFAULT_PIN_DIR,
+      .batch = 1,
+      .timeout_ms = DEFAULT_TIMEOUT_MS,
+  };
+  long nr_threads = 1;
+  long nr_dispatch_workers = 0;
+  long duration_s = DEFAULT_DURATION_S;
+  long batch = 1;
+  double qps = 0;
+  char *end;
+  int opt;
+
+  while ((opt = getopt_long(argc, argv, "i:j:w:q:b:d:t:B:h", long_options,
+                            NULL)) != -1) {
+    switch (opt) {
+    case 'i':
+      for (cfg.interface = 0; cfg.interface < LG_NR_INTERFACES;
+           cfg.interface++) {
+        if (!strcmp(optarg, interface_names[cfg.interface]))
+          break;
+      }
+      if (cfg.interface == LG_NR_INTERFACES) {
+        fprintf(stderr, "Unknown interface '%s'\n", optarg);
+        return 1;
+      }
+      break;
+    case 'j':
+      nr_threads = strtol(optarg, &end, 10);
+      if (*end || nr_threads < 1 || nr_threads > CPU_SETSIZE) {
+        fprintf(stderr, "Invalid thread count '%s'\n", optarg);
+        return 1;
+      }
+      break;
+    case 'w':
+      nr_dispatch_workers = strtol(optarg, &end, 10);
+      if (*end || nr_dispatch_workers < 1 ||
+          nr_dispatch_workers > CPU_SETSIZE) {
+        fprintf(stderr, "Invalid worker count '%s'\n", optarg);
+        return 1;
+      }
+      break;
+    case 'q':
+      qps = strtod(optarg, &end);
+      if (*end || !(qps > 0)) {
+        fprintf(stderr, "Invalid rate '%s'\n", optarg);
+        return 1;
+      }
+      break;
+    case 'b':
+      batch = strtol(optarg, &end, 10);
+      if (*end || batch < 1) {
+        fprintf(stderr, "Invalid batch size '%s'\n", optarg);
+        return 1;
+      }
+      break;
+    case 'd':
+      duration_s = strtol(optarg, &end, 10);
+      if (*end || duration_s < 1) {
+        fprintf(stderr, "Invalid duration '%s'\n", optarg);
+        return 1;
+      }
+      break;
+    case 't':
+      cfg.timeout_ms = strtol(optarg, &end, 10);
+      if (*end || cfg.timeout_ms < 1) {
+        fprintf(stderr, "Invalid timeout '%s'\n", optarg);
+        return 1;
+      }
+      break;
+    case 'B':
+      cfg.pin_dir = optarg;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  long max_batch =
+      cfg.interface == LG_RUN ? MNIST_BATCH_SIZE : MNIST_MAX_SLOTS;
+  if (batch > max_batch) {
+    fprintf(stderr, "The %s interface takes batches of up to %ld images\n",
+            interface_names[cfg.interface], max_batch);
+    return 1;
+  }
+  cfg.batch = batch;
+  cfg.qps = qps / nr_threads;
+  if (cfg.interface != LG_RUN && cfg.interface != LG_DISPATCH &&
+      check_slots(&cfg, nr_threads))
+    return 1;
+
+  uint8_t *images;
+  if (kerinfer_read_records(argv[optind], INPUT_SIZE, &images,
+                            &cfg.nr_images))
+    return 1;
+  cfg.images = images;
+
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+    fprintf(stderr, "Failed to get the CPU affinity: %s\n", strerror(errno));
+    free(images);
+    return 1;
+  }
+  struct lg_worker *workers = calloc(nr_threads, sizeof(*workers));
+  if (!workers) {
+    fprintf(stderr, "Failed to allocate the workers\n");
+    free(images);
+    return 1;
+  }
+
+  // Dispatch requests are chunked by the kernel-side batch limit
+  int dispatch_prog_fd = -1;
+  if (cfg.interface == LG_DISPATCH) {
+    dispatch_prog_fd = open_run_program(cfg.pin_dir);
+    if (dispatch_prog_fd >= 0)
+      cfg.dispatcher = kerinfer_dispatcher_new(
+          dispatch_prog_fd, nr_dispatch_workers,
+          batch < MNIST_BATCH_SIZE ? batch : MNIST_BATCH_SIZE);
+    if (!cfg.dispatcher) {
+      if (dispatch_prog_fd >= 0)
+        close(dispatch_prog_fd);
+      free(workers);
+      free(images);
+      return 1;
+    }
+    printf("%u dispatch worker(s)\n",
+           kerinfer_dispatcher_nr_workers(cfg.dispatcher));
+  }
+
+  printf("%ld %s thread(s), %s, batch %u, %zu images from %s\n", nr_threads,
+         interface_names[cfg.interface],
+         qps > 0 ? "open loop" : "closed loop", cfg.batch, cfg.nr_images,
+         argv[optind]);
+
+  int nr_workers = 0, cpu = -1, err = 0;
+  __u64 t0 = now_ns();
+  for (; nr_workers < nr_threads; nr_workers++) {
+    do {
+      cpu = (cpu + 1) % CPU_SETSIZE;
+    } while (!CPU_ISSET(cpu, &allowed));
+
+    struct lg_worker *w = &workers[nr_workers];
+    w->cfg = &cfg;
+    w->cpu = cpu;
+    // Spread the threads over the file, so they do not all send the same
+    // image at the same time
+    w->next_image = (size_t)nr_workers * cfg.nr_images / nr_threads;
+    err = pthread_create(&w->thread, NULL, worker_fn, w);
+    if (err) {
+      fprintf(stderr, "Failed to start a worker: %s\n", strerror(err));
+      break;
+    }
+  }
+  if (!err)
+    sleep(duration_s);
+  __atomic_store_n(&lg_stop, 1, __ATOMIC_RELAXED);
+
+  for (int i = 0; i < nr_workers; i++) {
+    pthread_join(workers[i].thread, NULL);
+    if (workers[i].err) {
+      fprintf(stderr, "Worker on CPU %d failed: %s\n", workers[i].cpu,
+              strerror(-workers[i].err));
+      err = workers[i].err;
+    }
+  }
+  print_report(&cfg, workers, nr_workers, (now_ns() - t0) / 1e9);
+
+  kerinfer_dispatcher_free(cfg.dispatcher);
+  if (dispatch_prog_fd >= 0)
+    close(dispatch_prog_fd);
+  free(workers);
+  free(images);
+  return err ? 1 : 0;
+}
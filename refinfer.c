@@ -0,0 +1,288 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// refinfer.c
+// User-space reference engine (see refinfer.h). Every kernel computes the
+// same int32 dot products of uint8 activations and int8 weights: the order
+// of the additions differs, but modular sums do not depend on it, so all of
+// them match the BPF programs bit for bit.
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "refinfer.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define REFINFER_HAVE_X86 1
+#include <immintrin.h>
+#else
+#define REFINFER_HAVE_X86 0
+#endif
+
+// Dot product of one weight row with a layer's uint8 inputs (the pixels or
+// the previous layer's activations), modulo 2^32 like the BPF ALU
+typedef uint32_t (*dot_u8_fn)(const uint8_t *in, const int8_t *w, uint32_t n);
+
+struct kernel_ops {
+  const char *name;
+  dot_u8_fn dot_u8;
+};
+
+struct refinfer {
+  struct mnist_model_desc desc;
+  const struct kernel_ops *ops;
+  enum refinfer_kernel kernel;
+  uint8_t *blob;
+};
+
+static uint32_t dot_u8_scalar(const uint8_t *in, const int8_t *w,
+                              uint32_t n) {
+  uint32_t sum = 0;
+
+  for (uint32_t i = 0; i < n; i++)
+    sum += (uint32_t)(w[i] * in[i]);
+  return sum;
+}
+
+#if REFINFER_HAVE_X86
+__attribute__((target("avx2"))) static uint32_t hsum_avx2(__m256i v) {
+  __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v),
+                            _mm256_extracti128_si256(v, 1));
+
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+  return (uint32_t)_mm_cvtsi128_si32(s);
+}
+
+// vpmaddubsw would multiply the bytes directly, but it saturates each pair
+// of products to int16 (255 * 127 * 2 does not fit), so widen both operands
+// to int16 and use vpmaddwd, whose int32 pair sums are exact
+__attribute__((target("avx2"))) static uint32_t
+dot_u8_avx2(const uint8_t *in, const int8_t *w, uint32_t n) {
+  __m256i acc = _mm256_setzero_si256();
+  uint32_t i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    __m256i x =
+        _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(in + i)));
+    __m256i y =
+        _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(w + i)));
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(x, y));
+  }
+  return hsum_avx2(acc) + dot_u8_scalar(in + i, w + i, n - i);
+}
+
+// vpdpbusd adds four uint8 * int8 products into each int32 lane without
+// saturating; the tail of the row goes through masked loads
+__attribute__((target("avx512f,avx512bw,avx512vnni"))) static uint32_t
+dot_u8_vnni(const uint8_t *in, const int8_t *w, uint32_t n) {
+  __m512i acc = _mm512_setzero_si512();
+  uint32_t i = 0;
+
+  for (; i + 64 <= n; i += 64)
+    acc = _mm512_dpbusd_epi32(acc, _mm512_loadu_si512(in + i),
+                              _mm512_loadu_si512(w + i));
+  if (i < n) {
+    __mmask64 mask = (1ULL << (n - i)) - 1;
+    acc = _mm512_dpbusd_epi32(acc, _mm512_maskz_loadu_epi8(mask, in + i),
+                              _mm512_maskz_loadu_epi8(mask, w + i));
+  }
+  return (uint32_t)_mm512_reduce_add_epi32(acc);
+}
+#endif
+
+// Activations are requantized to uint8 after every layer, so all layers
+// share one kernel
+static const struct kernel_ops kernels[REFINFER_NR_KERNELS] = {
+    [REFINFER_KERNEL_AUTO] = {"auto"},
+    [REFINFER_KERNEL_SCALAR] = {"scalar", dot_u8_scalar},
+#if REFINFER_HAVE_X86
+    [REFINFER_KERNEL_AVX2] = {"avx2", dot_u8_avx2},
+    [REFINFER_KERNEL_VNNI] = {"vnni", dot_u8_vnni},
+#else
+    [REFINFER_KERNEL_AVX2] = {"avx2"},
+    [REFINFER_KERNEL_VNNI] = {"vnni"},
+#endif
+};
+
+const char *refinfer_kernel_name(enum refinfer_kernel kernel) {
+  return kernel < REFINFER_NR_KERNELS ? kernels[kernel].name : "unknown";
+}
+
+int refinfer_parse_kernel(const char *name, enum refinfer_kernel *kernel) {
+  for (int k = 0; k < REFINFER_NR_KERNELS; k++) {
+    if (!strcmp(name, kernels[k].name)) {
+      *kernel = k;
+      return 0;
+    }
+  }
+  return -EINVAL;
+}
+
+int refinfer_kernel_supported(enum refinfer_kernel kernel) {
+  if (kernel == REFINFER_KERNEL_AUTO)
+    return 1;
+  if (kernel >= REFINFER_NR_KERNELS || !kernels[kernel].dot_u8)
+    return 0;
+#if REFINFER_HAVE_X86
+  if (kernel == REFINFER_KERNEL_AVX2)
+    return __builtin_cpu_supports("avx2");
+  if (kernel == REFINFER_KERNEL_VNNI)
+    return __builtin_cpu_supports("avx2") &&
+           __builtin_cpu_supports("avx512bw") &&
+           __builtin_cpu_supports("avx512vnni");
+#endif
+  return 1;
+}
+
+int refinfer_set_kernel(struct refinfer *ri, enum refinfer_kernel kernel) {
+  if (!refinfer_kernel_supported(kernel))
+    return -EOPNOTSUPP;
+  if (kernel == REFINFER_KERNEL_AUTO) {
+    kernel = REFINFER_KERNEL_SCALAR;
+    for (int k = REFINFER_NR_KERNELS - 1; k > REFINFER_KERNEL_SCALAR; k--) {
+      if (refinfer_kernel_supported(k)) {
+        kernel = k;
+        break;
+      }
+    }
+  }
+  ri->kernel = kernel;
+  ri->ops = &kernels[kernel];
+  return 0;
+}
+
+enum refinfer_kernel refinfer_get_kernel(const struct refinfer *ri) {
+  return ri->kernel;
+}
+
+static int check_requant(const struct mnist_requant *rq) {
+  return rq->multiplier >= 0 && rq->shift >= 1 &&
+         rq->shift <= MNIST_MAX_REQUANT_SHIFT;
+}
+
+// The same checks as the loader's and bpf_mnist_infer_net's: every layer
+// chains from INPUT_SIZE to OUTPUT_SIZE and lies inside the blob, and its
+// requantization shifts are in range
+static int check_desc(const struct mnist_model_desc *desc, const void *blob) {
+  __u32 prev_dim = INPUT_SIZE;
+
+  if (desc->nr_layers == 0 || desc->nr_layers > MNIST_NET_MAX_LAYERS ||
+      desc->blob_size > MNIST_NET_MAX_BLOB_SIZE)
+    return -EINVAL;
+
+  for (__u32 l = 0; l < desc->nr_layers; l++) {
+    const struct mnist_layer_desc *ld = &desc->layers[l];
+    __u64 weights_end = ld->weight_off + (__u64)ld->in_dim * ld->out_dim;
+    __u64 bias_end = ld->bias_off + (__u64)ld->out_dim * sizeof(int32_t);
+    __u64 requant_end = ld->requant_off + MNIST_LAYER_REQUANT_SIZE(ld->out_dim);
+
+    if (ld->in_dim != prev_dim || ld->out_dim == 0 ||
+        ld->out_dim > MNIST_NET_MAX_DIM || ld->activation >= MNIST_NR_ACT ||
+        ld->bias_off % sizeof(int32_t) || weights_end > desc->blob_size ||
+        bias_end > desc->blob_size || ld->requant_off % sizeof(int32_t) ||
+        requant_end > desc->blob_size)
+      return -EINVAL;
+
+    const struct mnist_layer_requant *layer =
+        (const void *)((const uint8_t *)blob + ld->requant_off);
+    const struct mnist_requant *unit = (const void *)(layer + 1);
+    if (!check_requant(&layer->pos) || !check_requant(&layer->neg))
+      return -EINVAL;
+    for (__u32 j = 0; j < ld->out_dim; j++)
+      if (!check_requant(&unit[j]))
+        return -EINVAL;
+    prev_dim = ld->out_dim;
+  }
+  return prev_dim == OUTPUT_SIZE ? 0 : -EINVAL;
+}
+
+struct refinfer *refinfer_open(const struct mnist_model_desc *desc,
+                               const void *blob, enum refinfer_kernel kernel) {
+  struct refinfer *ri;
+  int err = check_desc(desc, blob);
+
+  if (err) {
+    errno = -err;
+    return NULL;
+  }
+  ri = calloc(1, sizeof(*ri));
+  if (!ri)
+    return NULL;
+  // malloc() alignment keeps the int32 biases and the requantization (at
+  // 4-byte offsets) aligned
+  ri->blob = malloc(desc->blob_size ? desc->blob_size : 1);
+  if (!ri->blob) {
+    free(ri);
+    return NULL;
+  }
+  ri->desc = *desc;
+  memcpy(ri->blob, blob, desc->blob_size);
+
+  err = refinfer_set_kernel(ri, kernel);
+  if (err) {
+    refinfer_close(ri);
+    errno = -err;
+    return NULL;
+  }
+  return ri;
+}
+
+void refinfer_close(struct refinfer *ri) {
+  if (!ri)
+    return;
+  free(ri->blob);
+  free(ri);
+}
+
+static uint8_t clamp_u8(int64_t x) {
+  return x < 0 ? 0 : x > 255 ? 255 : (uint8_t)x;
+}
+
+// requantize() of the BPF programs (see struct mnist_layer_requant)
+static uint8_t requantize(int32_t sum, const struct mnist_layer_requant *layer,
+                          const struct mnist_requant *unit, int leaky) {
+  if (!leaky)
+    return clamp_u8(layer->zero_point + MNIST_REQUANT(sum, *unit));
+
+  int32_t d = clamp_u8(layer->linear_zero_point + MNIST_REQUANT(sum, *unit)) -
+              layer->linear_zero_point;
+  return clamp_u8(layer->zero_point +
+                  MNIST_REQUANT(d, d >= 0 ? layer->pos : layer->neg));
+}
+
+static void infer_image(const struct refinfer *ri, const uint8_t *image,
+                        int32_t *logits) {
+  uint8_t act[2][MNIST_NET_MAX_DIM];
+  const uint8_t *in = image; // the first layer reads the image in place
+  __u32 src = 0;
+
+  for (__u32 l = 0; l < ri->desc.nr_layers; l++) {
+    const struct mnist_layer_desc *ld = &ri->desc.layers[l];
+    const int8_t *w = (const int8_t *)ri->blob + ld->weight_off;
+    const int32_t *bias = (const int32_t *)(ri->blob + ld->bias_off);
+    const struct mnist_layer_requant *layer =
+        (const void *)(ri->blob + ld->requant_off);
+    const struct mnist_requant *unit = (const void *)(layer + 1);
+    uint8_t *dst = act[src ^ 1];
+
+    for (__u32 j = 0; j < ld->out_dim; j++) {
+      const int8_t *row = w + (size_t)j * ld->in_dim;
+      uint32_t sum = (uint32_t)bias[j] + ri->ops->dot_u8(in, row, ld->in_dim);
+
+      dst[j] = requantize((int32_t)sum, layer, &unit[j],
+                          ld->activation == MNIST_ACT_LEAKY_RELU);
+    }
+    in = dst;
+    src ^= 1;
+  }
+  for (int o = 0; o < OUTPUT_SIZE; o++)
+    logits[o] = in[o];
+}
+
+void refinfer_infer(const struct refinfer *ri, const uint8_t *images,
+                    unsigned int count, int32_t *logits) {
+  for (unsigned int b = 0; b < count; b++)
+    infer_image(ri, images + (size_t)b * INPUT_SIZE,
+                logits + (size_t)b * OUTPUT_SIZE);
+}
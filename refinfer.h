@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// refinfer.h
+// User-space reference engine: runs a network described by a struct
+// mnist_model_desc and its blob with the exact integer semantics of the BPF
+// programs (wrapping int32 sums, fixed-point requantization to uint8), so
+// its logits are bit-identical to theirs. Serves as a correctness oracle for
+// the BPF variants and as a batch path for hosts where BPF is not available.
+
+#ifndef __REFINFER_H
+#define __REFINFER_H
+
+#include <stdint.h>
+
+#include "kerinferencel.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct refinfer;
+
+// Dot-product kernels, selected at run time. The x86 kernels only exist in
+// x86-64 builds, and only run if the CPU supports them.
+enum refinfer_kernel {
+  REFINFER_KERNEL_AUTO,   // the fastest one the CPU supports
+  REFINFER_KERNEL_SCALAR, // portable C
+  REFINFER_KERNEL_AVX2,   // vpmaddwd on widened pixels and weights
+  REFINFER_KERNEL_VNNI,   // AVX-512 VNNI vpdpbusd
+  REFINFER_NR_KERNELS,
+};
+
+// Returns NULL with errno set on failure. The descriptor and blob_size bytes
+// of blob are copied, so neither has to outlive the call.
+struct refinfer *refinfer_open(const struct mnist_model_desc *desc,
+                               const void *blob, enum refinfer_kernel kernel);
+void refinfer_close(struct refinfer *ri);
+
+// Kernel names as accepted by refinfer_parse_kernel(): "auto", "scalar",
+// "avx2", "vnni". Parsing returns -EINVAL for anything else.
+const char *refinfer_kernel_name(enum refinfer_kernel kernel);
+int refinfer_parse_kernel(const char *name, enum refinfer_kernel *kernel);
+
+int refinfer_kernel_supported(enum refinfer_kernel kernel);
+
+// Switch an open engine to another kernel; -EOPNOTSUPP if the CPU or the
+// build lacks it. refinfer_get_kernel() never returns REFINFER_KERNEL_AUTO.
+int refinfer_set_kernel(struct refinfer *ri, enum refinfer_kernel kernel);
+enum refinfer_kernel refinfer_get_kernel(const struct refinfer *ri);
+
+// Classify count images (count * INPUT_SIZE bytes) into count * OUTPUT_SIZE
+// logits. Safe to call from several threads at once.
+void refinfer_infer(const struct refinfer *ri, const uint8_t *images,
+                    unsigned int count, int32_t *logits);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __REFINFER_H
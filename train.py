@@ -3,14 +3,28 @@
 """ train.py - trains a model for ebpf inference """
 
 import argparse
+import math
+import struct
 import sys
+import zlib
 
 import numpy as np
 import torch
 import torch.ao.quantization as quant
-from torch.ao.quantization.observer import PerChannelMinMaxObserver, default_observer
+from torch.ao.quantization.observer import (
+    FixedQParamsObserver,
+    PerChannelMinMaxObserver,
+    default_observer,
+)
+from torch.ao.quantization.fake_quantize import (
+    FakeQuantize,
+    FixedQParamsFakeQuantize,
+    default_fake_quant,
+    default_per_channel_weight_fake_quant,
+)
 import torch.nn as nn
 import torch.nn.functional as F
+import torch.nn.utils.prune as prune
 import torch.optim as optim
 from torchvision import datasets, transforms
 
@@ -18,12 +32,14 @@ from torchvision import datasets, transforms
 class TinyPerceptron(nn.Module):
     """A tiny leaky-relu based single-layer perceptron"""
 
-    def __init__(self, negative_slope=0.01):
+    def __init__(
+        self, input_size=784, hidden_size=32, output_size=10, negative_slope=0.01
+    ):
         super().__init__()
         self.quant = quant.QuantStub()
-        self.fc1 = nn.Linear(784, 32)
+        self.fc1 = nn.Linear(input_size, hidden_size)
         self.leaky_relu = nn.LeakyReLU(negative_slope=negative_slope)
-        self.fc2 = nn.Linear(32, 10)
+        self.fc2 = nn.Linear(hidden_size, output_size)
         self.dequant = quant.DeQuantStub()
 
     def forward(self, x):
@@ -35,6 +51,28 @@ class TinyPerceptron(nn.Module):
         return x
 
 
+class MultiLayerPerceptron(nn.Module):
+    """a leaky-relu based perceptron with any number of hidden layers"""
+
+    def __init__(self, sizes, negative_slope=0.01):
+        super().__init__()
+        self.quant = quant.QuantStub()
+        self.layers = nn.ModuleList(
+            nn.Linear(n_in, n_out) for n_in, n_out in zip(sizes, sizes[1:])
+        )
+        self.leaky_relu = nn.LeakyReLU(negative_slope=negative_slope)
+        self.dequant = quant.DeQuantStub()
+
+    def forward(self, x):
+        x = self.quant(x)
+        for i, layer in enumerate(self.layers):
+            x = layer(x)
+            if i + 1 < len(self.layers):
+                x = self.leaky_relu(x)
+        x = self.dequant(x)
+        return x
+
+
 def parse_args(args):
     """parse command line arguments"""
 
@@ -44,11 +82,84 @@ def parse_args(args):
     argp.add_argument("--num-epochs", type=int, default=10)
     argp.add_argument("--learn-rate", type=float, default=1e-3)
     argp.add_argument("--input-size", type=int, default=784)
-    argp.add_argument("--hidden-size", type=int, default=32)
+    argp.add_argument(
+        "--hidden-size",
+        type=int,
+        default=32,
+        help="hidden layer width, up to 256 (make MODEL=FILE builds for it)",
+    )
     argp.add_argument("--output-size", type=int, default=10)
     argp.add_argument("--leaky-slope", type=float, default=1e-2)
+    argp.add_argument(
+        "--weight-block",
+        type=int,
+        default=0,
+        help="store hidden weights blocked by this many units (make LAYOUT=blocked BLOCK=N)",
+    )
+
+    argp.add_argument(
+        "--hidden-bits",
+        type=int,
+        choices=(8, 4),
+        default=8,
+        help="bits per hidden weight; 4 packs two per byte (make WEIGHTS=int4)",
+    )
+    argp.add_argument(
+        "--qat-epochs",
+        type=int,
+        default=2,
+        help="quantization-aware fine-tuning epochs for --hidden-bits 4",
+    )
+
+    argp.add_argument(
+        "--prune-blocks",
+        type=int,
+        default=0,
+        help="keep only this many blocks of PRUNE_BLOCK pixels per hidden unit "
+        "(make PRUNED=K)",
+    )
+    argp.add_argument(
+        "--prune-epochs",
+        type=int,
+        default=2,
+        help="fine-tuning epochs after --prune-blocks",
+    )
+
+    argp.add_argument(
+        "--net-layers",
+        type=str,
+        default="",
+        help="comma-separated hidden layer widths, e.g. 64,32, for a deeper "
+        "model run by loader --net (see NET_MAX_LAYERS)",
+    )
+
+    argp.add_argument(
+        "--output",
+        type=str,
+        default="mnist_model.bin",
+        help="model file to write (loader --model)",
+    )
+    argp.add_argument(
+        "--dump-test",
+        type=str,
+        default="",
+        metavar="PREFIX",
+        help="also write the test images to PREFIX.images, and their labels and "
+        "int8 model predictions to PREFIX.labels (loader --dataset PREFIX)",
+    )
 
-    return argp.parse_args(args)
+    params = argp.parse_args(args)
+    if params.net_layers and params.hidden_bits != 8:
+        argp.error("--net-layers only supports --hidden-bits 8")
+    if params.prune_blocks:
+        if not 1 <= params.prune_blocks <= params.input_size // PRUNE_BLOCK:
+            argp.error(
+                f"--prune-blocks must be between 1 and "
+                f"{params.input_size // PRUNE_BLOCK}"
+            )
+        if params.net_layers or params.hidden_bits != 8:
+            argp.error("--prune-blocks only supports two layers and --hidden-bits 8")
+    return params
 
 
 def train(model, device, train_loader, optimizer, epochs=5):
@@ -87,22 +198,392 @@ def evaluate(model, device, data_loader):
     return 100.0 * correct / total
 
 
-def export_quantized_parameters(model, prefix=""):
+def dump_test_set(model, dataset, data_loader, prefix):
+    """write the raw test images, then a label and the model's prediction
+    per image, in the order of the unshuffled data_loader"""
+
+    model.eval()
+    predictions = []
+    with torch.no_grad():
+        for data, _ in data_loader:
+            output = model(data.view(data.size(0), -1))
+            predictions.append(torch.argmax(output, 1))
+    labels = np.stack([dataset.targets.numpy(), torch.cat(predictions).numpy()], 1)
+
+    with open(f"{prefix}.images", "wb") as f:
+        f.write(dataset.data.numpy().astype(np.uint8).tobytes())
+    with open(f"{prefix}.labels", "wb") as f:
+        f.write(labels.astype(np.uint8).tobytes())
+    print(f"Wrote {len(labels)} test images to {prefix}.images and {prefix}.labels.")
+
+
+# Must match MNIST_MAX_HIDDEN_SHIFT
+INT4_MAX_SHIFT = 4
+
+
+class Int4ShiftObserver(PerChannelMinMaxObserver):
+    """per-channel symmetric int4 observer whose scales are the largest
+    channel's divided by 2**INT4_MAX_SHIFT, times a power of two: the eBPF
+    kernels apply them as a shift per hidden unit"""
+
+    def calculate_qparams(self):
+        scales, zero_points = super().calculate_qparams()
+        base = scales.max() / 2**INT4_MAX_SHIFT
+        shifts = torch.ceil(torch.log2(scales / base)).clamp(0, INT4_MAX_SHIFT)
+        return base * 2**shifts, torch.zeros_like(zero_points, dtype=torch.int64)
+
+
+int4_weight_fake_quant = FakeQuantize.with_args(
+    observer=Int4ShiftObserver,
+    quant_min=-8,
+    quant_max=7,
+    dtype=torch.qint8,
+    qscheme=torch.per_channel_symmetric,
+    ch_axis=0,
+)
+
+
+def int4_shifts(scales):
+    """per-unit shifts of Int4ShiftObserver scales"""
+
+    shifts = np.rint(np.log2(scales / (scales.max() / 2**INT4_MAX_SHIFT)))
+    return np.clip(shifts, 0, INT4_MAX_SHIFT).astype(np.uint8)
+
+
+def pack_int4_weights(weight, shifts):
+    """pack int4 weights, in the file's layout, two per byte (even index in
+    the low nibble), followed by one shift byte per hidden unit"""
+
+    nibbles = weight.astype(np.uint8).reshape(-1) & 0xF
+    return (nibbles[0::2] | nibbles[1::2] << 4).tobytes() + shifts.tobytes()
+
+
+# Pixels are used as they are: 1/255 is the input scale of ToTensor() images
+INPUT_QPARAMS = dict(scale=1.0 / 255, zero_point=0, dtype=torch.quint8)
+input_observer = FixedQParamsObserver.with_args(**INPUT_QPARAMS)
+input_fake_quant = FixedQParamsFakeQuantize.with_args(observer=input_observer)
+
+
+def block_hidden_weights(weight, block):
+    """interleave `block` hidden units per input pixel: [H/B][I][B]"""
+
+    hidden, inputs = weight.shape
+    if hidden % block:
+        raise ValueError(f"hidden size {hidden} is not a multiple of {block}")
+    return weight.reshape(hidden // block, block, inputs).transpose(0, 2, 1)
+
+
+def prune_hidden_blocks(model, blocks):
+    """keep the `blocks` runs of PRUNE_BLOCK pixels with the largest L1 norm
+    in each hidden unit's weights and mask out the rest; returns the kept
+    block indices of every unit, in ascending order"""
+
+    weight = model.fc1.weight.detach()
+    norms = weight.abs().reshape(weight.shape[0], -1, PRUNE_BLOCK).sum(2)
+    kept = norms.topk(blocks, dim=1).indices.sort(dim=1).values
+    mask = torch.zeros_like(norms).scatter_(1, kept, 1.0)
+    prune.custom_from_mask(
+        model.fc1, "weight", mask.repeat_interleave(PRUNE_BLOCK, dim=1)
+    )
+    return kept.cpu().numpy().astype(np.uint8)
+
+
+def pack_hidden_blocks(weight, kept):
+    """the kept block indices of every hidden unit, then their weights:
+    [H][K] followed by [H][K][PRUNE_BLOCK], from row-major weights"""
+
+    blocks = weight.reshape(weight.shape[0], -1, PRUNE_BLOCK)
+    rows = np.arange(weight.shape[0])[:, None]
+    return kept.tobytes() + blocks[rows, kept].astype(np.int8).tobytes()
+
+
+# Must match kerinferencel.h
+MODEL_MAGIC = 0x4C4E494B
+MODEL_VERSION = 3
+MODEL_ALIGN = 64
+LAYOUT_ROW_MAJOR = 0
+LAYOUT_BLOCKED = 1
+(
+    TENSOR_HIDDEN_WEIGHTS,
+    TENSOR_HIDDEN_BIAS,
+    TENSOR_OUTPUT_WEIGHTS,
+    TENSOR_OUTPUT_BIAS,
+    TENSOR_HIDDEN_SCALES,
+    TENSOR_OUTPUT_SCALES,
+    TENSOR_NET,
+    TENSOR_HIDDEN_REQUANT,
+    TENSOR_OUTPUT_REQUANT,
+    TENSOR_HIDDEN_BLOCKS,
+    NR_TENSORS,
+) = range(11)
+MODEL_HEADER_FORMAT = "<10I3f3i" + "QQ" * NR_TENSORS
+NET_MAX_LAYERS = 4
+ACT_NONE = 0
+ACT_LEAKY_RELU = 1
+MAX_REQUANT_SHIFT = 62
+REQUANT_LAYER = struct.Struct("<2i" + "iI" * 2)
+REQUANT_UNIT = struct.Struct("<iI")
+PRUNE_BLOCK = 8
+
+
+def write_model_file(
+    path,
+    tensors,
+    hidden_size,
+    layout=LAYOUT_ROW_MAJOR,
+    weight_block=0,
+    scales=(0.0, 0.0, 0.0),
+    zero_points=(0, 0, 0),
+    hidden_bits=8,
+    input_size=784,
+    output_size=10,
+):
+    """write the model file read by the loader: struct mnist_model_header,
+    then every tensor section on a MODEL_ALIGN boundary"""
+
+    header_size = struct.calcsize(MODEL_HEADER_FORMAT)
+    sections = [(0, 0)] * NR_TENSORS
+    payload = bytearray()
+    for index, data in sorted(tensors.items()):
+        payload += bytes(-(header_size + len(payload)) % MODEL_ALIGN)
+        sections[index] = (header_size + len(payload), len(data))
+        payload += data
+
+    def header(checksum):
+        return struct.pack(
+            MODEL_HEADER_FORMAT,
+            MODEL_MAGIC,
+            MODEL_VERSION,
+            header_size,
+            checksum,
+            input_size,
+            hidden_size,
+            output_size,
+            layout,
+            weight_block,
+            hidden_bits,
+            *scales,
+            *zero_points,
+            *[field for section in sections for field in section],
+        )
+
+    checksum = zlib.crc32(header(0) + payload)
+    with open(path, "wb") as f:
+        f.write(header(checksum))
+        f.write(payload)
+
+
+def weight_scales(layer):
+    """per-output-channel weight scales"""
+
+    return layer.weight().q_per_channel_scales().numpy().astype(np.float64)
+
+
+def qparams(module):
+    """(scale, zero point) of a quantized module's outputs"""
+
+    return float(module.scale), int(module.zero_point)
+
+
+def activation_qparams(model, layers):
+    """(scales, zero points) of the input, hidden and output activations"""
+
+    modules = [model.quant, model.leaky_relu, layers[-1]]
+    return (
+        tuple(qparams(module)[0] for module in modules),
+        tuple(qparams(module)[1] for module in modules),
+    )
+
+
+def fixed_point(real):
+    """(multiplier, shift) with multiplier * 2**-shift closest to real"""
+
+    if real == 0:
+        return 0, 31
+    frac, exp = math.frexp(real)
+    multiplier, shift = round(frac * 2**31), 31 - exp
+    if multiplier == 2**31:
+        multiplier, shift = multiplier // 2, shift - 1
+    if not 1 <= shift <= MAX_REQUANT_SHIFT:
+        raise ValueError(f"requantization multiplier {real} out of range")
+    return multiplier, shift
+
+
+def quantize_bias(layer, weight, sum_scales, input_zero_point):
+    """int32 biases in units of the layer's sums, with the input zero point
+    folded in. weight is [out][in], as the kernels multiply it."""
+
+    bias = layer.bias().detach().cpu().numpy().astype(np.float64)
+    bias = np.rint(bias / sum_scales)
+    bias -= input_zero_point * weight.astype(np.int64).sum(axis=1)
+    return np.clip(bias, -(2**31), 2**31 - 1).astype("<i4")
+
+
+def layer_requant(sum_scales, linear_qparams, act_qparams=None, negative_slope=0):
+    """struct mnist_layer_requant and the per-unit multipliers: from sums in
+    units of sum_scales to the linear outputs, then with act_qparams through
+    PyTorch's quantized LeakyReLU"""
+
+    linear_scale, linear_zero_point = linear_qparams
+    zero_point, pos, neg = linear_zero_point, 1.0, 1.0
+    if act_qparams:
+        act_scale, zero_point = act_qparams
+        pos = linear_scale / act_scale
+        neg = negative_slope * pos
+
+    data = REQUANT_LAYER.pack(
+        linear_zero_point, zero_point, *fixed_point(pos), *fixed_point(neg)
+    )
+    for scale in sum_scales:
+        data += REQUANT_UNIT.pack(*fixed_point(scale / linear_scale))
+    return data
+
+
+def quantize_layers(model, layers):
+    """(int8 weights, int32 biases, requantization, activation) of every
+    layer; all but the last are followed by the model's LeakyReLU"""
+
+    leaky = model.leaky_relu
+    input_qparams = qparams(model.quant)
+    quantized = []
+    for index, layer in enumerate(layers):
+        weight = layer.weight().int_repr().detach().cpu().numpy()
+        sum_scales = input_qparams[0] * weight_scales(layer)
+        bias = quantize_bias(layer, weight, sum_scales, input_qparams[1])
+        if index + 1 < len(layers):
+            act_qparams = qparams(leaky)
+            requant = layer_requant(
+                sum_scales, qparams(layer), act_qparams, leaky.negative_slope
+            )
+            quantized.append((weight, bias, requant, ACT_LEAKY_RELU))
+            input_qparams = act_qparams
+        else:
+            requant = layer_requant(sum_scales, qparams(layer))
+            quantized.append((weight, bias, requant, ACT_NONE))
+    return quantized
+
+
+def pack_net(model, layers):
+    """pack a generic network for loader --net: struct mnist_model_desc
+    followed by a blob of row-major int8 weights, then the 4-byte aligned
+    biases and requantization of every layer"""
+
+    if not 1 <= len(layers) <= NET_MAX_LAYERS:
+        raise ValueError(f"{len(layers)} layers, at most {NET_MAX_LAYERS} supported")
+
+    blob = bytearray()
+    quantized = quantize_layers(model, layers)
+
+    weight_offs = []
+    for weight, _, _, _ in quantized:
+        weight_offs.append(len(blob))
+        blob += weight.astype(np.int8).tobytes()
+    blob += bytes(-len(blob) % 4)
+
+    bias_offs = []
+    for _, bias, _, _ in quantized:
+        bias_offs.append(len(blob))
+        blob += bias.tobytes()
+
+    requant_offs = []
+    for _, _, requant, _ in quantized:
+        requant_offs.append(len(blob))
+        blob += requant
+
+    desc = struct.pack("<II", len(layers), len(blob))
+    for (weight, _, _, act), w_off, b_off, r_off in zip(
+        quantized, weight_offs, bias_offs, requant_offs
+    ):
+        n_out, n_in = weight.shape
+        desc += struct.pack("<6I", n_in, n_out, act, w_off, b_off, r_off)
+    desc += bytes(24 * (NET_MAX_LAYERS - len(layers)))
+    return desc + blob
+
+
+def export_quantized_parameters(
+    model, path="mnist_model.bin", weight_block=0, hidden_bits=8, kept_blocks=None
+):
     """save quantized model"""
 
     fc1 = model.fc1
     fc2 = model.fc2
+    leaky = model.leaky_relu
+    input_scale, input_zero_point = qparams(model.quant)
 
     fc1_weight = fc1.weight().int_repr().detach().cpu().numpy()
-    fc1_bias = fc1.bias().detach().cpu().numpy()  # should be int32
+    fc1_scales = weight_scales(fc1)
+    # The kernels compute int4 sums as if the weights were q << shift, so at
+    # the scale of a unit with shift 0
+    sum_weight, sum_scales = fc1_weight, fc1_scales
+    if hidden_bits == 4:
+        fc1_weight = np.clip(fc1_weight, -8, 7)
+        shifts = int4_shifts(fc1_scales)
+        sum_weight = fc1_weight.astype(np.int64) << shifts[:, None]
+        sum_scales = fc1_scales / 2.0**shifts
+    sum_scales = input_scale * sum_scales
+    fc1_bias = quantize_bias(fc1, sum_weight, sum_scales, input_zero_point)
+    fc1_requant = layer_requant(
+        sum_scales, qparams(fc1), qparams(leaky), leaky.negative_slope
+    )
+
+    act_scale, act_zero_point = qparams(leaky)
     fc2_weight = fc2.weight().int_repr().detach().cpu().numpy()
-    fc2_bias = fc2.bias().detach().cpu().numpy()  # should be int32
+    fc2_sum_scales = act_scale * weight_scales(fc2)
+    fc2_bias = quantize_bias(fc2, fc2_weight, fc2_sum_scales, act_zero_point)
+    fc2_requant = layer_requant(fc2_sum_scales, qparams(fc2))
+
+    tensors = {}
+    if kept_blocks is not None:
+        tensors[TENSOR_HIDDEN_BLOCKS] = pack_hidden_blocks(fc1_weight, kept_blocks)
+
+    layout = LAYOUT_ROW_MAJOR
+    if weight_block:
+        fc1_weight = np.ascontiguousarray(block_hidden_weights(fc1_weight, weight_block))
+        layout = LAYOUT_BLOCKED
+
+    fc1_data = fc1_weight.tobytes()
+    if hidden_bits == 4:
+        fc1_data = pack_int4_weights(fc1_weight, shifts)
+
+    scales, zero_points = activation_qparams(model, [fc1, fc2])
+    tensors.update(
+        {
+            TENSOR_HIDDEN_WEIGHTS: fc1_data,
+            TENSOR_HIDDEN_BIAS: fc1_bias.tobytes(),
+            TENSOR_OUTPUT_WEIGHTS: fc2_weight.tobytes(),
+            TENSOR_OUTPUT_BIAS: fc2_bias.tobytes(),
+            TENSOR_HIDDEN_SCALES: fc1_scales.astype(np.float32).tobytes(),
+            TENSOR_OUTPUT_SCALES: weight_scales(fc2).astype(np.float32).tobytes(),
+            TENSOR_HIDDEN_REQUANT: fc1_requant,
+            TENSOR_OUTPUT_REQUANT: fc2_requant,
+        }
+    )
+    write_model_file(
+        path,
+        tensors,
+        hidden_size=fc1.out_features,
+        layout=layout,
+        weight_block=weight_block,
+        scales=scales,
+        zero_points=zero_points,
+        hidden_bits=hidden_bits,
+    )
+    print(f"Exported quantized parameters for eBPF to {path}.")
+
 
-    fc1_weight.tofile(prefix + "hweights8.bin")
-    fc1_bias.tofile(prefix + "hbias32.bin")
-    fc2_weight.tofile(prefix + "outweights8.bin")
-    fc2_bias.tofile(prefix + "outbias32.bin")
-    print("Exported quantized parameters for eBPF.")
+def export_net(model, path="mnist_model.bin"):
+    """save a model with any number of layers, for loader --net only"""
+
+    layers = list(model.layers)
+    scales, zero_points = activation_qparams(model, layers)
+    write_model_file(
+        path,
+        {TENSOR_NET: pack_net(model, layers)},
+        hidden_size=0,
+        scales=scales,
+        zero_points=zero_points,
+    )
+    print(f"Exported {len(layers)}-layer network for eBPF to {path}.")
 
 
 def main(args):
@@ -126,7 +607,19 @@ def main(args):
         test_dataset, batch_size=params.batch_size, shuffle=False
     )
 
-    model_fp32 = TinyPerceptron(negative_slope=params.leaky_slope).to(device)
+    if params.net_layers:
+        widths = [int(width) for width in params.net_layers.split(",")]
+        model_fp32 = MultiLayerPerceptron(
+            [params.input_size] + widths + [params.output_size],
+            negative_slope=params.leaky_slope,
+        ).to(device)
+    else:
+        model_fp32 = TinyPerceptron(
+            input_size=params.input_size,
+            hidden_size=params.hidden_size,
+            output_size=params.output_size,
+            negative_slope=params.leaky_slope,
+        ).to(device)
     optimizer = optim.Adam(model_fp32.parameters(), lr=params.learn_rate)
 
     train(model_fp32, device, train_loader, optimizer, epochs=params.num_epochs)
@@ -136,6 +629,18 @@ def main(args):
         f"Float32 Model -> Train Accuracy: {train_acc:.2f}%, Test Accuracy: {test_acc:.2f}%"
     )
 
+    kept_blocks = None
+    if params.prune_blocks:
+        # Magnitude pruning, then fine-tuning with the pruned blocks held at
+        # zero to recover the accuracy lost
+        print(f"Pruning to {params.prune_blocks} blocks per hidden unit...")
+        kept_blocks = prune_hidden_blocks(model_fp32, params.prune_blocks)
+        optimizer = optim.Adam(model_fp32.parameters(), lr=params.learn_rate / 10)
+        train(model_fp32, device, train_loader, optimizer, epochs=params.prune_epochs)
+        prune.remove(model_fp32.fc1, "weight")
+        test_acc = evaluate(model_fp32, device, test_loader)
+        print(f"Pruned Model -> Test Accuracy: {test_acc:.2f}%")
+
     model_fp32.to("cpu")
     model_fp32.eval()
 
@@ -146,24 +651,59 @@ def main(args):
         ),
     )
     model_fp32.qconfig = symmetric_qconfig
+    model_fp32.quant.qconfig = torch.ao.quantization.QConfig(
+        activation=input_observer, weight=symmetric_qconfig.weight
+    )
 
-    print("Preparing model for static quantization...")
-    model_prepared = quant.prepare(model_fp32, inplace=False)
-
-    with torch.no_grad():
-        for i, (data, _) in enumerate(train_loader):
-            data = data.to("cpu")
-            data = data.view(data.size(0), -1)
-            model_prepared(data)
-            if i >= 10:
-                break
+    if params.hidden_bits == 4:
+        # Four bits lose too much for post-training quantization alone, so
+        # fine-tune with int4 fake quantization on the hidden layer
+        print("Preparing model for int4 quantization-aware training...")
+        model_fp32.qconfig = torch.ao.quantization.QConfig(
+            activation=default_fake_quant,
+            weight=default_per_channel_weight_fake_quant,
+        )
+        model_fp32.fc1.qconfig = torch.ao.quantization.QConfig(
+            activation=default_fake_quant, weight=int4_weight_fake_quant
+        )
+        model_fp32.quant.qconfig = torch.ao.quantization.QConfig(
+            activation=input_fake_quant,
+            weight=default_per_channel_weight_fake_quant,
+        )
+        model_fp32.train()
+        model_prepared = quant.prepare_qat(model_fp32, inplace=False)
+        optimizer = optim.Adam(model_prepared.parameters(), lr=params.learn_rate / 10)
+        train(model_prepared, "cpu", train_loader, optimizer, epochs=params.qat_epochs)
+        model_prepared.eval()
+    else:
+        print("Preparing model for static quantization...")
+        model_prepared = quant.prepare(model_fp32, inplace=False)
+
+        with torch.no_grad():
+            for i, (data, _) in enumerate(train_loader):
+                data = data.to("cpu")
+                data = data.view(data.size(0), -1)
+                model_prepared(data)
+                if i >= 10:
+                    break
 
     model_int8 = quant.convert(model_prepared, inplace=False)
     model_int8.to("cpu")
     test_acc_int8 = evaluate(model_int8, torch.device("cpu"), test_loader)
     print(f"Quantized Model -> Test Accuracy: {test_acc_int8:.2f}%")
 
-    export_quantized_parameters(model_int8, prefix="")
+    if params.net_layers:
+        export_net(model_int8, path=params.output)
+    else:
+        export_quantized_parameters(
+            model_int8,
+            path=params.output,
+            weight_block=params.weight_block,
+            hidden_bits=params.hidden_bits,
+            kept_blocks=kept_blocks,
+        )
+    if params.dump_test:
+        dump_test_set(model_int8, test_dataset, test_loader, params.dump_test)
 
 
 if __name__ == "__main__":